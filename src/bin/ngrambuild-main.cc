@@ -0,0 +1,149 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Makes a normalized n-gram model from an input fst archive (FAR) or text
+// file, optionally shrinking it, without intermediate count files.
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <fst/log.h>
+#include <fst/extensions/far/far.h>
+#include <fst/vector-fst.h>
+#include <ngram/ngram-build.h>
+#include <ngram/ngram-shrink.h>
+
+DECLARE_int64(order);
+
+// For counting:
+DECLARE_string(input_format);
+DECLARE_string(symbols);
+DECLARE_string(OOV_symbol);
+DECLARE_bool(epsilon_as_backoff);
+DECLARE_double(add_to_symbol_unigram_count);
+DECLARE_int32(threads);
+DECLARE_int64(max_memory);
+DECLARE_bool(compact_counts);
+
+// For making:
+DECLARE_string(method);
+DECLARE_double(witten_bell_k);
+DECLARE_double(discount_D);
+DECLARE_bool(backoff);
+DECLARE_bool(interpolate);
+DECLARE_int64(bins);
+
+// For shrinking:
+DECLARE_string(shrink_method);
+DECLARE_double(total_unigram_count);
+DECLARE_double(theta);
+DECLARE_int64(target_number_of_ngrams);
+DECLARE_int32(min_order_to_prune);
+DECLARE_string(count_pattern);
+DECLARE_string(context_pattern);
+DECLARE_int32(shrink_opt);
+
+DECLARE_int64(backoff_label);
+DECLARE_double(norm_eps);
+DECLARE_bool(check_consistency);
+
+int ngrambuild_main(int argc, char **argv) {
+  std::string usage = "Make n-gram model from input file.\n\n  Usage: ";
+  usage += argv[0];
+  usage += " [--options] [in.far|in.txt [out.fst]]\n";
+  std::set_new_handler(FailedNewHandler);
+  SET_FLAGS(usage.c_str(), &argc, &argv, true);
+
+  if (argc > 3) {
+    ShowUsage();
+    return 1;
+  }
+
+  std::string in_name =
+      (argc > 1 && (strcmp(argv[1], "-") != 0)) ? argv[1] : "";
+  std::string out_name =
+      (argc > 2 && (strcmp(argv[2], "-") != 0)) ? argv[2] : "";
+
+  if (FLAGS_max_memory < 0) {
+    LOG(ERROR) << argv[0] << ": --max_memory must be non-negative";
+    return 1;
+  }
+
+  ngram::NGramCountOptions count_options;
+  count_options.epsilon_as_backoff = FLAGS_epsilon_as_backoff;
+  count_options.add_to_symbol_unigram_count =
+      FLAGS_add_to_symbol_unigram_count;
+  count_options.threads = FLAGS_threads;
+  count_options.max_memory = FLAGS_max_memory << 20;
+  count_options.oov_symbol = FLAGS_OOV_symbol;
+  count_options.compact = FLAGS_compact_counts;
+
+  fst::StdVectorFst fst;
+  bool model_made = false;
+  if (FLAGS_input_format == "far") {
+    std::unique_ptr<fst::FarReader<fst::StdArc>> far_reader(
+        fst::FarReader<fst::StdArc>::Open(in_name));
+    if (!far_reader) {
+      LOG(ERROR) << "ngrambuild: open of FST archive failed: " << in_name;
+      return 1;
+    }
+    model_made = ngram::NGramBuildModel(
+        far_reader.get(), &fst, FLAGS_order, count_options, FLAGS_method,
+        FLAGS_backoff, FLAGS_interpolate, FLAGS_bins, FLAGS_witten_bell_k,
+        FLAGS_discount_D, FLAGS_backoff_label, FLAGS_norm_eps,
+        FLAGS_check_consistency);
+  } else if (FLAGS_input_format == "text") {
+    if (FLAGS_symbols.empty()) {
+      LOG(ERROR) << "ngrambuild: text input requires --symbols";
+      return 1;
+    }
+    if (FLAGS_threads != 1) {
+      LOG(ERROR) << "ngrambuild: text input is counted by a single thread; "
+                 << "--threads is for FAR input";
+      return 1;
+    }
+    std::unique_ptr<fst::SymbolTable> syms(
+        fst::SymbolTable::ReadText(FLAGS_symbols));
+    if (!syms) return 1;
+    std::ifstream ifstrm;
+    if (!in_name.empty()) {
+      ifstrm.open(in_name);
+      if (!ifstrm) {
+        LOG(ERROR) << "ngrambuild: open of text file failed: " << in_name;
+        return 1;
+      }
+    }
+    std::istream &istrm = ifstrm.is_open() ? ifstrm : std::cin;
+    model_made = ngram::NGramBuildModelFromText(
+        istrm, *syms, &fst, FLAGS_order, count_options, FLAGS_method,
+        FLAGS_backoff, FLAGS_interpolate, FLAGS_bins, FLAGS_witten_bell_k,
+        FLAGS_discount_D, FLAGS_backoff_label, FLAGS_norm_eps,
+        FLAGS_check_consistency);
+  } else {
+    LOG(ERROR) << argv[0] << ": bad input format: " << FLAGS_input_format;
+    return 1;
+  }
+
+  if (model_made && !FLAGS_shrink_method.empty()) {
+    model_made = ngram::NGramShrinkModel(
+        &fst, FLAGS_shrink_method, FLAGS_total_unigram_count, FLAGS_theta,
+        FLAGS_target_number_of_ngrams, FLAGS_min_order_to_prune,
+        FLAGS_count_pattern, FLAGS_context_pattern, FLAGS_shrink_opt,
+        FLAGS_backoff_label, FLAGS_norm_eps, FLAGS_check_consistency);
+  }
+  if (model_made) fst.Write(out_name);
+  return !model_made;
+}
@@ -0,0 +1,79 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+#include <fst/flags.h>
+#include <ngram/ngram-model.h>
+
+DEFINE_int64(order, 3, "Set maximal order of ngrams to be counted");
+
+// For counting:
+DEFINE_string(input_format, "far",
+              "One of: \"far\" (archive of FSTs), \"text\" (one sentence per "
+              "line)");
+DEFINE_string(symbols, "", "Symbol table file, required for text input");
+DEFINE_string(OOV_symbol, "",
+              "Existing symbol to which words of the text input that are not "
+              "in the symbol table are mapped; if empty, sentences with such "
+              "words are skipped");
+DEFINE_bool(epsilon_as_backoff, false,
+            "Treat epsilon in the input Fsts as backoff");
+DEFINE_double(
+    add_to_symbol_unigram_count, 0.0,
+    "Adds this amount to the unigram count of each word in the symbol table");
+DEFINE_int32(threads, 1,
+             "Number of threads used for counting (FAR input only)");
+DEFINE_int64(max_memory, 0,
+             "Approximate memory budget in MB for in-memory counts, beyond "
+             "which counts are spilled to disk (0: unlimited); with "
+             "--threads, it may be exceeded by about a quarter while the "
+             "counts of each batch are merged");
+DEFINE_bool(compact_counts, false,
+            "Store in-memory counts with 32-bit IDs, using less memory "
+            "(at most 2^32 - 1 n-grams and order 255)");
+
+// For making:
+DEFINE_string(method, "katz",
+              "One of: \"absolute\", \"katz\", \"kneser_ney\", "
+              "\"presmoothed\", \"unsmoothed\", \"witten_bell\"");
+DEFINE_double(witten_bell_k, 1, "Witten-Bell hyperparameter K");
+DEFINE_double(discount_D, -1, "Absolute discount value D to use");
+DEFINE_bool(backoff, false,
+            "Use backoff smoothing (default: method dependent)");
+DEFINE_bool(interpolate, false,
+            "Use interpolated smoothing (default: method dependent)");
+DEFINE_int64(bins, -1, "Number of bins for katz or absolute discounting");
+
+// For shrinking:
+DEFINE_string(shrink_method, "",
+              "One of: \"\" (no shrinking), \"context_prune\", "
+              "\"count_prune\", \"relative_entropy\", \"seymore\"");
+DEFINE_double(total_unigram_count, -1.0, "Total unigram count");
+DEFINE_double(theta, 0.0, "Pruning threshold theta");
+DEFINE_int64(target_number_of_ngrams, -1,
+             "Maximum number of ngrams to leave in model after pruning. "
+             "Value less than zero means no target number, just use theta.");
+DEFINE_int32(min_order_to_prune, 2, "Minimum n-gram order to prune");
+DEFINE_string(count_pattern, "", "Pattern of counts to prune");
+DEFINE_string(context_pattern, "", "Pattern of contexts to prune");
+DEFINE_int32(shrink_opt, 0,
+             "Optimization level: Range 0 (fastest) to 2 (most accurate)");
+
+DEFINE_int64(backoff_label, 0, "Backoff label");
+DEFINE_double(norm_eps, ngram::kNormEps, "Normalization check epsilon");
+DEFINE_bool(check_consistency, false, "Check model consistency");
+
+int ngrambuild_main(int argc, char** argv);
+int main(int argc, char** argv) {
+  return ngrambuild_main(argc, argv);
+}
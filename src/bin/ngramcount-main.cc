@@ -12,8 +12,9 @@
 // limitations under the License.
 //
 // Copyright 2005-2016 Brian Roark and Google, Inc.
-// Counts n-grams from an input fst archive (FAR) file.
+// Counts n-grams from an input fst archive (FAR) or text file.
 
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -36,6 +37,21 @@ DECLARE_bool(round_to_int);
 DECLARE_bool(output_fst);
 DECLARE_bool(require_symbols);
 DECLARE_double(add_to_symbol_unigram_count);
+DECLARE_int32(threads);
+DECLARE_int64(max_memory);
+DECLARE_bool(compact_counts);
+DECLARE_bool(defer_backoff_counts);
+DECLARE_bool(real_counts);
+DECLARE_bool(suffix_array);
+DECLARE_string(resume_from);
+DECLARE_string(save_snapshot);
+DECLARE_string(min_counts);
+DECLARE_int64(min_count_sketch_size);
+DECLARE_string(count_of_counts);
+DECLARE_string(input_format);
+DECLARE_string(symbols);
+DECLARE_string(OOV_symbol);
+DECLARE_string(vocab);
 
 // For counting and histograms:
 DECLARE_bool(epsilon_as_backoff);
@@ -51,10 +67,32 @@ DECLARE_int64(backoff_label);
 DECLARE_double(norm_eps);
 DECLARE_bool(check_consistency);
 
+namespace {
+
+// Parses comma-separated minimum counts.
+bool ParseMinCounts(const std::string &str, std::vector<double> *min_counts) {
+  std::vector<char> line(str.begin(), str.end());
+  line.push_back('\0');
+  std::vector<char *> fields;
+  fst::SplitString(line.data(), ",", &fields, true);
+  for (const char *field : fields) {
+    char *end = nullptr;
+    double min_count = strtod(field, &end);
+    if (*end != '\0' || min_count < 0.0) {
+      LOG(ERROR) << "ngramcount: bad minimum count: " << field;
+      return false;
+    }
+    min_counts->push_back(min_count);
+  }
+  return true;
+}
+
+}  // namespace
+
 int ngramcount_main(int argc, char **argv) {
   std::string usage = "Count n-grams from input file.\n\n  Usage: ";
   usage += argv[0];
-  usage += " [--options] [in.far [out.fst]]\n";
+  usage += " [--options] [in.far|in.txt [out.fst]]\n";
   std::set_new_handler(FailedNewHandler);
   SET_FLAGS(usage.c_str(), &argc, &argv, true);
 
@@ -68,26 +106,110 @@ int ngramcount_main(int argc, char **argv) {
   std::string out_name =
       (argc > 2 && (strcmp(argv[2], "-") != 0)) ? argv[2] : "";
 
+  if (FLAGS_max_memory < 0 || FLAGS_min_count_sketch_size < 0) {
+    LOG(ERROR) << argv[0] << ": --max_memory and --min_count_sketch_size "
+               << "must be non-negative";
+    return 1;
+  }
+
   bool ngrams_counted = false;
   if (FLAGS_method == "counts") {
-    std::unique_ptr<fst::FarReader<fst::StdArc>> far_reader(
-        fst::FarReader<fst::StdArc>::Open(in_name));
-    if (!far_reader) {
-      LOG(ERROR) << "ngramcount: open of FST archive failed: " << in_name;
+    ngram::NGramCountOptions options;
+    if (!ParseMinCounts(FLAGS_min_counts, &options.min_counts)) return 1;
+    options.require_symbols = FLAGS_require_symbols;
+    options.epsilon_as_backoff = FLAGS_epsilon_as_backoff;
+    options.round_to_int = FLAGS_round_to_int;
+    options.add_to_symbol_unigram_count = FLAGS_add_to_symbol_unigram_count;
+    options.threads = FLAGS_threads;
+    options.max_memory = FLAGS_max_memory << 20;
+    options.oov_symbol = FLAGS_OOV_symbol;
+    options.compact = FLAGS_compact_counts;
+    options.defer_backoff_counts = FLAGS_defer_backoff_counts;
+    options.real_counts = FLAGS_real_counts;
+    options.suffix_array = FLAGS_suffix_array;
+    options.resume_from = FLAGS_resume_from;
+    options.save_snapshot = FLAGS_save_snapshot;
+    options.sketch_memory = FLAGS_min_count_sketch_size << 20;
+    std::unique_ptr<fst::FarReader<fst::StdArc>> far_reader;
+    std::unique_ptr<fst::SymbolTable> syms;
+    std::unique_ptr<fst::SymbolTable> vocab;
+    std::ifstream ifstrm;
+    if (FLAGS_input_format == "far") {
+      far_reader.reset(fst::FarReader<fst::StdArc>::Open(in_name));
+      if (!far_reader) {
+        LOG(ERROR) << "ngramcount: open of FST archive failed: " << in_name;
+        return 1;
+      }
+      if (!FLAGS_vocab.empty()) {
+        if (FLAGS_OOV_symbol.empty()) {
+          LOG(ERROR) << "ngramcount: --vocab requires --OOV_symbol";
+          return 1;
+        }
+        vocab.reset(fst::SymbolTable::ReadText(FLAGS_vocab));
+        if (!vocab) return 1;
+        options.vocab = vocab.get();
+      }
+    } else if (FLAGS_input_format == "text") {
+      if (FLAGS_symbols.empty()) {
+        LOG(ERROR) << "ngramcount: text input requires --symbols";
+        return 1;
+      }
+      if (!FLAGS_vocab.empty()) {
+        LOG(ERROR) << "ngramcount: text input is restricted to --symbols; "
+                   << "--vocab is for FAR input";
+        return 1;
+      }
+      if (FLAGS_threads != 1) {
+        LOG(ERROR) << "ngramcount: text input is counted by a single "
+                   << "thread; --threads is for FAR input";
+        return 1;
+      }
+      syms.reset(fst::SymbolTable::ReadText(FLAGS_symbols));
+      if (!syms) return 1;
+      if (!in_name.empty()) {
+        ifstrm.open(in_name);
+        if (!ifstrm) {
+          LOG(ERROR) << "ngramcount: open of text file failed: " << in_name;
+          return 1;
+        }
+      }
+    } else {
+      LOG(ERROR) << argv[0] << ": bad input format: " << FLAGS_input_format;
       return 1;
     }
+    std::istream &istrm = ifstrm.is_open() ? ifstrm : std::cin;
     if (FLAGS_output_fst) {
       fst::StdVectorFst fst;
-      ngrams_counted = ngram::GetNGramCounts(
-          far_reader.get(), &fst, FLAGS_order, FLAGS_require_symbols,
-          FLAGS_epsilon_as_backoff, FLAGS_round_to_int,
-          FLAGS_add_to_symbol_unigram_count);
-      if (ngrams_counted) fst.Write(out_name);
+      std::unique_ptr<ngram::NGramCountOfCounts<fst::StdArc>> count_of_counts;
+      if (!FLAGS_count_of_counts.empty()) {
+        count_of_counts.reset(new ngram::NGramCountOfCounts<fst::StdArc>(
+            FLAGS_context_pattern, FLAGS_order));
+        options.count_of_counts = count_of_counts.get();
+      }
+      if (far_reader) {
+        ngrams_counted =
+            ngram::GetNGramCounts(far_reader.get(), &fst, FLAGS_order, options);
+      } else {
+        ngrams_counted = ngram::GetNGramCountsFromText(istrm, *syms, &fst,
+                                                       FLAGS_order, options);
+      }
+      if (ngrams_counted) {
+        fst.Write(out_name);
+        if (count_of_counts) {
+          fst::StdVectorFst ccfst;
+          count_of_counts->GetFst(&ccfst);
+          ngrams_counted = ccfst.Write(FLAGS_count_of_counts);
+        }
+      }
     } else {
-      std::vector<std::string> ngram_counts;
-      ngrams_counted = ngram::GetNGramCounts(
-          far_reader.get(), &ngram_counts, FLAGS_order,
-          FLAGS_epsilon_as_backoff, FLAGS_add_to_symbol_unigram_count);
+      if (FLAGS_max_memory > 0 || FLAGS_suffix_array ||
+          !FLAGS_resume_from.empty() || !FLAGS_save_snapshot.empty() ||
+          !options.min_counts.empty() || !FLAGS_count_of_counts.empty()) {
+        LOG(ERROR) << argv[0] << ": --max_memory, --suffix_array, "
+                   << "--resume_from, --save_snapshot, --min_counts and "
+                   << "--count_of_counts require fst output";
+        return 1;
+      }
       std::ofstream ofstrm;
       if (!out_name.empty()) {
         ofstrm.open(out_name);
@@ -97,8 +219,13 @@ int ngramcount_main(int argc, char **argv) {
         }
       }
       std::ostream &ostrm = ofstrm.is_open() ? ofstrm : std::cout;
-      for (size_t i = 0; i < ngram_counts.size(); ++i)
-        ostrm << ngram_counts[i] << std::endl;
+      if (far_reader) {
+        ngrams_counted = ngram::GetNGramCounts(far_reader.get(), &ostrm,
+                                               FLAGS_order, options);
+      } else {
+        ngrams_counted = ngram::GetNGramCountsFromText(istrm, *syms, &ostrm,
+                                                       FLAGS_order, options);
+      }
     }
   } else if (FLAGS_method == "histograms") {
     std::unique_ptr<fst::FarReader<fst::StdArc>> far_reader(
@@ -111,7 +238,7 @@ int ngramcount_main(int argc, char **argv) {
     ngrams_counted = ngram::GetNGramHistograms(
         far_reader.get(), &fst, FLAGS_order, FLAGS_epsilon_as_backoff,
         FLAGS_backoff_label, FLAGS_norm_eps, FLAGS_check_consistency,
-        FLAGS_normalize, FLAGS_alpha, FLAGS_beta);
+        FLAGS_normalize, FLAGS_alpha, FLAGS_beta, FLAGS_threads);
     if (ngrams_counted) fst.Write(out_name);
   } else if (FLAGS_method == "count_of_counts" ||
              FLAGS_method == "count_of_histograms") {
@@ -21,12 +21,62 @@ DEFINE_string(method, "counts",
 DEFINE_int64(order, 3, "Set maximal order of ngrams to be counted");
 
 // For counting:
+DEFINE_string(input_format, "far",
+              "One of: \"far\" (archive of FSTs), \"text\" (one sentence per "
+              "line)");
+DEFINE_string(symbols, "", "Symbol table file, required for text input");
+DEFINE_string(OOV_symbol, "",
+              "Existing symbol to which words of the text input that are not "
+              "in the symbol table, or words of the FAR input that are not in "
+              "--vocab, are mapped; required with --vocab; if empty, "
+              "sentences of the text input with such words are skipped");
+DEFINE_string(vocab, "",
+              "Symbol table file of the vocabulary to which the labels of the "
+              "FAR input are mapped before counting; requires --OOV_symbol");
 DEFINE_bool(round_to_int, false, "Round all counts to integers");
 DEFINE_bool(output_fst, true, "Output counts as fst (otherwise strings)");
 DEFINE_bool(require_symbols, true, "Require symbol tables? (default: yes)");
 DEFINE_double(
     add_to_symbol_unigram_count, 0.0,
     "Adds this amount to the unigram count of each word in the symbol table");
+DEFINE_int32(threads, 1,
+             "Number of threads used for counting (FAR input only)");
+DEFINE_int64(max_memory, 0,
+             "Approximate memory budget in MB for in-memory counts, beyond "
+             "which counts are spilled to disk (0: unlimited; fst output "
+             "only); with --threads, it may be exceeded by about a quarter "
+             "while the counts of each batch are merged");
+DEFINE_bool(compact_counts, false,
+            "Store in-memory counts with 32-bit IDs, using less memory "
+            "(at most 2^32 - 1 n-grams and order 255)");
+DEFINE_bool(defer_backoff_counts, false,
+            "Only count the highest-order n-gram at each position, deriving "
+            "lower-order counts in a single pass after counting");
+DEFINE_bool(real_counts, false,
+            "Sum in-memory counts as plain numbers rather than in the log "
+            "semiring");
+DEFINE_bool(suffix_array, false,
+            "Count string input with a suffix array of the input tokens, "
+            "for high orders (fst output only)");
+DEFINE_string(resume_from, "",
+              "Snapshot of counts, saved with --save_snapshot, to resume "
+              "counting from (fst output only)");
+DEFINE_string(save_snapshot, "",
+              "File to save a snapshot of the counts to, from which counting "
+              "can be resumed (fst output only)");
+DEFINE_string(min_counts, "",
+              "Comma-separated minimum counts per order, starting with "
+              "unigrams, the last one applying to higher orders; rarer "
+              "n-grams of order > 1 are not counted, as by count pruning "
+              "(fst output from strings only); with --threads, --max_memory "
+              "or snapshots, all are counted and the result count pruned");
+DEFINE_int64(min_count_sketch_size, 64,
+             "Memory in MB of the sketch estimating the counts of n-grams "
+             "below their minimum count");
+DEFINE_string(count_of_counts, "",
+              "File to also write the count-of-counts to, as computed by "
+              "--method=count_of_counts, with --context_pattern (fst output "
+              "only)");
 
 // For counting and histograms:
 DEFINE_bool(epsilon_as_backoff, false,
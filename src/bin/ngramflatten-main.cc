@@ -0,0 +1,58 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Converts an n-gram model into the flat format mapped by ngramperplexity.
+
+#include <memory>
+#include <string>
+
+#include <fst/flags.h>
+#include <fst/mutable-fst.h>
+#include <ngram/ngram-flat-model.h>
+#include <ngram/ngram-output.h>
+#include <ngram/util.h>
+
+DECLARE_string(OOV_symbol);
+DECLARE_double(OOV_class_size);
+DECLARE_double(OOV_probability);
+
+int ngramflatten_main(int argc, char **argv) {
+  std::string usage =
+      "Converts n-gram model into a flat model file.\n\n  Usage: ";
+  usage += argv[0];
+  usage += " [--options] in.fst out.flat\n";
+  std::set_new_handler(FailedNewHandler);
+  SET_FLAGS(usage.c_str(), &argc, &argv, true);
+
+  if (argc != 3) {
+    ShowUsage();
+    return 1;
+  }
+
+  std::string in_name = strcmp(argv[1], "-") != 0 ? argv[1] : "";
+  std::string out_name = argv[2];
+
+  std::unique_ptr<fst::StdMutableFst> fst(
+      fst::StdMutableFst::Read(in_name, true));
+  if (!fst) return 1;
+
+  ngram::NGramOutput ngram(fst.get());
+  if (ngram.Error()) return 1;
+  // The unigram state is renormalized for OOVs before converting, as
+  // ngramperplexity does, since a flat model can't be modified.
+  std::unique_ptr<ngram::StdNGramFlatModel> flat_model(ngram.GetFlatModel(
+      &FLAGS_OOV_symbol, FLAGS_OOV_class_size, FLAGS_OOV_probability));
+  if (!flat_model) return 1;
+  return !flat_model->Write(out_name);
+}
@@ -26,6 +26,7 @@ OOV_SYMBOL=""
 ORDER=3
 EPSILON_AS_BACKOFF=false
 ROUND_TO_INT=false
+THREADS=1
 
 # (3) FST counts -> LM flags
 BINS=-1
@@ -80,6 +81,8 @@ while [[ $# != 0 ]]; do
       OOV_SYMBOL="${ARG}" ;;
     --theta|-theta)
       THETA="${ARG}" ;;
+    --threads|-threads)
+      THREADS="${ARG}" ;;
     --verbose|-verbose)
       VERBOSE=true ;;
     *)
@@ -110,6 +113,7 @@ if [[ -z ${IFILE} || -z ${OFILE} || -z ${ITYPE} || -z ${OTYPE} || \
   echo "Counting flags:"
   echo "  --epsilon_as_backoff  treat epsilon in the input Fsts as backoff"
   echo "  --order               set maximal order of ngrams to be counted"
+  echo "  --threads             no. of threads used for counting"
   echo
   echo "Smoothing flags:"
   echo "  --bins                no. of bins for katz or absolute discounting"
@@ -268,6 +272,7 @@ ngram_count() {
       --order="${ORDER}" \
       --epsilon_as_backoff="${EPSILON_AS_BACKOFF}" \
       --round_to_int="${ROUND_TO_INT}" \
+      --threads="${THREADS}" \
       "${INF}" \
       "${OUTF}"
   done
@@ -29,6 +29,7 @@ DECLARE_string(OOV_symbol);
 DECLARE_double(OOV_class_size);
 DECLARE_double(OOV_probability);
 DECLARE_string(context_pattern);
+DECLARE_bool(verify_flat_model);
 
 int ngramperplexity_main(int argc, char **argv) {
   std::string usage = "Apply n-gram model to input FST archive.\n\n  Usage: ";
@@ -49,9 +50,26 @@ int ngramperplexity_main(int argc, char **argv) {
   std::string out_name =
       (argc > 3 && (strcmp(argv[3], "-") != 0)) ? argv[3] : "";
 
-  std::unique_ptr<fst::StdMutableFst> fst(
-      fst::StdMutableFst::Read(in1_name, true));
-  if (!fst) return 1;
+  // Models converted by ngramflatten are mapped rather than read.
+  std::unique_ptr<ngram::StdNGramFlatModel> flat_model;
+  std::unique_ptr<fst::StdMutableFst> fst;
+  if (!in1_name.empty() && ngram::StdNGramFlatModel::IsFlatModel(in1_name)) {
+    if (FLAGS_use_phimatcher) {
+      LOG(ERROR) << argv[0] << ": Can't use the phi matcher with a flat model";
+      return 1;
+    }
+    if (!FLAGS_OOV_symbol.empty() || FLAGS_OOV_probability != 0) {
+      LOG(ERROR) << argv[0] << ": OOV options for a flat model are given "
+                 << "when converting it with ngramflatten";
+      return 1;
+    }
+    flat_model.reset(
+        ngram::StdNGramFlatModel::Read(in1_name, FLAGS_verify_flat_model));
+    if (!flat_model) return 1;
+  } else {
+    fst.reset(fst::StdMutableFst::Read(in1_name, true));
+    if (!fst) return 1;
+  }
 
   std::ofstream ofstrm;
   if (argc > 3 && (strcmp(argv[3], "-") != 0)) {
@@ -63,8 +81,6 @@ int ngramperplexity_main(int argc, char **argv) {
   }
   std::ostream &ostrm = ofstrm.is_open() ? ofstrm : std::cout;
 
-  ngram::NGramOutput ngram(fst.get(), ostrm, 0, false, FLAGS_context_pattern);
-
   if (in2_name.empty()) {
     if (in1_name.empty()) {
       LOG(ERROR) << argv[0] << ": Can't use standard i/o for both inputs.";
@@ -85,6 +101,13 @@ int ngramperplexity_main(int argc, char **argv) {
     far_reader->Next();
   }
 
+  if (flat_model) {
+    ngram::NGramFlatOutput ngram(
+        *flat_model, ostrm,
+        ngram::NGramContext(FLAGS_context_pattern, flat_model->HiOrder()));
+    return !ngram.PerplexityNGramModel(infsts, FLAGS_v);
+  }
+  ngram::NGramOutput ngram(fst.get(), ostrm, 0, false, FLAGS_context_pattern);
   return !ngram.PerplexityNGramModel(
       infsts, FLAGS_v, FLAGS_use_phimatcher, &FLAGS_OOV_symbol,
       FLAGS_OOV_class_size, FLAGS_OOV_probability);
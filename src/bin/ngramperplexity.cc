@@ -21,6 +21,9 @@ DEFINE_double(OOV_probability, 0, "Unigram probability for OOVs");
 DEFINE_string(context_pattern, "",
               "Restrict perplexity computation to contexts defined by"
               " pattern (default: no restriction)");
+DEFINE_bool(verify_flat_model, false,
+            "Check all states and arcs of a flat model when mapping it, at a "
+            "cost linear in its size, rather than only its header");
 
 int ngramperplexity_main(int argc, char** argv);
 int main(int argc, char** argv) {
@@ -0,0 +1,94 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Count-min sketch estimating the counts of 64-bit keys in bounded memory.
+
+#ifndef NGRAM_COUNT_MIN_SKETCH_H_
+#define NGRAM_COUNT_MIN_SKETCH_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include <fst/types.h>
+
+namespace ngram {
+
+// Estimates the total count added for each key with a fixed number of
+// counters: each key is hashed to one counter in each of 'kDepth' rows and
+// its estimate is the smallest of those counters. Counters are updated
+// conservatively, only raising those below the new estimate. Estimates are
+// never lower than the true count and exceed it only through collisions,
+// which become rarer as the sketch grows.
+class CountMinSketch {
+ public:
+  static constexpr size_t kDepth = 4;
+
+  // Constructs a sketch using about 'memory' bytes of counters, which are
+  // allocated on the first update.
+  explicit CountMinSketch(size_t memory = 0) : width_(1), shift_(64) {
+    while (2 * width_ * kDepth * sizeof(float) <= memory) {
+      width_ *= 2;
+      --shift_;
+    }
+  }
+
+  // Adds 'count' to the count of 'key' and returns its new estimate.
+  double Add(uint64 key, double count) {
+    if (counters_.empty()) counters_.assign(width_ * kDepth, 0.0F);
+    size_t slots[kDepth];
+    float estimate = Slots(key, slots);
+    float updated = estimate + count;
+    for (size_t row = 0; row < kDepth; ++row)
+      counters_[slots[row]] = std::max(counters_[slots[row]], updated);
+    return updated;
+  }
+
+  // Returns the estimated count of 'key'.
+  double Estimate(uint64 key) const {
+    if (counters_.empty()) return 0.0;
+    size_t slots[kDepth];
+    return Slots(key, slots);
+  }
+
+  // Number of bytes used by the counters.
+  size_t MemoryUsage() const { return counters_.capacity() * sizeof(float); }
+
+  // Resets all counts and releases the memory.
+  void Clear() { std::vector<float>().swap(counters_); }
+
+ private:
+  // Sets the counter of 'key' in each row and returns their minimum.
+  float Slots(uint64 key, size_t *slots) const {
+    static const uint64 kMultipliers[kDepth] = {
+        0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+        0xD6E8FEB86659FD93ULL};
+    float estimate = 0.0F;
+    for (size_t row = 0; row < kDepth; ++row) {
+      uint64 hash = (key ^ (key >> 29)) * kMultipliers[row];
+      slots[row] = row * width_ + (shift_ < 64 ? hash >> shift_ : 0);
+      estimate = row == 0 ? counters_[slots[row]]
+                          : std::min(estimate, counters_[slots[row]]);
+    }
+    return estimate;
+  }
+
+  std::vector<float> counters_;  // 'kDepth' rows of 'width_' counters.
+  size_t width_;                 // Power of two.
+  int shift_;                    // 64 - log2(width_).
+};
+
+}  // namespace ngram
+
+#endif  // NGRAM_COUNT_MIN_SKETCH_H_
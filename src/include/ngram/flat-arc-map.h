@@ -0,0 +1,148 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Open-addressing hash table mapping (label, state) pairs to arc IDs.
+
+#ifndef NGRAM_FLAT_ARC_MAP_H_
+#define NGRAM_FLAT_ARC_MAP_H_
+
+#include <cstddef>
+#include <vector>
+
+#include <fst/types.h>
+
+namespace ngram {
+
+// Maps (label, state) pairs, packed into 64-bit keys, to 32-bit arc IDs.
+// Entries are stored inline in a single power-of-two sized array and found
+// by linear probing, so inserting does not allocate and a lookup usually
+// touches a single cache line. Labels must fit in 32 bits, state and arc
+// IDs must be at most kMaxId, and the pair (kNoLabel, kNoStateId) cannot be
+// used as a key. Callers check these limits, as keys are packed and arc IDs
+// stored without checks. Entries cannot be removed.
+class FlatArcMap {
+ public:
+  static constexpr uint32 kNoArc = static_cast<uint32>(-1);
+
+  // Largest state or arc ID that can be stored.
+  static constexpr uint64 kMaxId = kNoArc - 1;
+
+  // Constructs a table holding 'size_hint' entries without rehashing.
+  explicit FlatArcMap(size_t size_hint = 0) : size_(0), shift_(64) {
+    Reserve(size_hint);
+  }
+
+  // Packs a (label, state) pair into a key; 'state' must be at most kMaxId.
+  static uint64 Key(int64 label, int64 state) {
+    return (static_cast<uint64>(static_cast<uint32>(label)) << 32) |
+           static_cast<uint32>(state);
+  }
+
+  // Unpacks the state from a key.
+  static uint32 State(uint64 key) { return static_cast<uint32>(key); }
+
+  // Returns the arc ID stored for 'key', or kNoArc if there is none.
+  uint32 Find(uint64 key) const {
+    if (size_ == 0) return kNoArc;
+    for (size_t i = Slot(key);; i = (i + 1) & (entries_.size() - 1)) {
+      const Entry &entry = entries_[i];
+      if (entry.key == key) return entry.arc_id;
+      if (entry.key == kEmptyKey) return kNoArc;
+    }
+  }
+
+  // Stores 'arc_id' for 'key', which must not be in the table already;
+  // 'arc_id' must be at most kMaxId.
+  void Insert(uint64 key, uint32 arc_id) {
+    if ((size_ + 1) * kMaxLoadDenominator >
+        entries_.size() * kMaxLoadNumerator) {
+      size_t capacity = 2 * entries_.size();
+      if (capacity < kMinCapacity) capacity = kMinCapacity;
+      Rehash(capacity);
+    }
+    InsertEntry(key, arc_id);
+    ++size_;
+  }
+
+  // Grows the table so that it holds 'size' entries without rehashing.
+  void Reserve(size_t size) {
+    size_t capacity = kMinCapacity;
+    while (size * kMaxLoadDenominator > capacity * kMaxLoadNumerator)
+      capacity *= 2;
+    if (capacity > entries_.size()) Rehash(capacity);
+  }
+
+  // Removes all entries and releases the memory.
+  void Clear() {
+    std::vector<Entry>().swap(entries_);
+    size_ = 0;
+    shift_ = 64;
+  }
+
+  // Calls 'visit(key, arc_id)' for each entry, in no particular order.
+  template <class Visitor>
+  void Visit(Visitor visit) const {
+    for (const Entry &entry : entries_) {
+      if (entry.key != kEmptyKey) visit(entry.key, entry.arc_id);
+    }
+  }
+
+  // Number of entries.
+  size_t Size() const { return size_; }
+
+  // Number of bytes used by the table.
+  size_t MemoryUsage() const { return entries_.capacity() * sizeof(Entry); }
+
+ private:
+  struct Entry {
+    uint64 key;
+    uint32 arc_id;
+  };
+
+  static constexpr uint64 kEmptyKey = static_cast<uint64>(-1);
+  static constexpr size_t kMinCapacity = 16;
+  // The table is grown when more than 3/4 of the slots are in use.
+  static constexpr size_t kMaxLoadNumerator = 3;
+  static constexpr size_t kMaxLoadDenominator = 4;
+
+  // First slot probed for 'key' (Fibonacci hashing on the top bits).
+  size_t Slot(uint64 key) const {
+    return (key * 0x9E3779B97F4A7C15ULL) >> shift_;
+  }
+
+  void InsertEntry(uint64 key, uint32 arc_id) {
+    size_t i = Slot(key);
+    while (entries_[i].key != kEmptyKey) i = (i + 1) & (entries_.size() - 1);
+    entries_[i].key = key;
+    entries_[i].arc_id = arc_id;
+  }
+
+  void Rehash(size_t capacity) {
+    std::vector<Entry> entries(capacity, Entry{kEmptyKey, kNoArc});
+    entries.swap(entries_);
+    shift_ = 64;
+    for (size_t c = capacity; c > 1; c >>= 1) --shift_;
+    for (const Entry &entry : entries) {
+      if (entry.key != kEmptyKey) InsertEntry(entry.key, entry.arc_id);
+    }
+  }
+
+  std::vector<Entry> entries_;
+  size_t size_;  // Number of entries in use.
+  int shift_;    // 64 - log2(capacity).
+};
+
+}  // namespace ngram
+
+#endif  // NGRAM_FLAT_ARC_MAP_H_
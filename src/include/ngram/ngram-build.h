@@ -0,0 +1,63 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Makes a normalized n-gram model directly from an input fst archive (FAR)
+// or text file, counting and smoothing in memory.
+
+#ifndef NGRAM_NGRAM_BUILD_H_
+#define NGRAM_NGRAM_BUILD_H_
+
+#include <iostream>
+#include <string>
+
+#include <fst/extensions/far/far.h>
+#include <fst/mutable-fst.h>
+#include <ngram/ngram-count.h>
+#include <ngram/ngram-model.h>
+#include <ngram/util.h>
+
+namespace ngram {
+
+// Counts n-grams of order up to 'order' from 'far_reader' with
+// 'count_options' and makes a model of the counts with 'method', as
+// GetNGramCounts() followed by NGramMakeModel() would, but without writing
+// and reading back the count FST in between. For the "katz" and "absolute"
+// methods, the count-of-counts are collected while the counts are produced
+// instead of in a further pass over them, in place of any histograms given
+// in 'count_options'. Returns 'true' on success and false otherwise.
+bool NGramBuildModel(fst::FarReader<fst::StdArc> *far_reader,
+                     fst::StdMutableFst *fst, int order,
+                     const NGramCountOptions &count_options,
+                     const std::string &method = "katz", bool backoff = false,
+                     bool interpolate = false, int64 bins = -1,
+                     double witten_bell_k = 1, double discount_D = -1.0,
+                     int64 backoff_label = 0, double norm_eps = kNormEps,
+                     bool check_consistency = false);
+
+// The same, but counts the sentences in 'strm', one per line, as
+// GetNGramCountsFromText() does.
+bool NGramBuildModelFromText(std::istream &strm, const fst::SymbolTable &syms,
+                             fst::StdMutableFst *fst, int order,
+                             const NGramCountOptions &count_options,
+                             const std::string &method = "katz",
+                             bool backoff = false, bool interpolate = false,
+                             int64 bins = -1, double witten_bell_k = 1,
+                             double discount_D = -1.0,
+                             int64 backoff_label = 0,
+                             double norm_eps = kNormEps,
+                             bool check_consistency = false);
+
+}  // namespace ngram
+
+#endif  // NGRAM_NGRAM_BUILD_H_
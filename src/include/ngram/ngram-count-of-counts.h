@@ -86,6 +86,28 @@ class NGramCountOfCounts {
     }
   }
 
+  // Clears the histograms and sizes them for orders up to 'hi_order', to be
+  // filled with AddCount() while counting rather than from a model.
+  void InitCounts(int hi_order) {
+    histogram_.assign(hi_order, std::vector<double>(bins_ + 1, 0.0));
+  }
+
+  // Returns true if the n-grams leaving the state with n-gram 'state_ngram'
+  // are within the context and should be added.
+  bool HasContext(const std::vector<Label> &state_ngram) const {
+    return context_.NullContext() || context_.HasContext(state_ngram, false);
+  }
+
+  // Returns true if no context restricts the n-grams added.
+  bool NullContext() const { return context_.NullContext(); }
+
+  // Adds to the histogram of 'order' (unigram is order 0) an n-gram count,
+  // given as a negative log count.
+  void AddCount(int order, double weight) {
+    int bin = GetCountBin(weight, GetBins(), false);
+    if (bin >= 0) ++histogram_[order][bin];
+  }
+
   // Returns the number of bins
   int GetBins() const { return bins_; }
 
@@ -17,6 +17,10 @@
 #ifndef NGRAM_NGRAM_COUNT_H_
 #define NGRAM_NGRAM_COUNT_H_
 
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
 #include <string>
 #include <type_traits>
 #include <vector>
@@ -24,42 +28,339 @@
 #include <fst/log.h>
 #include <fst/extensions/far/far.h>
 #include <fst/fstlib.h>
+#include <ngram/count-min-sketch.h>
+#include <ngram/flat-arc-map.h>
 #include <ngram/hist-arc.h>
 #include <ngram/ngram-count-of-counts.h>
 #include <ngram/ngram-model.h>
 #include <ngram/util.h>
-#include <unordered_map>
 
 namespace ngram {
 
-// NGramCounter class.
-template <class Weight, class Label = int32>
+// Default value of the 'delta' argument of the counters, which is unused:
+// the shortest distances of acyclic input are computed exactly, in a single
+// pass in topological order. Kept so that existing callers compile.
+constexpr float kCountDelta = 1e-9F;
+
+// Default number of bytes of the sketch used to apply minimum counts.
+constexpr size_t kMinCountSketchMemory = 64 << 20;
+
+// Count weight holding a plain (real-domain) count, so that adding counts
+// is a floating-point addition rather than a log-domain sum. Like
+// Log64Weight, it is constructed from and its Value() is a negative log
+// count, so that it can be used as the Weight of an NGramCounter; the
+// conversion then only happens when counts enter and leave the counter.
+// Integer counts are exact up to 2^53.
+class RealCountWeight {
+ public:
+  RealCountWeight() : count_(0.0) {}
+
+  // Constructs from a negative log count.
+  RealCountWeight(double value) : count_(std::exp(-value)) {}  // NOLINT
+
+  static RealCountWeight Zero() { return FromCount(0.0); }
+  static RealCountWeight One() { return FromCount(1.0); }
+
+  static RealCountWeight FromCount(double count) {
+    RealCountWeight weight;
+    weight.count_ = count;
+    return weight;
+  }
+
+  // Negative log count; a count of one gives 0 rather than -0.
+  double Value() const { return 0.0 - std::log(count_); }
+
+  double Count() const { return count_; }
+
+  // Writes the negative log count, as Log64Weight does.
+  std::ostream &Write(std::ostream &strm) const {
+    return fst::WriteType(strm, Value());
+  }
+
+ private:
+  double count_;
+};
+
+inline RealCountWeight Plus(const RealCountWeight &w1,
+                            const RealCountWeight &w2) {
+  return RealCountWeight::FromCount(w1.Count() + w2.Count());
+}
+
+inline bool operator==(const RealCountWeight &w1, const RealCountWeight &w2) {
+  return w1.Count() == w2.Count();
+}
+
+inline bool operator!=(const RealCountWeight &w1, const RealCountWeight &w2) {
+  return !(w1 == w2);
+}
+
+// Storage for the states and arcs of an NGramCounter, as arrays of
+// structures with 64-bit IDs.
+template <class Weight, class Label>
+class NGramCountStorage {
+ public:
+  static constexpr size_t kMaxOrder = static_cast<size_t>(-1);
+  static constexpr size_t kMaxId = std::numeric_limits<ssize_t>::max();
+
+  size_t NumStates() const { return states_.size(); }
+  size_t NumArcs() const { return arcs_.size(); }
+
+  // Adds a state without outgoing arcs and returns its ID.
+  ssize_t AddState(ssize_t backoff_state, size_t order) {
+    states_.push_back(CountState(backoff_state, order, Weight::Zero(), -1));
+    return states_.size() - 1;
+  }
+
+  ssize_t BackoffState(ssize_t s) const { return states_[s].backoff_state; }
+  size_t Order(ssize_t s) const { return states_[s].order; }
+  const Weight &FinalCount(ssize_t s) const { return states_[s].final_count; }
+  void SetFinalCount(ssize_t s, Weight count) {
+    states_[s].final_count = count;
+  }
+  ssize_t FirstArc(ssize_t s) const { return states_[s].first_arc; }
+  void SetFirstArc(ssize_t s, ssize_t a) { states_[s].first_arc = a; }
+
+  // Adds an arc with a zero count and returns its ID.
+  ssize_t AddArc(Label label, ssize_t origin, ssize_t destination,
+                 ssize_t backoff_arc) {
+    arcs_.push_back(
+        CountArc(origin, destination, label, Weight::Zero(), backoff_arc));
+    return arcs_.size() - 1;
+  }
+
+  Label ArcLabel(ssize_t a) const { return arcs_[a].label; }
+  ssize_t Origin(ssize_t a) const { return arcs_[a].origin; }
+  void SetOrigin(ssize_t a, ssize_t s) { arcs_[a].origin = s; }
+  ssize_t Destination(ssize_t a) const { return arcs_[a].destination; }
+  void SetDestination(ssize_t a, ssize_t s) { arcs_[a].destination = s; }
+  const Weight &Count(ssize_t a) const { return arcs_[a].count; }
+  void SetCount(ssize_t a, Weight count) { arcs_[a].count = count; }
+  ssize_t BackoffArc(ssize_t a) const { return arcs_[a].backoff_arc; }
+  void SetBackoffArc(ssize_t a, ssize_t b) { arcs_[a].backoff_arc = b; }
+
+  // Approximate number of bytes used.
+  size_t MemoryUsage() const {
+    return states_.capacity() * sizeof(CountState) +
+           arcs_.capacity() * sizeof(CountArc);
+  }
+
+  // Removes all states and arcs, and releases the memory.
+  void Clear() {
+    std::vector<CountState>().swap(states_);
+    std::vector<CountArc>().swap(arcs_);
+  }
+
+ private:
+  // Data representation for a state.
+  struct CountState {
+    ssize_t backoff_state;  // ID of the backoff state for the current state.
+    size_t order;           // N-gram order of the state (of the outgoing arcs).
+    Weight final_count;     // Count for n-gram corresponding to superfinal arc.
+    ssize_t first_arc;      // ID of the first outgoing arc at that state.
+
+    CountState(ssize_t s, size_t o, Weight c, ssize_t a)
+        : backoff_state(s), order(o), final_count(c), first_arc(a) {}
+  };
+
+  // Data represention for an arc.
+  struct CountArc {
+    ssize_t origin;       // ID of the origin state for this arc.
+    ssize_t destination;  // ID of the destination state for this arc.
+    Label label;          // Label.
+    Weight count;         // Count of the n-gram corresponding to this arc.
+    ssize_t backoff_arc;  // ID of backoff arc.
+
+    CountArc(ssize_t o, ssize_t d, Label l, Weight c, ssize_t b)
+        : origin(o), destination(d), label(l), count(c), backoff_arc(b) {}
+  };
+
+  std::vector<CountState> states_;  // Vector mapping state IDs to CountStates
+  std::vector<CountArc> arcs_;      // Vector mapping arc IDs to CountArcs
+};
+
+// Compact storage for the states and arcs of an NGramCounter, as separate
+// arrays for each field, with 32-bit IDs and 8-bit orders. Supports orders
+// up to 255 and fewer than 2^32 - 1 states and arcs, which NGramCounter
+// checks against kMaxOrder and kMaxId before adding states and arcs.
+template <class Weight, class Label>
+class NGramCompactCountStorage {
+ public:
+  static constexpr size_t kMaxOrder = 255;
+  static constexpr size_t kMaxId = static_cast<uint32>(-1) - 1;
+
+  size_t NumStates() const { return orders_.size(); }
+  size_t NumArcs() const { return labels_.size(); }
+
+  // Adds a state without outgoing arcs and returns its ID.
+  ssize_t AddState(ssize_t backoff_state, size_t order) {
+    backoff_states_.push_back(ToId(backoff_state));
+    orders_.push_back(order);
+    final_counts_.push_back(Weight::Zero());
+    first_arcs_.push_back(kNoId);
+    return orders_.size() - 1;
+  }
+
+  ssize_t BackoffState(ssize_t s) const { return FromId(backoff_states_[s]); }
+  size_t Order(ssize_t s) const { return orders_[s]; }
+  const Weight &FinalCount(ssize_t s) const { return final_counts_[s]; }
+  void SetFinalCount(ssize_t s, Weight count) { final_counts_[s] = count; }
+  ssize_t FirstArc(ssize_t s) const { return FromId(first_arcs_[s]); }
+  void SetFirstArc(ssize_t s, ssize_t a) { first_arcs_[s] = ToId(a); }
+
+  // Adds an arc with a zero count and returns its ID.
+  ssize_t AddArc(Label label, ssize_t origin, ssize_t destination,
+                 ssize_t backoff_arc) {
+    labels_.push_back(label);
+    counts_.push_back(Weight::Zero());
+    origins_.push_back(ToId(origin));
+    destinations_.push_back(ToId(destination));
+    backoff_arcs_.push_back(ToId(backoff_arc));
+    return labels_.size() - 1;
+  }
+
+  Label ArcLabel(ssize_t a) const { return labels_[a]; }
+  ssize_t Origin(ssize_t a) const { return FromId(origins_[a]); }
+  void SetOrigin(ssize_t a, ssize_t s) { origins_[a] = ToId(s); }
+  ssize_t Destination(ssize_t a) const { return FromId(destinations_[a]); }
+  void SetDestination(ssize_t a, ssize_t s) { destinations_[a] = ToId(s); }
+  const Weight &Count(ssize_t a) const { return counts_[a]; }
+  void SetCount(ssize_t a, Weight count) { counts_[a] = count; }
+  ssize_t BackoffArc(ssize_t a) const { return FromId(backoff_arcs_[a]); }
+  void SetBackoffArc(ssize_t a, ssize_t b) { backoff_arcs_[a] = ToId(b); }
+
+  // Approximate number of bytes used.
+  size_t MemoryUsage() const {
+    return backoff_states_.capacity() * sizeof(uint32) +
+           orders_.capacity() * sizeof(uint8) +
+           final_counts_.capacity() * sizeof(Weight) +
+           first_arcs_.capacity() * sizeof(uint32) +
+           labels_.capacity() * sizeof(Label) +
+           counts_.capacity() * sizeof(Weight) +
+           origins_.capacity() * sizeof(uint32) +
+           destinations_.capacity() * sizeof(uint32) +
+           backoff_arcs_.capacity() * sizeof(uint32);
+  }
+
+  // Removes all states and arcs, and releases the memory.
+  void Clear() {
+    std::vector<uint32>().swap(backoff_states_);
+    std::vector<uint8>().swap(orders_);
+    std::vector<Weight>().swap(final_counts_);
+    std::vector<uint32>().swap(first_arcs_);
+    std::vector<Label>().swap(labels_);
+    std::vector<Weight>().swap(counts_);
+    std::vector<uint32>().swap(origins_);
+    std::vector<uint32>().swap(destinations_);
+    std::vector<uint32>().swap(backoff_arcs_);
+  }
+
+ private:
+  static constexpr uint32 kNoId = static_cast<uint32>(-1);
+
+  // 'id' is -1 or at most kMaxId.
+  static uint32 ToId(ssize_t id) {
+    return id == -1 ? kNoId : static_cast<uint32>(id);
+  }
+
+  static ssize_t FromId(uint32 id) {
+    return id == kNoId ? -1 : static_cast<ssize_t>(id);
+  }
+
+  // State fields, indexed by state ID.
+  std::vector<uint32> backoff_states_;
+  std::vector<uint8> orders_;
+  std::vector<Weight> final_counts_;
+  std::vector<uint32> first_arcs_;
+  // Arc fields, indexed by arc ID.
+  std::vector<Label> labels_;
+  std::vector<Weight> counts_;
+  std::vector<uint32> origins_;
+  std::vector<uint32> destinations_;
+  std::vector<uint32> backoff_arcs_;
+};
+
+template <class Weight, class Label>
+constexpr size_t NGramCountStorage<Weight, Label>::kMaxId;
+
+template <class Weight, class Label>
+constexpr size_t NGramCompactCountStorage<Weight, Label>::kMaxId;
+
+template <class Weight, class Label>
+constexpr uint32 NGramCompactCountStorage<Weight, Label>::kNoId;
+
+// Magic numbers identifying n-gram counter snapshots.
+constexpr int32 kNGramCounterMagic = 0x4e474354;
+constexpr int32 kNGramSuffixArrayCounterMagic = 0x4e475341;
+
+// NGramCounter class. The 'Storage' template parameter selects the layout of
+// the states and arcs: NGramCountStorage (the default) or the more compact
+// NGramCompactCountStorage.
+template <class Weight, class Label = int32,
+          class Storage = NGramCountStorage<Weight, Label>>
 class NGramCounter {
  public:
   // Construct an NGramCounter object counting n-grams of order less or equal to
   // 'order'. When 'epsilon_as_backoff' is 'true', the epsilon transition in the
   // input Fst are treated as failure backoff transitions and would trigger the
   // length of the current context to be decreased by one ("pop front").
+  // When 'defer_backoff_counts' is 'true', each n-gram occurrence only
+  // increases the count of that n-gram, and the counts of the lower-order
+  // n-grams it backs off to are derived in a single pass by
+  // PropagateCounts() before the counts are read. When 'min_counts' is not
+  // empty, its i-th value (or its last one, for higher orders) is the
+  // minimum count of n-grams of order i + 1 > 1: counts of n-grams not seen
+  // yet are kept in a count-min sketch of about 'sketch_memory' bytes, and
+  // an n-gram is only added once its estimated count reaches the minimum,
+  // starting from that estimate. Its occurrences until then only count for
+  // lower orders. As the sketch estimates never undercount, this keeps the
+  // n-grams count pruning would keep, with their exact counts barring hash
+  // collisions. The sketch is not part of MemoryUsage() and is reset by
+  // Clear(). Minimum counts require string input and are not supported with
+  // deferred backoff counts or epsilons as backoff. 'delta' is unused (see
+  // kCountDelta).
   explicit NGramCounter(size_t order, bool epsilon_as_backoff = false,
-                        float delta = 1e-9F)
+                        float /*delta*/ = kCountDelta,
+                        bool defer_backoff_counts = false,
+                        const std::vector<double> &min_counts =
+                            std::vector<double>(),
+                        size_t sketch_memory = kMinCountSketchMemory)
       : order_(order),
-        pair_arc_maps_(order),
+        arc_maps_(order),
         epsilon_as_backoff_(epsilon_as_backoff),
-        delta_(delta),
+        defer_backoff_counts_(defer_backoff_counts),
+        counts_deferred_(defer_backoff_counts),
+        min_counts_(min_counts),
+        sketch_(sketch_memory),
+        start_count_(Weight::Zero()),
         error_(false) {
     if (order == 0) {
       NGRAMERROR() << "order must be greater than 0";
       SetError();
       return;
     }
-    backoff_ = states_.size();
-    states_.push_back(CountState(-1, 1, Weight::Zero(), -1));
-    if (order == 1) {
-      initial_ = backoff_;
-    } else {
-      initial_ = states_.size();
-      states_.push_back(CountState(backoff_, 2, Weight::Zero(), -1));
+    if (order > Storage::kMaxOrder) {
+      NGRAMERROR() << "order must be at most " << Storage::kMaxOrder;
+      SetError();
+      return;
+    }
+    if (defer_backoff_counts && order > 255) {
+      NGRAMERROR() << "order must be at most 255 with deferred backoff counts";
+      SetError();
+      return;
+    }
+    if (defer_backoff_counts && !min_counts.empty()) {
+      NGRAMERROR() << "minimum counts are not supported with deferred "
+                   << "backoff counts";
+      SetError();
+      return;
     }
+    if (epsilon_as_backoff && !min_counts.empty()) {
+      NGRAMERROR() << "minimum counts are not supported with epsilons as "
+                   << "backoff transitions";
+      SetError();
+      return;
+    }
+    AddInitialStates();
   }
 
   // Extract counts from the input acyclic Fst.  Return 'true' when
@@ -97,22 +398,59 @@ class NGramCounter {
     return CountFromTopSortedFst(*fst);
   }
 
-  // Get an FST representation of the ngram counts.
+  // Extracts counts from the string of 'size' labels starting at 'labels',
+  // each n-gram occurrence having count 'count'. Return 'true' when the
+  // counting was successful and false otherwise.
+  bool CountLabels(const Label *labels, size_t size,
+                   Weight count = Weight::One()) {
+    if (Error()) return false;
+    if (!min_counts_.empty()) return CountAdmittedLabels(labels, size, count);
+    ssize_t count_state = initial_;
+    for (size_t i = 0; i < size; ++i) {
+      if (labels[i]) {
+        count_state = UpdateCount(count_state, labels[i], count);
+      } else if (epsilon_as_backoff_) {
+        ssize_t next_count_state = NGramBackoffState(count_state);
+        count_state = next_count_state == -1 ? count_state : next_count_state;
+      }
+    }
+    UpdateFinalCount(count_state, count);
+    return !Error();
+  }
+
+  // Get an FST representation of the ngram counts. If 'count_of_counts' is
+  // not null, its histograms are also filled from the final counts, as
+  // NGramCountOfCounts::CalculateCounts() would from the resulting model.
   template <class Arc>
-  void GetFst(fst::MutableFst<Arc> *fst) {
+  void GetFst(fst::MutableFst<Arc> *fst,
+              NGramCountOfCounts<fst::StdArc> *count_of_counts = nullptr) {
     fst->DeleteStates();
     if (Error()) return;
-    for (size_t s = 0; s < states_.size(); ++s) {
+    PropagateCounts();
+    std::vector<bool> in_context;
+    if (count_of_counts) {
+      count_of_counts->InitCounts(order_);
+      GetStatesInContext(*count_of_counts, &in_context);
+    }
+    for (size_t s = 0; s < store_.NumStates(); ++s) {
       fst->AddState();
-      fst->SetFinal(s, states_[s].final_count.Value());
-      if (states_[s].backoff_state != -1)
-        fst->AddArc(s, Arc(0, 0, Arc::Weight::Zero(),
-                           states_[s].backoff_state));
+      fst->SetFinal(s, store_.FinalCount(s).Value());
+      if (store_.BackoffState(s) != -1)
+        fst->AddArc(s, Arc(0, 0, Arc::Weight::Zero(), store_.BackoffState(s)));
+      if (count_of_counts && in_context[s]) {
+        count_of_counts->AddCount(store_.Order(s) - 1,
+                                  store_.FinalCount(s).Value());
+      }
     }
-    for (size_t a = 0; a < arcs_.size(); ++a) {
-      const CountArc &arc = arcs_[a];
-      fst->AddArc(arc.origin, Arc(arc.label, arc.label, arc.count.Value(),
-                                  arc.destination));
+    for (size_t a = 0; a < store_.NumArcs(); ++a) {
+      Label label = store_.ArcLabel(a);
+      ssize_t origin = store_.Origin(a);
+      fst->AddArc(origin, Arc(label, label, store_.Count(a).Value(),
+                              store_.Destination(a)));
+      if (count_of_counts && in_context[origin]) {
+        count_of_counts->AddCount(store_.Order(origin) - 1,
+                                  store_.Count(a).Value());
+      }
     }
     fst->SetStart(initial_);
     StateCounts(fst);
@@ -124,53 +462,110 @@ class NGramCounter {
   void GetReverseContextNGrams(
       std::vector<std::pair<std::vector<int>, std::pair<Label, double>>>
           *ngram_counts) {
+    VisitReverseContextNGrams([ngram_counts](
+        const std::vector<int> &reverse_context, Label label, double count) {
+      ngram_counts->push_back(
+          std::make_pair(reverse_context, std::make_pair(label, count)));
+    });
+  }
+
+  // Calls 'visit(reverse_context, label, count)' for each ngram count, in the
+  // order and form of GetReverseContextNGrams(), with label 0 for the end of
+  // string. The reverse contexts are recovered from the states as they are
+  // visited rather than stored, and 'reverse_context' is only valid during
+  // the call.
+  template <class Visitor>
+  void VisitReverseContextNGrams(Visitor visit) {
     if (Error()) return;
-    std::vector<int> incoming_words(states_.size(), -1);
-    std::vector<int> previous_states(states_.size(), -1);
+    PropagateCounts();
+    std::vector<int> incoming_words(store_.NumStates(), -1);
+    std::vector<int> previous_states(store_.NumStates(), -1);
     if (order_ > 1) incoming_words[NGramStartState()] = 0;
-    for (size_t a = 0; a < arcs_.size(); ++a) {
-      const CountArc &arc = arcs_[a];
-      if (states_[arc.origin].order < states_[arc.destination].order) {
-        previous_states[arc.destination] = arc.origin;
-        incoming_words[arc.destination] = arc.label;
+    for (size_t a = 0; a < store_.NumArcs(); ++a) {
+      ssize_t origin = store_.Origin(a);
+      ssize_t destination = store_.Destination(a);
+      if (store_.Order(origin) < store_.Order(destination)) {
+        previous_states[destination] = origin;
+        incoming_words[destination] = store_.ArcLabel(a);
       }
     }
-    std::vector<std::vector<int>> reverse_context(states_.size());
-    for (size_t s = 0; s < states_.size(); ++s) {
-      int ps = s;
-      while (ps >= 0) {
+    std::vector<int> reverse_context;
+    ssize_t context_state = -1;  // State whose context is reverse_context.
+    auto set_context = [&](ssize_t s) {
+      if (s == context_state) return;
+      context_state = s;
+      reverse_context.clear();
+      for (int ps = s; ps >= 0; ps = previous_states[ps]) {
         if (incoming_words[ps] >= 0)
-          reverse_context[s].push_back(incoming_words[ps]);
-        ps = previous_states[ps];
+          reverse_context.push_back(incoming_words[ps]);
       }
-      if (states_[s].final_count.Value() != Weight::Zero().Value()) {
-        ngram_counts->push_back(
-            std::make_pair(reverse_context[s],
-                           std::make_pair(0, states_[s].final_count.Value())));
+    };
+    for (size_t s = 0; s < store_.NumStates(); ++s) {
+      if (store_.FinalCount(s).Value() != Weight::Zero().Value()) {
+        set_context(s);
+        visit(reverse_context, 0, store_.FinalCount(s).Value());
       }
     }
-    for (size_t a = 0; a < arcs_.size(); ++a) {
-      const CountArc &arc = arcs_[a];
-      ngram_counts->push_back(
-          std::make_pair(reverse_context[arc.origin],
-                         std::make_pair(arc.label, arc.count.Value())));
+    for (size_t a = 0; a < store_.NumArcs(); ++a) {
+      set_context(store_.Origin(a));
+      visit(reverse_context, store_.ArcLabel(a), store_.Count(a).Value());
+    }
+  }
+
+  // Adds the counts of 'counter' to this counter. N-grams are visited in the
+  // order in which they were created in 'counter', so that merging counters
+  // built from consecutive shards of some input, in shard order, yields the
+  // same state numbering as counting that input with a single counter.
+  // Returns 'true' when the merge was successful and false otherwise.
+  bool MergeCounts(const NGramCounter &counter) {
+    if (Error()) return false;
+    if (counter.Error()) {
+      NGRAMERROR() << "NGramCounter::MergeCounts: counter in a bad state";
+      SetError();
+      return false;
+    }
+    if (counter.order_ != order_) {
+      NGRAMERROR() << "NGramCounter::MergeCounts: order mismatch: "
+                   << counter.order_ << " != " << order_;
+      SetError();
+      return false;
+    }
+    if (counter.counts_deferred_ != counts_deferred_) {
+      NGRAMERROR() << "NGramCounter::MergeCounts: counters must both have "
+                   << "or both not have deferred backoff counts";
+      SetError();
+      return false;
+    }
+    // This counter ends up holding at least as many n-grams as 'counter'.
+    for (size_t o = 0; o < order_; ++o)
+      arc_maps_[o].Reserve(counter.arc_maps_[o].Size());
+    const Storage &store = counter.store_;
+    std::vector<ssize_t> state_map(store.NumStates(), -1);
+    state_map[counter.backoff_] = backoff_;
+    state_map[counter.initial_] = initial_;
+    // An arc is always created before any arc leaving its destination state,
+    // so the origin of each arc has already been mapped when it is reached.
+    for (size_t a = 0; a < store.NumArcs(); ++a) {
+      ssize_t arc_id = FindArc(state_map[store.Origin(a)], store.ArcLabel(a));
+      if (arc_id == -1) return false;
+      store_.SetCount(arc_id, Plus(store_.Count(arc_id), store.Count(a)));
+      state_map[store.Destination(a)] = store_.Destination(arc_id);
+    }
+    for (size_t s = 0; s < store.NumStates(); ++s) {
+      ssize_t state_id = state_map[s];
+      store_.SetFinalCount(state_id, Plus(store_.FinalCount(state_id),
+                                          store.FinalCount(s)));
     }
+    return !Error();
   }
 
   // Given a state ID and a label, returns the ID of the corresponding
-  // arc, creating the arc if it does not exist already.
+  // arc, creating the arc if it does not exist already. Returns -1 if the
+  // arc cannot be created, leaving the counter in a bad state.
   ssize_t FindArc(ssize_t state_id, Label label) {
-    const CountState &count_state = states_[state_id];
-    // First determines if there already exists a corresponding arc.
-    if (count_state.first_arc != -1) {
-      if (arcs_[count_state.first_arc].label == label)
-        return count_state.first_arc;
-      const PairArcMap &arc_map = pair_arc_maps_[count_state.order - 1];
-      auto iter = arc_map.find(std::make_pair(label, state_id));
-      if (iter != arc_map.end()) return iter->second;
-    }
+    ssize_t arc_id = FindExistingArc(state_id, label);
     // Otherwise, this arc needs to be created.
-    return AddArc(state_id, label);
+    return arc_id != -1 ? arc_id : AddArc(state_id, label);
   }
 
   // Gets the start state of the counts (<s>).
@@ -181,19 +576,19 @@ class NGramCounter {
 
   // Gets the backoff state for a given state.
   ssize_t NGramBackoffState(ssize_t state_id) {
-    return states_[state_id].backoff_state;
+    return store_.BackoffState(state_id);
   }
 
   // Gets the next state from a found arc.
   ssize_t NGramNextState(ssize_t arc_id) {
-    if (arc_id < 0 || arc_id >= arcs_.size()) return -1;
-    return arcs_[arc_id].destination;
+    if (arc_id < 0 || arc_id >= store_.NumArcs()) return -1;
+    return store_.Destination(arc_id);
   }
 
   // Sets the weight for an n-gram ending with the stop symbol </s>.
   bool SetFinalNGramWeight(ssize_t state_id, Weight weight) {
-    if (state_id < 0 || state_id >= states_.size()) return false;
-    states_[state_id].final_count = weight;
+    if (state_id < 0 || state_id >= store_.NumStates()) return false;
+    store_.SetFinalCount(state_id, weight);
     return true;
   }
 
@@ -212,13 +607,104 @@ class NGramCounter {
 
   // Sets the weight for a found n-gram.
   bool SetNGramWeight(ssize_t arc_id, Weight weight) {
-    if (arc_id < 0 || arc_id >= arcs_.size()) return false;
-    arcs_[arc_id].count = weight;
+    if (arc_id < 0 || arc_id >= store_.NumArcs()) return false;
+    store_.SetCount(arc_id, weight);
     return true;
   }
 
   // Size of ngram model is the sum of the number of states and number of arcs.
-  ssize_t GetSize() const { return states_.size() + arcs_.size(); }
+  ssize_t GetSize() const { return store_.NumStates() + store_.NumArcs(); }
+
+  // Approximate number of bytes used to store the counts.
+  size_t MemoryUsage() const {
+    size_t usage = store_.MemoryUsage();
+    for (const auto &arc_map : arc_maps_) usage += arc_map.MemoryUsage();
+    return usage;
+  }
+
+  // Writes all n-grams and their counts to 'strm', in lexicographic n-gram
+  // order. Each n-gram is written as a vector of labels, where label 0
+  // stands for <s> in first position and for </s> in last position, followed
+  // by its count. Returns 'true' when the n-grams were successfully written
+  // and false otherwise.
+  bool WriteSortedNGrams(std::ostream &strm);
+
+  // Writes the counts to 'strm' as a snapshot, from which Read() restores
+  // them so that counting can be resumed. The snapshot does not depend on
+  // the storage layout or on the count weight, and holds labels only; the
+  // counting functions save their symbol table after it. Returns 'true' when
+  // the snapshot was successfully written and false otherwise.
+  bool Write(std::ostream &strm) const;
+
+  // Replaces the counts by those of a snapshot written by Write() with the
+  // same order. The counter takes on whether the snapshot defers backoff
+  // counts. Returns 'true' when the snapshot was successfully read and false
+  // otherwise, leaving the counter in a bad state.
+  bool Read(std::istream &strm);
+
+  // Removes all counts, bringing the counter back to its initial state.
+  void Clear() {
+    store_.Clear();
+    for (auto &arc_map : arc_maps_) arc_map.Clear();
+    sketch_.Clear();
+    start_count_ = Weight::Zero();
+    counts_deferred_ = defer_backoff_counts_;
+    AddInitialStates();
+  }
+
+  // When backoff counts are deferred, adds the count of each n-gram to
+  // the n-gram it backs off to, from the highest order down, so that all
+  // counts are complete. The arcs and states are bucketed by order first,
+  // so that each is visited once. Further counting then updates all orders
+  // at once.
+  void PropagateCounts() {
+    if (!counts_deferred_) return;
+    counts_deferred_ = false;
+    // An arc of order o < order_ leads to a state of order o + 1, while an
+    // arc of order order_ leads to the destination of its backoff arc.
+    std::vector<uint8> arc_orders(store_.NumArcs());
+    for (size_t a = 0; a < store_.NumArcs(); ++a) {
+      ssize_t destination = store_.Destination(a);
+      size_t arc_order = store_.Order(destination) - 1;
+      if (arc_order + 1 == order_ && order_ > 1) {
+        ssize_t backoff_arc = store_.BackoffArc(a);
+        if (backoff_arc != -1 &&
+            store_.Destination(backoff_arc) == destination) {
+          arc_order = order_;
+        }
+      }
+      arc_orders[a] = arc_order;
+    }
+    std::vector<uint8> state_orders(store_.NumStates());
+    for (size_t s = 0; s < store_.NumStates(); ++s)
+      state_orders[s] = store_.Order(s);
+    std::vector<size_t> arcs, arcs_begin, states, states_begin;
+    BucketByOrder(arc_orders, &arcs, &arcs_begin);
+    BucketByOrder(state_orders, &states, &states_begin);
+    for (size_t o = order_; o > 1; --o) {
+      for (size_t i = arcs_begin[o]; i < arcs_begin[o + 1]; ++i) {
+        ssize_t backoff_arc = store_.BackoffArc(arcs[i]);
+        store_.SetCount(backoff_arc, Plus(store_.Count(backoff_arc),
+                                          store_.Count(arcs[i])));
+      }
+      for (size_t i = states_begin[o]; i < states_begin[o + 1]; ++i) {
+        ssize_t backoff_state = store_.BackoffState(states[i]);
+        if (backoff_state == -1) continue;
+        store_.SetFinalCount(
+            backoff_state, Plus(store_.FinalCount(backoff_state),
+                                store_.FinalCount(states[i])));
+      }
+    }
+  }
+
+  // Maximal order of the n-grams being counted.
+  size_t Order() const { return order_; }
+
+  // Whether epsilons in the input are treated as backoff transitions.
+  bool EpsilonAsBackoff() const { return epsilon_as_backoff_; }
+
+  // Whether the counts of backoff n-grams are deferred when counting.
+  bool DeferBackoffCounts() const { return defer_backoff_counts_; }
 
   // Returns true if counter setup is in a bad state.
   bool Error() const { return error_; }
@@ -227,84 +713,134 @@ class NGramCounter {
   void SetError() { error_ = true; }
 
  private:
-  // Data representation for a state.
-  struct CountState {
-    ssize_t backoff_state;  // ID of the backoff state for the current state.
-    size_t order;           // N-gram order of the state (of the outgoing arcs).
-    Weight final_count;     // Count for n-gram corresponding to superfinal arc.
-    ssize_t first_arc;      // ID of the first outgoing arc at that state.
-
-    CountState(ssize_t s, size_t o, Weight c, ssize_t a)
-        : backoff_state(s), order(o), final_count(c), first_arc(a) {}
-  };
-
-  // Data represention for an arc.
-  struct CountArc {
-    ssize_t origin;       // ID of the origin state for this arc.
-    ssize_t destination;  // ID of the destination state for this arc.
-    Label label;          // Label.
-    Weight count;         // Count of the n-gram corresponding to this arc.
-    ssize_t backoff_arc;  // ID of backoff arc.
+  // Sorts the ids of 'orders', each in [0, order_], by their order into
+  // 'ids', keeping ids of the same order in increasing order: the ids of
+  // order o are (*ids)[(*begin)[o]] up to (*ids)[(*begin)[o + 1]].
+  void BucketByOrder(const std::vector<uint8> &orders,
+                     std::vector<size_t> *ids,
+                     std::vector<size_t> *begin) const {
+    begin->assign(order_ + 2, 0);
+    for (uint8 o : orders) ++(*begin)[o + 1];
+    for (size_t o = 1; o < begin->size(); ++o) (*begin)[o] += (*begin)[o - 1];
+    std::vector<size_t> next(begin->begin(), begin->end() - 1);
+    ids->resize(orders.size());
+    for (size_t id = 0; id < orders.size(); ++id)
+      (*ids)[next[orders[id]]++] = id;
+  }
 
-    CountArc(ssize_t o, size_t d, Label l, Weight c, ssize_t b)
-        : origin(o), destination(d), label(l), count(c), backoff_arc(b) {}
-  };
+  // Creates the unigram state and the start state (<s>).
+  void AddInitialStates() {
+    backoff_ = store_.AddState(-1, 1);
+    initial_ = order_ == 1 ? backoff_ : store_.AddState(backoff_, 2);
+  }
 
-  // A pair (Label, State ID) or (State ID, State ID)
-  using Pair = std::pair<ssize_t, ssize_t>;
+  // Sets the origin of each arc, which snapshots do not hold, from the
+  // first arc of each state and from the keys of the arc maps. Returns false
+  // if some arc is reached from neither.
+  bool RestoreArcOrigins() {
+    for (size_t a = 0; a < store_.NumArcs(); ++a) store_.SetOrigin(a, -1);
+    for (size_t s = 0; s < store_.NumStates(); ++s) {
+      if (store_.FirstArc(s) != -1) store_.SetOrigin(store_.FirstArc(s), s);
+    }
+    for (const auto &arc_map : arc_maps_) {
+      arc_map.Visit([this](uint64 key, uint32 arc_id) {
+        store_.SetOrigin(arc_id, FlatArcMap::State(key));
+      });
+    }
+    for (size_t a = 0; a < store_.NumArcs(); ++a) {
+      if (store_.Origin(a) == -1) return false;
+    }
+    return true;
+  }
 
-  struct PairHash {
-    size_t operator()(const Pair &p) const {
-      return (static_cast<size_t>(p.first) * 55697) ^
-             (static_cast<size_t>(p.second) * 54631);
-      // TODO(allauzen): run benchmark using Compose's hash function
-      // return static_cast<size_t>(p.first + p.second * 7853);
+  // Sets 'in_context[s]' to whether the n-grams leaving state 's' are within
+  // the context of 'count_of_counts'. When there is a context, the n-gram of
+  // each state is rebuilt in a single buffer by following its parents.
+  void GetStatesInContext(
+      const NGramCountOfCounts<fst::StdArc> &count_of_counts,
+      std::vector<bool> *in_context) const {
+    in_context->assign(store_.NumStates(), true);
+    if (count_of_counts.NullContext()) return;
+    std::vector<ssize_t> parents(store_.NumStates(), -1);
+    std::vector<Label> labels(store_.NumStates(), 0);
+    for (size_t a = 0; a < store_.NumArcs(); ++a) {
+      ssize_t origin = store_.Origin(a);
+      ssize_t destination = store_.Destination(a);
+      if (store_.Order(origin) < store_.Order(destination)) {
+        parents[destination] = origin;
+        labels[destination] = store_.ArcLabel(a);
+      }
     }
-  };
+    std::vector<Label> state_ngram;
+    state_ngram.reserve(order_);
+    for (size_t s = 0; s < store_.NumStates(); ++s) {
+      state_ngram.clear();
+      ssize_t root = s;
+      for (; parents[root] != -1; root = parents[root])
+        state_ngram.push_back(labels[root]);
+      if (root == initial_ && initial_ != backoff_) state_ngram.push_back(0);
+      std::reverse(state_ngram.begin(), state_ngram.end());
+      (*in_context)[s] = count_of_counts.HasContext(state_ngram);
+    }
+  }
 
-  // TODO(allauzen): run benchmark using map instead of unordered map
-  using PairArcMap = std::unordered_map<Pair, size_t, PairHash>;
+  // Whether an arc leaving state 'state_id', and the state it may lead to,
+  // can be added within the ID limits of the arc maps and of the storage.
+  bool CanAddArc(ssize_t state_id) const {
+    const size_t max_id = std::min<size_t>(FlatArcMap::kMaxId, Storage::kMaxId);
+    return store_.NumArcs() <= max_id && store_.NumStates() <= max_id &&
+           static_cast<size_t>(state_id) <= max_id;
+  }
 
   // Creates the arc corresponding to label 'label' out of the state
-  // with ID 'state_id'.
-  size_t AddArc(ssize_t state_id, Label label) {
-    CountState count_state = states_[state_id];
-    ssize_t arc_id = arcs_.size();
+  // with ID 'state_id'. Returns -1 when there are too many states or arcs
+  // for the arc maps or the storage, putting the counter in a bad state.
+  ssize_t AddArc(ssize_t state_id, Label label) {
+    if (!CanAddArc(state_id)) {
+      if (!Error()) {
+        NGRAMERROR() << "NGramCounter: too many states or arcs";
+        SetError();
+      }
+      return -1;
+    }
+    size_t state_order = store_.Order(state_id);
+    ssize_t backoff_state = store_.BackoffState(state_id);
+
+    // Pre-fills arc with values valid when order_ == 1.
+    ssize_t arc_id = store_.AddArc(label, state_id, initial_, -1);
 
     // Updates the hash entry for the new arc.
-    if (count_state.first_arc == -1) {
-      states_[state_id].first_arc = arc_id;
+    if (store_.FirstArc(state_id) == -1) {
+      store_.SetFirstArc(state_id, arc_id);
     } else {
-      pair_arc_maps_[count_state.order - 1].insert(
-          std::make_pair(std::make_pair(label, state_id), arc_id));
+      arc_maps_[state_order - 1].Insert(FlatArcMap::Key(label, state_id),
+                                        arc_id);
     }
 
-    // Pre-fills arc with values valid when order_ == 1 and returns
-    // if nothing else needs to be done.
-    arcs_.push_back(CountArc(state_id, initial_, label, Weight::Zero(), -1));
+    // Returns if nothing else needs to be done.
     if (order_ == 1) return arc_id;
 
     // First compute the backoff arc
-    ssize_t backoff_arc = count_state.backoff_state == -1
-                              ? -1
-                              : FindArc(count_state.backoff_state, label);
+    ssize_t backoff_arc =
+        backoff_state == -1 ? -1 : FindArc(backoff_state, label);
+    // The arc keeps its valid pre-filled values if the backoff arc could not
+    // be created.
+    if (Error()) return arc_id;
 
     // Second compute the destination state.
     ssize_t destination;
-    if (count_state.order == order_) {
+    if (state_order == order_) {
       // The destination state is the destination of the backoff arc.
-      destination = arcs_[backoff_arc].destination;
+      destination = store_.Destination(backoff_arc);
     } else {
       // The destination state needs to be created.
-      destination = states_.size();
-      CountState next_count_state(
-          backoff_arc == -1 ? backoff_ : arcs_[backoff_arc].destination,
-          count_state.order + 1, Weight::Zero(), -1);
-      states_.push_back(next_count_state);
+      destination = store_.AddState(
+          backoff_arc == -1 ? backoff_ : store_.Destination(backoff_arc),
+          state_order + 1);
     }
     // Updates destination and backoff_arc with the newly computed values.
-    arcs_[arc_id].destination = destination;
-    arcs_[arc_id].backoff_arc = backoff_arc;
+    store_.SetDestination(arc_id, destination);
+    store_.SetBackoffArc(arc_id, backoff_arc);
     return arc_id;
   }
 
@@ -312,30 +848,225 @@ class NGramCounter {
   // out of state of ID 'state_id' by 'count'.
   ssize_t UpdateCount(ssize_t state_id, Label label, Weight count) {
     ssize_t arc_id = FindArc(state_id, label);
-    ssize_t nextstate_id = arcs_[arc_id].destination;
+    if (arc_id == -1) return state_id;
+    ssize_t nextstate_id = store_.Destination(arc_id);
+    if (counts_deferred_) {
+      store_.SetCount(arc_id, Plus(store_.Count(arc_id), count));
+      return nextstate_id;
+    }
     while (arc_id != -1) {
-      arcs_[arc_id].count = Plus(arcs_[arc_id].count, count);
-      arc_id = arcs_[arc_id].backoff_arc;
+      store_.SetCount(arc_id, Plus(store_.Count(arc_id), count));
+      arc_id = store_.BackoffArc(arc_id);
     }
     return nextstate_id;
   }
 
+  // Minimum count of the n-grams of order 'order', <s> included; unigrams
+  // are always counted.
+  double MinCount(size_t order) const {
+    return order == 1 ? 1.0
+                      : min_counts_[std::min(order, min_counts_.size()) - 1];
+  }
+
+  // Key of the n-gram of 'size' labels starting at 'labels' in the sketch,
+  // where label 0 stands for <s> in first position. When 'final' is true,
+  // the key is that of the n-gram followed by </s>.
+  static uint64 NGramKey(const Label *labels, size_t size, bool final) {
+    uint64 key = final ? 0x2545F4914F6CDD1DULL : 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; ++i) {
+      key = (key ^ static_cast<uint64>(labels[i])) * 0x9E3779B97F4A7C15ULL;
+      key ^= key >> 31;
+    }
+    return key;
+  }
+
+  // As CountLabels() with minimum counts. The sketch keys n-grams by their
+  // labels rather than by state, so that the occurrences of an n-gram are
+  // counted even before its context is added.
+  bool CountAdmittedLabels(const Label *labels, size_t size, Weight count) {
+    // Context of the next n-gram, followed by its last label.
+    std::vector<Label> ngram;
+    ngram.reserve(order_);
+    if (order_ > 1) ngram.push_back(0);
+    start_count_ = Plus(start_count_, count);
+    ssize_t count_state = initial_;
+    for (size_t i = 0; i < size; ++i) {
+      if (!labels[i]) continue;
+      ngram.push_back(labels[i]);
+      count_state =
+          UpdateAdmittedCount(count_state, ngram.data(), ngram.size(), count);
+      if (ngram.size() == order_) ngram.erase(ngram.begin());
+    }
+    UpdateAdmittedFinalCount(count_state, ngram.data(), ngram.size(), count);
+    return !Error();
+  }
+
+  // As UpdateCount() for the n-gram of 'size' labels starting at 'ngram',
+  // 'state_id' being the state of the longest suffix of its context that
+  // was added. Each suffix of the n-gram without an arc, from the longest,
+  // is counted in the sketch until its estimated count reaches the minimum
+  // for its order, when it is added; the first suffix with an arc then has
+  // its count and those of its backoff arcs increased.
+  ssize_t UpdateAdmittedCount(ssize_t state_id, const Label *ngram,
+                              size_t size, Weight count) {
+    const Label label = ngram[size - 1];
+    const size_t order = store_.Order(state_id);
+    const double occurrence = std::exp(-count.Value());
+    ssize_t context_id = state_id;
+    for (size_t k = size; k > 0; --k) {
+      ssize_t arc_id = -1;
+      if (k <= order) {
+        if (k < order) context_id = store_.BackoffState(context_id);
+        arc_id = FindExistingArc(context_id, label);
+      }
+      if (arc_id == -1) {
+        const double min_count = MinCount(k);
+        if (min_count > 1.0) {
+          uint64 key = NGramKey(ngram + size - k, k, false);
+          if (sketch_.Estimate(key) + occurrence < min_count) {
+            sketch_.Add(key, occurrence);
+            continue;
+          }
+        }
+        arc_id = AdmitNGram(ngram + size - k, k);
+        if (arc_id == -1) return state_id;
+      }
+      ssize_t nextstate_id = store_.Destination(arc_id);
+      while (arc_id != -1) {
+        store_.SetCount(arc_id, Plus(store_.Count(arc_id), count));
+        arc_id = store_.BackoffArc(arc_id);
+      }
+      return nextstate_id;
+    }
+    return state_id;
+  }
+
+  // As UpdateAdmittedCount() for the end of string after the context of
+  // 'size' labels starting at 'context'.
+  void UpdateAdmittedFinalCount(ssize_t state_id, const Label *context,
+                                size_t size, Weight count) {
+    const size_t order = store_.Order(state_id);
+    const double occurrence = std::exp(-count.Value());
+    ssize_t context_id = state_id;
+    for (size_t k = size + 1; k > 0; --k) {
+      bool added = false;
+      if (k <= order) {
+        if (k < order) context_id = store_.BackoffState(context_id);
+        added = store_.FinalCount(context_id) != Weight::Zero();
+      }
+      if (!added) {
+        const double min_count = MinCount(k);
+        if (min_count > 1.0) {
+          uint64 key = NGramKey(context + size - k + 1, k - 1, true);
+          if (sketch_.Estimate(key) + occurrence < min_count) {
+            sketch_.Add(key, occurrence);
+            continue;
+          }
+        }
+        context_id = AdmitFinal(context + size - k + 1, k - 1);
+        if (context_id == -1) return;
+      }
+      for (; context_id != -1; context_id = store_.BackoffState(context_id)) {
+        store_.SetFinalCount(context_id,
+                             Plus(store_.FinalCount(context_id), count));
+      }
+      return;
+    }
+  }
+
+  // Returns the ID of the state of the context of 'size' labels starting at
+  // 'context', adding the n-grams leading to it if needed, or -1 on error.
+  ssize_t AdmitContext(const Label *context, size_t size) {
+    if (size == 0) return backoff_;
+    if (size == 1 && context[0] == 0) return initial_;
+    ssize_t arc_id = AdmitNGram(context, size);
+    return arc_id == -1 ? -1 : store_.Destination(arc_id);
+  }
+
+  // Returns the ID of the arc of the n-gram of 'size' labels starting at
+  // 'ngram', first adding it, its context and the n-grams it backs off to
+  // if needed. An added arc starts from the count of the earlier
+  // occurrences of its n-gram held by the sketch. Returns -1 on error.
+  ssize_t AdmitNGram(const Label *ngram, size_t size) {
+    ssize_t context_id = AdmitContext(ngram, size - 1);
+    if (context_id == -1) return -1;
+    ssize_t arc_id = FindExistingArc(context_id, ngram[size - 1]);
+    if (arc_id != -1) return arc_id;
+    if (size > 1 && AdmitNGram(ngram + 1, size - 1) == -1) return -1;
+    arc_id = AddArc(context_id, ngram[size - 1]);
+    if (arc_id == -1) return -1;
+    if (MinCount(size) > 1.0) {
+      double pending = sketch_.Estimate(NGramKey(ngram, size, false));
+      if (pending > 0.0) store_.SetCount(arc_id, Weight(-std::log(pending)));
+    }
+    return arc_id;
+  }
+
+  // As AdmitNGram() for the end of string after the context of 'size'
+  // labels starting at 'context', returning the ID of the context state.
+  ssize_t AdmitFinal(const Label *context, size_t size) {
+    ssize_t context_id = AdmitContext(context, size);
+    if (context_id == -1) return -1;
+    if (store_.FinalCount(context_id) != Weight::Zero()) return context_id;
+    if (size > 0 && AdmitFinal(context + 1, size - 1) == -1) return -1;
+    if (MinCount(size + 1) > 1.0) {
+      double pending = sketch_.Estimate(NGramKey(context, size, true));
+      if (pending > 0.0) {
+        store_.SetFinalCount(context_id, Weight(-std::log(pending)));
+      }
+    }
+    return context_id;
+  }
+
+  // Returns the ID of the arc labeled 'label' leaving the state with ID
+  // 'state_id', or -1 if there is none.
+  ssize_t FindExistingArc(ssize_t state_id, Label label) const {
+    ssize_t first_arc = store_.FirstArc(state_id);
+    if (first_arc == -1) return -1;
+    if (store_.ArcLabel(first_arc) == label) return first_arc;
+    uint32 arc_id = arc_maps_[store_.Order(state_id) - 1].Find(
+        FlatArcMap::Key(label, state_id));
+    return arc_id != FlatArcMap::kNoArc ? static_cast<ssize_t>(arc_id) : -1;
+  }
+
   // Increase the count of n-gram corresponding to the super-final arc
   // out of state of ID 'state_id' by 'count'.
   void UpdateFinalCount(ssize_t state_id, Weight count) {
+    if (counts_deferred_) {
+      store_.SetFinalCount(state_id, Plus(store_.FinalCount(state_id), count));
+      return;
+    }
     while (state_id != -1) {
-      states_[state_id].final_count =
-          Plus(states_[state_id].final_count, count);
-      state_id = states_[state_id].backoff_state;
+      store_.SetFinalCount(state_id,
+                           Plus(store_.FinalCount(state_id), count));
+      state_id = store_.BackoffState(state_id);
     }
   }
 
   // Puts the sum of counts of non-backoff arcs leaving s on the backoff arc.
+  // With minimum counts, this is instead the count of the n-gram of s, as
+  // count pruning would keep.
   template <class Arc>
   void StateCounts(fst::MutableFst<Arc> *fst) {
-    for (size_t s = 0; s < states_.size(); ++s) {
-      Weight state_count = states_[s].final_count;
-      if (states_[s].backoff_state != -1) {
+    std::vector<Weight> ngram_counts;
+    if (!min_counts_.empty()) {
+      ngram_counts.assign(store_.NumStates(), Weight::Zero());
+      ngram_counts[initial_] = start_count_;
+      for (size_t a = 0; a < store_.NumArcs(); ++a) {
+        ssize_t destination = store_.Destination(a);
+        if (store_.Order(destination) == store_.Order(store_.Origin(a)) + 1)
+          ngram_counts[destination] = store_.Count(a);
+      }
+    }
+    for (size_t s = 0; s < store_.NumStates(); ++s) {
+      Weight state_count = store_.FinalCount(s);
+      if (store_.BackoffState(s) != -1 && !ngram_counts.empty()) {
+        fst::MutableArcIterator<fst::MutableFst<Arc>> aiter(fst, s);
+        while (aiter.Value().ilabel != 0) aiter.Next();
+        auto arc = aiter.Value();
+        arc.weight = ngram_counts[s].Value();
+        aiter.SetValue(arc);
+      } else if (store_.BackoffState(s) != -1) {
         fst::MutableArcIterator<fst::MutableFst<Arc>> aiter(fst, s);
         ssize_t bo_pos = -1;
         for (; !aiter.Done(); aiter.Next()) {
@@ -359,40 +1090,239 @@ class NGramCounter {
     }
   }
 
+  // Writes the n-grams whose history is that of state 'state_id', followed
+  // by those of its descendants in lexicographic order; 'ngram' holds the
+  // history of the state. 'sorted_arcs' holds the arc IDs sorted by origin
+  // and label, with the arcs leaving state s starting at 'arc_begin[s]'.
+  void WriteSortedNGrams(ssize_t state_id,
+                         const std::vector<size_t> &sorted_arcs,
+                         const std::vector<size_t> &arc_begin,
+                         std::vector<Label> *ngram,
+                         std::ostream &strm) const {
+    if (store_.FinalCount(state_id) != Weight::Zero()) {
+      ngram->push_back(0);
+      fst::WriteType(strm, *ngram);
+      fst::WriteType(strm, store_.FinalCount(state_id));
+      ngram->pop_back();
+    }
+    if (state_id == backoff_ && initial_ != backoff_) {
+      ngram->push_back(0);
+      WriteSortedNGrams(initial_, sorted_arcs, arc_begin, ngram, strm);
+      ngram->pop_back();
+    }
+    for (size_t i = arc_begin[state_id]; i < arc_begin[state_id + 1]; ++i) {
+      size_t arc_id = sorted_arcs[i];
+      ssize_t destination = store_.Destination(arc_id);
+      ngram->push_back(store_.ArcLabel(arc_id));
+      fst::WriteType(strm, *ngram);
+      fst::WriteType(strm, store_.Count(arc_id));
+      if (store_.Order(destination) > store_.Order(state_id))
+        WriteSortedNGrams(destination, sorted_arcs, arc_begin, ngram, strm);
+      ngram->pop_back();
+    }
+  }
+
   template <class Arc>
   bool CountFromTopSortedFst(const Fst<Arc> &fst);
 
   template <class Arc>
   bool CountFromStringFst(const Fst<Arc> &fst);
 
-  struct PairCompare {
-    bool operator()(const Pair &p1, const Pair &p2) const {
-      return p1.first == p2.first ? p1.second > p2.second : p1.first > p2.first;
-    }
-  };
-
-  size_t order_;                    // Maximal order of n-gram being counted
-  std::vector<CountState> states_;  // Vector mapping state IDs to CountStates
-  std::vector<CountArc> arcs_;      // Vector mapping arc IDs to CountArcs
-  ssize_t initial_;                 // ID of start state
-  ssize_t backoff_;                 // ID of unigram/backoff state
-  std::vector<PairArcMap> pair_arc_maps_;  // Maps pairs to arc IDs.
-  bool epsilon_as_backoff_;  // Treat epsilons as backoff trans. in input Fsts
-  float delta_;              // Delta value used by shortest-distance
+  size_t order_;     // Maximal order of n-gram being counted
+  Storage store_;    // States and arcs
+  ssize_t initial_;  // ID of start state
+  ssize_t backoff_;  // ID of unigram/backoff state
+  // Maps (label, state ID) pairs to arc IDs, for all but the first arc
+  // leaving each state, one map per order.
+  std::vector<FlatArcMap> arc_maps_;
+  bool epsilon_as_backoff_;    // Treat epsilons as backoff trans. in input Fsts
+  bool defer_backoff_counts_;  // Defer counts of backoff n-grams
+  bool counts_deferred_;       // Counts of backoff n-grams are pending
+  std::vector<double> min_counts_;  // Minimum counts per order
+  CountMinSketch sketch_;           // Counts of n-grams below the minimum
+  Weight start_count_;  // Count of <s> with minimum counts
   bool error_;
 
   NGramCounter(const NGramCounter &) = delete;
   NGramCounter &operator=(const NGramCounter &) = delete;
 };
 
-template <class Weight, class Label>
+// NGramCounter using the compact storage, for orders up to 255.
+template <class Weight, class Label = int32>
+using NGramCompactCounter =
+    NGramCounter<Weight, Label, NGramCompactCountStorage<Weight, Label>>;
+
+template <class Weight, class Label, class Storage>
+bool NGramCounter<Weight, Label, Storage>::WriteSortedNGrams(
+    std::ostream &strm) {
+  if (Error()) return false;
+  PropagateCounts();
+  std::vector<size_t> sorted_arcs(store_.NumArcs());
+  for (size_t a = 0; a < store_.NumArcs(); ++a) sorted_arcs[a] = a;
+  std::sort(sorted_arcs.begin(), sorted_arcs.end(),
+            [this](size_t a1, size_t a2) {
+              ssize_t origin1 = store_.Origin(a1), origin2 = store_.Origin(a2);
+              return origin1 == origin2
+                         ? store_.ArcLabel(a1) < store_.ArcLabel(a2)
+                         : origin1 < origin2;
+            });
+  std::vector<size_t> arc_begin(store_.NumStates() + 1, 0);
+  for (size_t a = 0; a < store_.NumArcs(); ++a)
+    ++arc_begin[store_.Origin(a) + 1];
+  for (size_t s = 0; s < store_.NumStates(); ++s)
+    arc_begin[s + 1] += arc_begin[s];
+  std::vector<Label> ngram;
+  WriteSortedNGrams(backoff_, sorted_arcs, arc_begin, &ngram, strm);
+  if (!strm) {
+    NGRAMERROR() << "NGramCounter::WriteSortedNGrams: write failed";
+    return false;
+  }
+  return true;
+}
+
+template <class Weight, class Label, class Storage>
+bool NGramCounter<Weight, Label, Storage>::Write(std::ostream &strm) const {
+  if (Error()) return false;
+  fst::WriteType(strm, kNGramCounterMagic);
+  fst::WriteType(strm, static_cast<int64>(order_));
+  fst::WriteType(strm, counts_deferred_);
+  fst::WriteType(strm, static_cast<int64>(initial_));
+  fst::WriteType(strm, static_cast<int64>(backoff_));
+  fst::WriteType(strm, static_cast<int64>(store_.NumStates()));
+  for (size_t s = 0; s < store_.NumStates(); ++s) {
+    fst::WriteType(strm, static_cast<int64>(store_.BackoffState(s)));
+    fst::WriteType(strm, static_cast<int64>(store_.Order(s)));
+    fst::WriteType(strm, static_cast<double>(store_.FinalCount(s).Value()));
+    fst::WriteType(strm, static_cast<int64>(store_.FirstArc(s)));
+  }
+  fst::WriteType(strm, static_cast<int64>(store_.NumArcs()));
+  for (size_t a = 0; a < store_.NumArcs(); ++a) {
+    fst::WriteType(strm, store_.ArcLabel(a));
+    fst::WriteType(strm, static_cast<int64>(store_.Destination(a)));
+    fst::WriteType(strm, static_cast<double>(store_.Count(a).Value()));
+    fst::WriteType(strm, static_cast<int64>(store_.BackoffArc(a)));
+  }
+  for (const auto &arc_map : arc_maps_) {
+    fst::WriteType(strm, static_cast<int64>(arc_map.Size()));
+    arc_map.Visit([&strm](uint64 key, uint32 arc_id) {
+      fst::WriteType(strm, key);
+      fst::WriteType(strm, arc_id);
+    });
+  }
+  if (!strm) {
+    NGRAMERROR() << "NGramCounter::Write: write failed";
+    return false;
+  }
+  return true;
+}
+
+template <class Weight, class Label, class Storage>
+bool NGramCounter<Weight, Label, Storage>::Read(std::istream &strm) {
+  if (Error()) return false;
+  int32 magic = 0;
+  int64 order = 0;
+  fst::ReadType(strm, &magic);
+  fst::ReadType(strm, &order);
+  if (!strm || magic != kNGramCounterMagic) {
+    NGRAMERROR() << "NGramCounter::Read: not an n-gram counter snapshot";
+    SetError();
+    return false;
+  }
+  if (order != static_cast<int64>(order_)) {
+    NGRAMERROR() << "NGramCounter::Read: order mismatch: " << order
+                 << " != " << order_;
+    SetError();
+    return false;
+  }
+  // IDs are checked against the limits of the storage and of the arc maps
+  // as they are read, so that a corrupt snapshot cannot be truncated into
+  // a counter that looks valid.
+  const int64 max_size =
+      std::min<size_t>(FlatArcMap::kMaxId, Storage::kMaxId) + 1;
+  bool counts_deferred = false;
+  int64 initial = -1, backoff = -1, num_states = 0, num_arcs = 0;
+  fst::ReadType(strm, &counts_deferred);
+  fst::ReadType(strm, &initial);
+  fst::ReadType(strm, &backoff);
+  fst::ReadType(strm, &num_states);
+  bool valid = num_states > 0 && num_states <= max_size && initial >= 0 &&
+               initial < num_states && backoff >= 0 && backoff < num_states;
+  store_.Clear();
+  for (int64 s = 0; s < num_states && strm && valid; ++s) {
+    int64 backoff_state = -1, state_order = 0, first_arc = -1;
+    double final_count = 0.0;
+    fst::ReadType(strm, &backoff_state);
+    fst::ReadType(strm, &state_order);
+    fst::ReadType(strm, &final_count);
+    fst::ReadType(strm, &first_arc);
+    // First arcs are checked against the number of arcs once it is known.
+    valid = backoff_state >= -1 && backoff_state < num_states &&
+            state_order >= 1 && state_order <= order &&
+            first_arc >= -1 && first_arc < max_size;
+    if (!valid) break;
+    store_.AddState(backoff_state, state_order);
+    store_.SetFinalCount(s, Weight(final_count));
+    store_.SetFirstArc(s, first_arc);
+  }
+  if (valid) fst::ReadType(strm, &num_arcs);
+  valid = valid && num_arcs >= 0 && num_arcs <= max_size;
+  for (int64 a = 0; a < num_arcs && strm && valid; ++a) {
+    Label label = 0;
+    int64 destination = -1, backoff_arc = -1;
+    double count = 0.0;
+    fst::ReadType(strm, &label);
+    fst::ReadType(strm, &destination);
+    fst::ReadType(strm, &count);
+    fst::ReadType(strm, &backoff_arc);
+    valid = destination >= 0 && destination < num_states &&
+            backoff_arc >= -1 && backoff_arc < num_arcs;
+    if (!valid) break;
+    // The origin is restored from the arc maps once they are read.
+    store_.AddArc(label, -1, destination, backoff_arc);
+    store_.SetCount(a, Weight(count));
+  }
+  for (size_t s = 0; s < store_.NumStates() && valid; ++s)
+    valid = store_.FirstArc(s) < num_arcs;
+  for (auto &arc_map : arc_maps_) {
+    int64 size = 0;
+    if (valid) fst::ReadType(strm, &size);
+    valid = valid && size >= 0 && size <= num_arcs;
+    arc_map.Clear();
+    if (!valid) break;
+    arc_map.Reserve(size);
+    for (int64 i = 0; i < size && strm; ++i) {
+      uint64 key = 0;
+      uint32 arc_id = 0;
+      fst::ReadType(strm, &key);
+      fst::ReadType(strm, &arc_id);
+      valid = arc_id < num_arcs && FlatArcMap::State(key) < num_states;
+      if (!valid) break;
+      arc_map.Insert(key, arc_id);
+    }
+  }
+  if (strm && valid) valid = RestoreArcOrigins();
+  if (!strm || !valid) {
+    NGRAMERROR() << "NGramCounter::Read: "
+                 << (strm ? "bad snapshot" : "read failed");
+    SetError();
+    return false;
+  }
+  initial_ = initial;
+  backoff_ = backoff;
+  defer_backoff_counts_ = counts_deferred;
+  counts_deferred_ = counts_deferred;
+  return true;
+}
+
+template <class Weight, class Label, class Storage>
 template <class Arc>
-bool NGramCounter<Weight, Label>::CountFromStringFst(const Fst<Arc> &fst) {
+bool NGramCounter<Weight, Label, Storage>::CountFromStringFst(const Fst<Arc> &fst) {
   if (!fst.Properties(fst::kString, false)) {
     NGRAMERROR() << "Input FST is not a string";
     return false;
   }
   ssize_t count_state = initial_;
+  std::vector<Label> labels;  // Collected instead with minimum counts.
   auto fst_state = fst.Start();
   Weight weight = fst.Properties(fst::kUnweighted, false)
                       ? Weight::One()
@@ -400,7 +1330,9 @@ bool NGramCounter<Weight, Label>::CountFromStringFst(const Fst<Arc> &fst) {
   while (fst.Final(fst_state) == Arc::Weight::Zero()) {
     fst::ArcIterator<fst::Fst<Arc>> aiter(fst, fst_state);
     const auto &arc = aiter.Value();
-    if (arc.ilabel) {
+    if (arc.ilabel && !min_counts_.empty()) {
+      labels.push_back(arc.ilabel);
+    } else if (arc.ilabel) {
       count_state = UpdateCount(count_state, arc.ilabel, weight);
     } else if (epsilon_as_backoff_) {
       ssize_t next_count_state = NGramBackoffState(count_state);
@@ -413,89 +1345,357 @@ bool NGramCounter<Weight, Label>::CountFromStringFst(const Fst<Arc> &fst) {
       return false;
     }
   }
+  if (!min_counts_.empty()) {
+    return CountAdmittedLabels(labels.data(), labels.size(), weight);
+  }
   UpdateFinalCount(count_state, weight);
-  return true;
+  return !Error();
 }
 
-template <class Weight, class Label>
+template <class Weight, class Label, class Storage>
 template <class Arc>
-bool NGramCounter<Weight, Label>::CountFromTopSortedFst(const Fst<Arc> &fst) {
+bool NGramCounter<Weight, Label, Storage>::CountFromTopSortedFst(const Fst<Arc> &fst) {
   if (!fst.Properties(fst::kTopSorted, false)) {
     NGRAMERROR() << "Input not topologically sorted";
     return false;
   }
-  // Computes shortest-distances from the initial state and to the final
-  // states.
-  std::vector<typename Arc::Weight> fdistance;
-  ShortestDistance(fst, &fdistance, true, delta_);
-  std::vector<Pair> heap;
-  std::unordered_map<Pair, typename Arc::Weight, PairHash> pair2weight;
-  PairCompare compare;
-  Pair start_pair = std::make_pair(fst.Start(), initial_);
-  pair2weight[start_pair] = Arc::Weight::One();
-  heap.push_back(start_pair);
-  std::push_heap(heap.begin(), heap.end(), compare);
-  size_t i = 0;
-  while (!heap.empty()) {
-    std::pop_heap(heap.begin(), heap.end(), compare);
-    Pair current_pair = heap.back();
-    auto fst_state = current_pair.first;
-    ssize_t count_state = current_pair.second;
-    auto current_weight = pair2weight[current_pair];
-    pair2weight.erase(current_pair);
-    heap.pop_back();
-    ++i;
-    for (fst::ArcIterator<fst::Fst<Arc>> aiter(fst, fst_state);
-         !aiter.Done(); aiter.Next()) {
+  if (!min_counts_.empty()) {
+    NGRAMERROR() << "minimum counts require string input";
+    return false;
+  }
+  // Computes the shortest distance from each state to the final states,
+  // in a single backward pass since arcs lead to higher state IDs.
+  const size_t num_states = fst::CountStates(fst);
+  std::vector<typename Arc::Weight> fdistance(num_states);
+  for (size_t s = num_states; s-- > 0;) {
+    typename Arc::Weight distance = fst.Final(s);
+    for (fst::ArcIterator<fst::Fst<Arc>> aiter(fst, s); !aiter.Done();
+         aiter.Next()) {
       const auto &arc = aiter.Value();
-      Pair next_pair(arc.nextstate, count_state);
-      if (arc.ilabel) {
-        Weight count =  Times(current_weight,
-                              Times(arc.weight,
-                                    fdistance[arc.nextstate])).Value();
-        next_pair.second = UpdateCount(count_state, arc.ilabel, count.Value());
-      } else if (epsilon_as_backoff_) {
-        ssize_t next_count_state = NGramBackoffState(count_state);
-        next_pair.second =
-            next_count_state == -1 ? count_state : next_count_state;
+      distance = Plus(distance, Times(arc.weight, fdistance[arc.nextstate]));
+    }
+    fdistance[s] = distance;
+  }
+  // Frontier of (count state, weight) pairs reaching each input state, one
+  // bucket per input state. Since the input is topologically sorted, a
+  // bucket is complete when its state is reached in state order. Its pairs
+  // are then sorted by count state, keeping the order in which the weights
+  // of a count state are summed, and each count state is expanded once.
+  using Entry = std::pair<ssize_t, typename Arc::Weight>;
+  std::vector<std::vector<Entry>> buckets(num_states);
+  buckets[fst.Start()].emplace_back(initial_, Arc::Weight::One());
+  auto compare = [](const Entry &e1, const Entry &e2) {
+    return e1.first < e2.first;
+  };
+  for (size_t fst_state = fst.Start(); fst_state < num_states; ++fst_state) {
+    std::vector<Entry> bucket;
+    bucket.swap(buckets[fst_state]);
+    if (bucket.empty()) continue;
+    std::stable_sort(bucket.begin(), bucket.end(), compare);
+    for (size_t i = 0; i < bucket.size();) {
+      ssize_t count_state = bucket[i].first;
+      auto current_weight = bucket[i].second;
+      for (++i; i < bucket.size() && bucket[i].first == count_state; ++i)
+        current_weight = Plus(current_weight, bucket[i].second);
+      for (fst::ArcIterator<fst::Fst<Arc>> aiter(fst, fst_state);
+           !aiter.Done(); aiter.Next()) {
+        const auto &arc = aiter.Value();
+        ssize_t next_count_state = count_state;
+        if (arc.ilabel) {
+          // The count is converted to the counter weight once per arc.
+          Weight count = Times(current_weight,
+                               Times(arc.weight,
+                                     fdistance[arc.nextstate])).Value();
+          next_count_state = UpdateCount(count_state, arc.ilabel, count);
+        } else if (epsilon_as_backoff_) {
+          ssize_t backoff_state = NGramBackoffState(count_state);
+          next_count_state = backoff_state == -1 ? count_state : backoff_state;
+        }
+        std::vector<Entry> &next_bucket = buckets[arc.nextstate];
+        typename Arc::Weight next_weight = Times(current_weight, arc.weight);
+        // Merges consecutive contributions to the same pair right away.
+        if (!next_bucket.empty() &&
+            next_bucket.back().first == next_count_state) {
+          next_bucket.back().second =
+              Plus(next_bucket.back().second, next_weight);
+        } else {
+          next_bucket.emplace_back(next_count_state, next_weight);
+        }
       }
-      typename Arc::Weight next_weight = Times(current_weight, arc.weight);
-      auto iter = pair2weight.find(next_pair);
-      if (iter == pair2weight.end()) {  // If pair not in heap, inserts it.
-        pair2weight[next_pair] = next_weight;
-        heap.push_back(next_pair);
-        std::push_heap(heap.begin(), heap.end(), compare);
-      } else {  // Otherwise, updates the weight stored for it.
-        iter->second = Plus(iter->second, next_weight);
+      if (fst.Final(fst_state) != Arc::Weight::Zero()) {
+        UpdateFinalCount(count_state,
+                         Times(current_weight, fst.Final(fst_state)).Value());
       }
     }
-    if (fst.Final(fst_state) != Arc::Weight::Zero()) {
-      UpdateFinalCount(count_state,
-                       Times(current_weight, fst.Final(fst_state)).Value());
-    }
   }
-  return true;
+  return !Error();
 }
 
-// Computes ngram counts and returns ngram format FST.
+// Counts n-grams of strings with a suffix array rather than a tree of
+// n-gram states, which suits high orders (e.g. character models) where the
+// tree has far more states and arcs than there are input tokens. Counted
+// strings are only appended to a token stream; the n-grams are enumerated
+// in lexicographic order from the suffix array of that stream when the
+// counts are requested. Lattices and epsilons as backoff transitions are
+// not supported. The interface follows NGramCounter, so that both can be
+// used interchangeably by the counting functions below.
+class NGramSuffixArrayCounter {
+ public:
+  static constexpr size_t kMaxOrder = 255;
+
+  explicit NGramSuffixArrayCounter(
+      size_t order, bool epsilon_as_backoff = false,
+      float delta = kCountDelta, bool defer_backoff_counts = false,
+      const std::vector<double> &min_counts = std::vector<double>(),
+      size_t sketch_memory = kMinCountSketchMemory);
+
+  // Extracts counts from the input string Fst. Returns 'true' when the
+  // counting from the Fst was successful and false otherwise.
+  template <class Arc>
+  bool Count(const fst::Fst<Arc> &fst) {
+    if (Error()) return false;
+    if (!fst.Properties(fst::kString, true)) {
+      NGRAMERROR() << "NGramSuffixArrayCounter: input FST is not a string";
+      SetError();
+      return false;
+    }
+    double count = fst.Properties(fst::kUnweighted, true)
+                       ? 1.0
+                       : std::exp(-ShortestDistance(fst).Value());
+    std::vector<int32> labels;
+    for (auto s = fst.Start(); fst.Final(s) == Arc::Weight::Zero();) {
+      fst::ArcIterator<fst::Fst<Arc>> aiter(fst, s);
+      labels.push_back(aiter.Value().ilabel);
+      s = aiter.Value().nextstate;
+    }
+    return CountLabels(labels.data(), labels.size(), count);
+  }
+
+  template <class Arc>
+  bool Count(fst::MutableFst<Arc> *fst) {
+    return Count(static_cast<const fst::Fst<Arc> &>(*fst));
+  }
+
+  // Extracts counts from the string of 'size' labels starting at 'labels',
+  // each n-gram occurrence having count 'count'. Epsilons are skipped.
+  bool CountLabels(const int32 *labels, size_t size, double count = 1.0);
+
+  // Adds the counts of 'counter', which must have the same order.
+  bool MergeCounts(const NGramSuffixArrayCounter &counter);
+
+  // Adds count to the unigram count of all symbols in the symbol table.
+  void AddCountToSymbolUnigrams(const fst::SymbolTable &syms,
+                                double neg_log_count);
+
+  // Gets an FST representation of the ngram counts, whose states are in
+  // lexicographic order of their histories, and fills the histograms of
+  // 'count_of_counts' if not null.
+  void GetFst(fst::StdMutableFst *fst,
+              NGramCountOfCounts<fst::StdArc> *count_of_counts = nullptr);
+
+  // Writes all n-grams and their counts to 'strm', in the format of
+  // NGramCounter::WriteSortedNGrams.
+  bool WriteSortedNGrams(std::ostream &strm);
+
+  // Writes the counted strings to 'strm' as a snapshot, from which Read()
+  // restores them so that counting can be resumed.
+  bool Write(std::ostream &strm) const;
+
+  // Replaces the counted strings by those of a snapshot written by Write()
+  // with the same order.
+  bool Read(std::istream &strm);
+
+  // Approximate number of bytes used by the counted strings, not including
+  // the suffix array built when the counts are requested.
+  size_t MemoryUsage() const;
+
+  // Removes all counted strings.
+  void Clear();
+
+  // Maximal order of the n-grams being counted.
+  size_t Order() const { return order_; }
+
+  bool EpsilonAsBackoff() const { return false; }
+
+  // Counts are always complete; kept for NGramCounter compatibility.
+  bool DeferBackoffCounts() const { return defer_backoff_counts_; }
+
+  // Returns true if counter setup is in a bad state.
+  bool Error() const { return error_; }
+
+ private:
+  void SetError() { error_ = true; }
+
+  // Starts a segment of the token stream whose n-grams have count 'count'.
+  void AddSegment(double count);
+
+  // Count of the n-grams starting at token 'pos'.
+  double PositionCount(uint32 pos) const;
+
+  // Length of the shortest n-gram starting at token 'pos': 2 for <s>,
+  // which is not a unigram, and 1 otherwise.
+  size_t MinLength(uint32 pos) const {
+    return tokens_[pos] == 0 && spans_[pos] > 1 ? 2 : 1;
+  }
+
+  // Number of leading tokens shared by the n-grams starting at 'pos1' and
+  // 'pos2'.
+  size_t CommonPrefix(uint32 pos1, uint32 pos2) const;
+
+  // Sorts the token positions by the n-grams starting there.
+  void BuildSuffixArray(std::vector<uint32> *suffixes) const;
+
+  // Calls 'visit(ngram, count)' for each n-gram in lexicographic order.
+  template <class Visitor>
+  bool VisitNGrams(Visitor visit);
+
+  size_t order_;
+  // Counted strings, each as <s> (when order > 1), its non-epsilon labels
+  // and </s>, all three being label 0 in an n-gram.
+  std::vector<int32> tokens_;
+  // Number of tokens of the longest n-gram starting at each position.
+  std::vector<uint8> spans_;
+  // First token and count of segments with the same count.
+  std::vector<uint32> segment_starts_;
+  std::vector<double> segment_counts_;
+  bool unit_counts_;  // All segment counts are 1.
+  bool defer_backoff_counts_;
+  bool error_;
+
+  NGramSuffixArrayCounter(const NGramSuffixArrayCounter &) = delete;
+  NGramSuffixArrayCounter &operator=(const NGramSuffixArrayCounter &) = delete;
+};
+
+// Options of the counting functions below.
+struct NGramCountOptions {
+  // Whether the input FSTs must have symbol tables.
+  bool require_symbols = true;
+  // Whether epsilons of the input FSTs are backoff transitions.
+  bool epsilon_as_backoff = false;
+  // Whether the counts are rounded to integers (FST output).
+  bool round_to_int = false;
+  // Count added to the unigram of each symbol, if positive.
+  double add_to_symbol_unigram_count = 0.0;
+  // When greater than one, consecutive shards of the input are counted in
+  // parallel and merged, producing the same counts as sequential counting
+  // (FAR input).
+  int threads = 1;
+  // When non-zero, in-memory counts exceeding approximately that many bytes
+  // are spilled to sorted runs on disk, which are merged into the output
+  // FST; its states are then in lexicographic n-gram order. With threads,
+  // half of that budget goes to the merged counts and the rest is split
+  // among the counters of the shards being counted, each spilling its own
+  // runs; merging a batch may exceed the budget by about a quarter (FST
+  // output).
+  size_t max_memory = 0;
+  // When not null, the labels of the input FSTs, which must share a symbol
+  // table, are mapped to those of the same words in 'vocab' before counting,
+  // and 'vocab' is the symbol table of the result (FAR input).
+  const fst::SymbolTable *vocab = nullptr;
+  // Word that words not in the symbol table of text input, or not in
+  // 'vocab', are mapped to; required with 'vocab'. When empty, sentences of
+  // text input containing such words are skipped.
+  std::string oov_symbol;
+  // Whether counts are held by an NGramCompactCounter.
+  bool compact = false;
+  // Whether only the highest-order n-gram at each position is counted, the
+  // lower-order counts being derived afterwards.
+  bool defer_backoff_counts = false;
+  // Whether counts are summed as RealCountWeight.
+  bool real_counts = false;
+  // Whether the input, which must then be strings, is counted by an
+  // NGramSuffixArrayCounter; the 'compact', 'defer_backoff_counts' and
+  // 'real_counts' options are then ignored (FST output).
+  bool suffix_array = false;
+  // When not empty, counting starts from the counts of that snapshot file,
+  // saved with the same order and with or without 'suffix_array' alike. Its
+  // symbol table must agree with that of the input on the labels and words
+  // they share, and is merged into the symbol table of the result (FST
+  // output).
+  std::string resume_from;
+  // When not empty, the counts and their symbol table are saved to that
+  // snapshot file, which requires that none were spilled (FST output).
+  std::string save_snapshot;
+  // Passed to the NGramCounter constructor with 'sketch_memory'; n-grams
+  // below their order's minimum count are then not counted, as if the
+  // counts were count pruned. As the pending counts of the sketch are
+  // neither shared between counters nor saved, with several threads,
+  // 'max_memory' or a snapshot all n-grams are counted instead, and the
+  // merged counts are count pruned (FST output).
+  std::vector<double> min_counts;
+  size_t sketch_memory = kMinCountSketchMemory;
+  // When not null, its histograms are filled as the counts are output, as
+  // GetNGramCountOfCounts() would from the resulting FST (FST output).
+  NGramCountOfCounts<fst::StdArc> *count_of_counts = nullptr;
+};
+
+// Computes ngram counts with 'options' and returns ngram format FST.
+bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
+                    fst::StdMutableFst *fst, int order,
+                    const NGramCountOptions &options);
+
 bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
                     fst::StdMutableFst *fst, int order,
                     bool require_symbols = true,
                     bool epsilon_as_backoff = false, bool round_to_int = false,
                     double add_to_symbol_unigram_count = 0.0);
 
+// Computes ngram counts and returns vector of strings, with the options
+// above that are not for FST output only.
+bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
+                    std::vector<std::string> *ngrams, int order,
+                    const NGramCountOptions &options);
+
 bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
                     std::vector<std::string> *ngrams, int order,
                     bool epsilon_as_backoff = false,
                     double add_to_symbol_unigram_count = 0.0);
 
-// Computes counts using the HistogramArc template.
+// Computes ngram counts and writes them to 'strm', one per line in the form
+// of the strings above, as they are read from the counter rather than
+// collected first.
+bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
+                    std::ostream *strm, int order,
+                    const NGramCountOptions &options);
+
+// Computes ngram counts from the sentences in 'strm', one per line, made of
+// whitespace-separated words mapped to labels by 'syms', and returns ngram
+// format FST. The options for FAR input are ignored.
+bool GetNGramCountsFromText(std::istream &strm, const fst::SymbolTable &syms,
+                            fst::StdMutableFst *fst, int order,
+                            const NGramCountOptions &options);
+
+bool GetNGramCountsFromText(std::istream &strm, const fst::SymbolTable &syms,
+                            std::vector<std::string> *ngrams, int order,
+                            const NGramCountOptions &options);
+
+// Computes ngram counts from text and writes them to 'ostrm', one per line
+// in the form of the strings above, as they are read from the counter.
+bool GetNGramCountsFromText(std::istream &strm, const fst::SymbolTable &syms,
+                            std::ostream *ostrm, int order,
+                            const NGramCountOptions &options);
+
+// Builds an ngram format FST of order 'order' from the n-gram counts read
+// from 'strms', each holding n-grams as written by
+// NGramCounter::WriteSortedNGrams. The counts of n-grams found in several
+// streams are summed. If 'count_of_counts' is not null, its histograms are
+// filled from the summed counts. Returns 'true' on success and false
+// otherwise.
+bool MergeSortedNGramCounts(
+    const std::vector<std::istream *> &strms, int order,
+    fst::StdMutableFst *fst,
+    NGramCountOfCounts<fst::StdArc> *count_of_counts = nullptr);
+
+// Computes counts using the HistogramArc template. With 'threads' > 1 and
+// no normalization, the inputs are counted in parallel and their histograms
+// merged in a parallel reduction tree.
 bool GetNGramHistograms(fst::FarReader<fst::StdArc> *far_reader,
                         fst::VectorFst<fst::HistogramArc> *fst,
                         int order, bool epsilon_as_backoff = false,
                         int backoff_label = 0, double norm_eps = kNormEps,
                         bool check_consistency = false, bool normalize = false,
-                        double alpha = 1.0, double beta = 1.0);
+                        double alpha = 1.0, double beta = 1.0,
+                        int threads = 1);
 
 // Computes count-of-counts.
 template <class Arc>
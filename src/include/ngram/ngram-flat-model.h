@@ -0,0 +1,945 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Read-only n-gram model stored in flat arrays for fast scoring.
+
+#ifndef NGRAM_NGRAM_FLAT_MODEL_H_
+#define NGRAM_NGRAM_FLAT_MODEL_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fst/fst.h>
+#include <fst/symbol-table.h>
+#include <ngram/ngram-model.h>
+#include <ngram/util.h>
+
+namespace ngram {
+
+// Immutable copy of an n-gram model for scoring. The arcs of all states are
+// stored contiguously, in the compressed sparse row layout: the labels,
+// weights and destination states of the arcs leaving a state are found at
+// the same range of positions of three arrays, in label order. The backoff
+// arc is taken out of that range and stored with the state, together with
+// its final weight and order. State IDs are those of the model, so states
+// can be passed between the two.
+//
+// Finding an n-gram thus reads the state entry and searches a range of
+// labels, instead of going through per-state arc vectors and a matcher for
+// each backoff step.
+//
+// The model can also carry the label and cost given to out-of-vocabulary
+// words, for models whose unigram distribution was renormalized for them.
+//
+// Quantize() replaces the weights of the arcs, final weights and backoff
+// weights by codes of a few bits, packed together, that index per-order
+// codebooks: one for the n-gram costs of each order and one for the
+// backoff costs of the states of each order.
+//
+// Write() stores the arrays as they are in memory, and Read() maps them
+// back without copying, so that the pages are shared by all processes
+// reading the model. Read() only checks the header in constant time; it
+// makes a pass over the states and arcs, to check that they index within
+// the arrays, only when asked to verify the model.
+//
+// ScoreSentences() scores a batch of sentences together, interleaving the
+// lookups of several of them so that the memory accesses of each are
+// prefetched while the others are scored.
+template <class Arc>
+class NGramFlatModel {
+ public:
+  typedef typename Arc::StateId StateId;
+  typedef typename Arc::Label Label;
+  typedef typename Arc::Weight Weight;
+
+  static constexpr size_t kNoArc = static_cast<size_t>(-1);
+
+  explicit NGramFlatModel(
+      const NGramModel<Arc> &model, Label oov_label = kNoLabel,
+      double oov_cost = NGramModel<Arc>::ScalarValue(Weight::Zero()))
+      : header_(), mapped_(nullptr), mapped_size_(0) {
+    const Fst<Arc> &fst = model.GetFst();
+    header_.magic = kMagic;
+    header_.state_size = sizeof(State);
+    header_.label_size = sizeof(Label);
+    header_.weight_size = sizeof(Weight);
+    header_.hi_order = model.HiOrder();
+    header_.start = fst.Start();
+    header_.unigram = model.UnigramState();
+    header_.backoff_label = model.BackoffLabel();
+    header_.num_states = model.NumStates();
+    header_.weight_bits = 0;
+    header_.num_arcs = 0;
+    header_.oov_label = oov_label;
+    header_.oov_cost = oov_cost;
+    for (StateId st = 0; st < model.NumStates(); ++st)
+      header_.num_arcs += fst.NumArcs(st);
+    state_storage_.resize(model.NumStates());
+    backoff_weight_storage_.resize(model.NumStates(), Weight::Zero());
+    final_weight_storage_.resize(model.NumStates());
+    label_storage_.reserve(header_.num_arcs);
+    weight_storage_.reserve(header_.num_arcs);
+    nextstate_storage_.reserve(header_.num_arcs);
+    for (StateId st = 0; st < model.NumStates(); ++st) {
+      State &state = state_storage_[st];
+      state.arc_begin = label_storage_.size();
+      state.backoff = kNoStateId;
+      final_weight_storage_[st] = fst.Final(st);
+      state.order = model.StateOrder(st);
+      for (ArcIterator<Fst<Arc>> aiter(fst, st); !aiter.Done(); aiter.Next()) {
+        const Arc &arc = aiter.Value();
+        if (arc.ilabel == header_.backoff_label) {
+          state.backoff = arc.nextstate;
+          backoff_weight_storage_[st] = arc.weight;
+        } else if (arc.ilabel != kNoLabel) {
+          label_storage_.push_back(arc.ilabel);
+          weight_storage_.push_back(arc.weight);
+          nextstate_storage_.push_back(arc.nextstate);
+        }
+      }
+      state.num_arcs = label_storage_.size() - state.arc_begin;
+    }
+    header_.num_arcs = label_storage_.size();
+    states_ = state_storage_.data();
+    labels_ = label_storage_.data();
+    nextstates_ = nextstate_storage_.data();
+    SetWeights(weight_storage_.data(), backoff_weight_storage_.data(),
+               final_weight_storage_.data());
+    if (fst.InputSymbols()) syms_.reset(fst.InputSymbols()->Copy());
+    header_.has_symbols = syms_ != nullptr;
+  }
+
+  ~NGramFlatModel() {
+    if (mapped_) munmap(mapped_, mapped_size_);
+  }
+
+  // Returns true if 'filename' holds a model written by Write().
+  static bool IsFlatModel(const std::string &filename) {
+    std::ifstream strm(filename, std::ios_base::in | std::ios_base::binary);
+    int32 magic = 0;
+    strm.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    return strm && magic == kMagic;
+  }
+
+  // Maps the model written to 'filename' by Write() into memory. Only the
+  // header and the bounds of the sections are checked, so that loading
+  // takes about as long as mapping the file; with 'verify', the states and
+  // arcs are also checked with Verify(), which files from untrusted sources
+  // need for lookups to stay in bounds. Returns null on error.
+  static NGramFlatModel *Read(const std::string &filename,
+                              bool verify = false) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      LOG(ERROR) << "NGramFlatModel::Read: Can't open file: " << filename;
+      return nullptr;
+    }
+    struct stat st;
+    void *mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+      mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      LOG(ERROR) << "NGramFlatModel::Read: Can't map file: " << filename;
+      return nullptr;
+    }
+    std::unique_ptr<NGramFlatModel> model(new NGramFlatModel(mapped,
+                                                             st.st_size));
+    const Header &header = model->header_;
+    if (header.magic != kMagic || header.state_size != sizeof(State) ||
+        header.label_size != sizeof(Label) ||
+        header.weight_size != sizeof(Weight)) {
+      LOG(ERROR) << "NGramFlatModel::Read: Not a flat model of this arc type: "
+                 << filename;
+      return nullptr;
+    }
+    // Offset() returns kNoOffset, which no file reaches, for counts whose
+    // sections would overflow.
+    if (header.weight_bits < 0 || header.weight_bits > kMaxWeightBits ||
+        header.hi_order < 0 || header.hi_order > header.num_states ||
+        (header.num_states > 0 &&
+         (header.start < 0 || header.start >= header.num_states)) ||
+        header.unigram < -1 || header.unigram >= header.num_states ||
+        Offset(header, kCodebooks) > static_cast<size_t>(st.st_size)) {
+      LOG(ERROR) << "NGramFlatModel::Read: Bad header or truncated file: "
+                 << filename;
+      return nullptr;
+    }
+    const char *data = static_cast<const char *>(mapped);
+    model->states_ =
+        reinterpret_cast<const State *>(data + Offset(header, kStates));
+    model->labels_ =
+        reinterpret_cast<const Label *>(data + Offset(header, kLabels));
+    model->nextstates_ =
+        reinterpret_cast<const StateId *>(data + Offset(header, kNextStates));
+    if (header.weight_bits == 0) {
+      model->SetWeights(
+          reinterpret_cast<const Weight *>(data + Offset(header, kWeights)),
+          reinterpret_cast<const Weight *>(data +
+                                           Offset(header, kBackoffWeights)),
+          reinterpret_cast<const Weight *>(data +
+                                           Offset(header, kFinalWeights)));
+    } else {
+      // The codebooks start with their sizes, which give the position of
+      // the symbols.
+      const uint32 *sizes =
+          reinterpret_cast<const uint32 *>(data + Offset(header, kCodebooks));
+      const float *values = reinterpret_cast<const float *>(
+          sizes + NumCodebooks(header.hi_order));
+      size_t end = reinterpret_cast<const char *>(values) - data;
+      for (int i = 0; i < NumCodebooks(header.hi_order); ++i) {
+        if (end > static_cast<size_t>(st.st_size)) break;
+        end += sizes[i] * sizeof(float);
+        model->codebooks_.push_back(values);
+        model->codebook_sizes_.push_back(sizes[i]);
+        values += sizes[i];
+      }
+      if (end > static_cast<size_t>(st.st_size)) {
+        LOG(ERROR) << "NGramFlatModel::Read: File is truncated: " << filename;
+        return nullptr;
+      }
+      model->SetCodes(
+          reinterpret_cast<const uint8 *>(data + Offset(header, kWeights)),
+          reinterpret_cast<const uint8 *>(data +
+                                          Offset(header, kBackoffWeights)),
+          reinterpret_cast<const uint8 *>(data +
+                                          Offset(header, kFinalWeights)));
+    }
+    if (verify && !model->Verify()) {
+      LOG(ERROR) << "NGramFlatModel::Read: Bad states or arcs: " << filename;
+      return nullptr;
+    }
+    if (header.has_symbols) {
+      std::ifstream strm(filename, std::ios_base::in | std::ios_base::binary);
+      strm.seekg(model->SymbolsOffset());
+      model->syms_.reset(fst::SymbolTable::Read(strm, filename));
+      if (!model->syms_) {
+        LOG(ERROR) << "NGramFlatModel::Read: Can't read symbols: " << filename;
+        return nullptr;
+      }
+    }
+    return model.release();
+  }
+
+  // Writes the model, followed by its symbol table, to 'filename'.
+  bool Write(const std::string &filename) const {
+    std::ofstream strm(filename, std::ios_base::out | std::ios_base::binary);
+    if (!strm) {
+      LOG(ERROR) << "NGramFlatModel::Write: Can't open file: " << filename;
+      return false;
+    }
+    strm.write(reinterpret_cast<const char *>(&header_), sizeof(header_));
+    WriteArray(strm, kStates, states_, header_.num_states);
+    WriteArray(strm, kLabels, labels_, header_.num_arcs);
+    WriteWeights(strm, kWeights, weights_, weight_codes_, header_.num_arcs);
+    WriteArray(strm, kNextStates, nextstates_, header_.num_arcs);
+    WriteWeights(strm, kBackoffWeights, backoff_weights_, backoff_codes_,
+                 header_.num_states);
+    WriteWeights(strm, kFinalWeights, final_weights_, final_codes_,
+                 header_.num_states);
+    if (header_.weight_bits != 0) {
+      WriteArray(strm, kCodebooks, codebook_sizes_.data(),
+                 codebook_sizes_.size());
+      for (int i = 0; i < NumCodebooks(header_.hi_order); ++i) {
+        strm.write(reinterpret_cast<const char *>(codebooks_[i]),
+                   codebook_sizes_[i] * sizeof(float));
+      }
+    }
+    Pad(strm, SymbolsOffset());
+    if (syms_) syms_->Write(strm);
+    if (!strm) {
+      LOG(ERROR) << "NGramFlatModel::Write: Write failed: " << filename;
+      return false;
+    }
+    return true;
+  }
+
+  // Checks that what the states of the model index is in bounds: their arc
+  // ranges, the destinations of their arcs, whose labels must increase for
+  // the search, their backoff states, whose orders must decrease so that
+  // backing off ends, their orders, which index the codebooks, and the
+  // codes of a quantized model. Lookups then stay in the arrays of a read
+  // model whatever its file holds. Takes time linear in the size of the
+  // model.
+  bool Verify() const {
+    const StateId num_states = header_.num_states;
+    const size_t num_arcs = header_.num_arcs;
+    for (StateId st = 0; st < num_states; ++st) {
+      const State &state = states_[st];
+      if (state.order < 1 || state.order > header_.hi_order ||
+          state.arc_begin > num_arcs ||
+          state.num_arcs > num_arcs - state.arc_begin) {
+        return false;
+      }
+      if (state.backoff < -1 ||
+          (state.backoff >= 0 &&
+           (state.backoff >= num_states ||
+            states_[state.backoff].order >= state.order))) {
+        return false;
+      }
+      const size_t arc_end = state.arc_begin + state.num_arcs;
+      for (size_t arc = state.arc_begin; arc < arc_end; ++arc) {
+        if (nextstates_[arc] < 0 || nextstates_[arc] >= num_states ||
+            (arc > state.arc_begin && labels_[arc] <= labels_[arc - 1])) {
+          return false;
+        }
+        if (header_.weight_bits != 0 &&
+            GetCode(weight_codes_, arc) >=
+                codebook_sizes_[Codebook(state.order, false)]) {
+          return false;
+        }
+      }
+      if (header_.weight_bits != 0 &&
+          (GetCode(final_codes_, st) >=
+               codebook_sizes_[Codebook(state.order, false)] ||
+           (state.backoff >= 0 &&
+            GetCode(backoff_codes_, st) >=
+                codebook_sizes_[Codebook(state.order, true)]))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  StateId Start() const { return header_.start; }
+
+  StateId UnigramState() const { return header_.unigram; }
+
+  int HiOrder() const { return header_.hi_order; }
+
+  StateId NumStates() const { return header_.num_states; }
+
+  // Label and cost of out-of-vocabulary words, if given when building.
+  Label OOVLabel() const { return header_.oov_label; }
+
+  double OOVCost() const { return header_.oov_cost; }
+
+  const fst::SymbolTable *InputSymbols() const { return syms_.get(); }
+
+  // Number of bits of the weight codes, or 0 if the weights aren't
+  // quantized.
+  int WeightBits() const { return header_.weight_bits; }
+
+  // Quantizes the weights of a model that was built, not read, to codes of
+  // 'bits' bits. The costs of each codebook are split into as many ranges
+  // of equally many costs as there are codes, each represented by its
+  // mean; a codebook with no more distinct costs than codes keeps them
+  // exactly. Returns false on error.
+  bool Quantize(int bits) {
+    if (mapped_ || header_.weight_bits != 0) {
+      NGRAMERROR() << "NGramFlatModel::Quantize: Model is already quantized "
+                   << "or read from a file";
+      return false;
+    }
+    if (bits < 1 || bits > kMaxWeightBits) {
+      NGRAMERROR() << "NGramFlatModel::Quantize: Bits must be between 1 and "
+                   << kMaxWeightBits << ": " << bits;
+      return false;
+    }
+    // Collects the costs of each codebook.
+    std::vector<std::vector<float>> costs(NumCodebooks(header_.hi_order));
+    for (StateId st = 0; st < header_.num_states; ++st) {
+      const State &state = states_[st];
+      std::vector<float> &ngram_costs = costs[Codebook(state.order, false)];
+      for (size_t arc = state.arc_begin;
+           arc < state.arc_begin + state.num_arcs; ++arc) {
+        ngram_costs.push_back(weights_[arc].Value());
+      }
+      ngram_costs.push_back(final_weights_[st].Value());
+      if (state.backoff >= 0) {
+        costs[Codebook(state.order, true)].push_back(
+            backoff_weights_[st].Value());
+      }
+    }
+    codebook_storage_.resize(costs.size());
+    for (size_t i = 0; i < costs.size(); ++i)
+      MakeCodebook(&costs[i], size_t{1} << bits, &codebook_storage_[i]);
+    codebooks_.clear();
+    codebook_sizes_.clear();
+    for (const auto &codebook : codebook_storage_) {
+      codebooks_.push_back(codebook.data());
+      codebook_sizes_.push_back(codebook.size());
+    }
+    // Replaces the weights by their codes.
+    std::vector<uint8> weight_codes(CodesSize(header_.num_arcs, bits), 0);
+    std::vector<uint8> backoff_codes(CodesSize(header_.num_states, bits), 0);
+    std::vector<uint8> final_codes(CodesSize(header_.num_states, bits), 0);
+    for (StateId st = 0; st < header_.num_states; ++st) {
+      const State &state = states_[st];
+      const std::vector<float> &ngram_codebook =
+          codebook_storage_[Codebook(state.order, false)];
+      for (size_t arc = state.arc_begin;
+           arc < state.arc_begin + state.num_arcs; ++arc) {
+        PutCode(weight_codes.data(), arc, bits,
+                Encode(ngram_codebook, weights_[arc].Value()));
+      }
+      PutCode(final_codes.data(), st, bits,
+              Encode(ngram_codebook, final_weights_[st].Value()));
+      if (state.backoff >= 0) {
+        PutCode(backoff_codes.data(), st, bits,
+                Encode(codebook_storage_[Codebook(state.order, true)],
+                       backoff_weights_[st].Value()));
+      }
+    }
+    weight_code_storage_.swap(weight_codes);
+    backoff_code_storage_.swap(backoff_codes);
+    final_code_storage_.swap(final_codes);
+    std::vector<Weight>().swap(weight_storage_);
+    std::vector<Weight>().swap(backoff_weight_storage_);
+    std::vector<Weight>().swap(final_weight_storage_);
+    header_.weight_bits = bits;
+    SetCodes(weight_code_storage_.data(), backoff_code_storage_.data(),
+             final_code_storage_.data());
+    return true;
+  }
+
+  // Number of arcs leaving 'st', not counting the backoff arc.
+  size_t NumArcs(StateId st) const { return states_[st].num_arcs; }
+
+  int StateOrder(StateId st) const { return states_[st].order; }
+
+  Weight Final(StateId st) const {
+    if (header_.weight_bits == 0) return final_weights_[st];
+    return Decode(final_codes_, st, Codebook(states_[st].order, false));
+  }
+
+  // Returns the backoff state of 'st', or -1 if there is none, and its cost
+  // in 'bocost' if not null.
+  StateId GetBackoff(StateId st, Weight *bocost) const {
+    if (bocost) *bocost = BackoffWeight(st);
+    return states_[st].backoff;
+  }
+
+  // Returns the position of the arc labeled 'label' leaving 'st', or kNoArc
+  // if there is none. The labels of large states (the unigram state in
+  // particular) are usually spread evenly over their range, so these are
+  // first narrowed down by interpolating on the label values; what remains
+  // is binary searched.
+  size_t FindArc(StateId st, Label label) const {
+    const State &state = states_[st];
+    const Label *begin = labels_ + state.arc_begin;
+    const Label *first = begin;
+    const Label *last = begin + state.num_arcs;
+    for (int probe = 0;
+         probe < kInterpolationProbes && last - first > kMinInterpolationArcs;
+         ++probe) {
+      const double low = first[0], high = last[-1];
+      if (label < low || label > high) return kNoArc;
+      const Label *guess =
+          first + static_cast<size_t>((label - low) / (high - low) *
+                                      (last - first - 1));
+      if (*guess == label) return state.arc_begin + (guess - begin);
+      if (*guess < label) {
+        first = guess + 1;
+      } else {
+        last = guess;
+      }
+    }
+    const Label *it = std::lower_bound(first, last, label);
+    if (it == last || *it != label) return kNoArc;
+    return state.arc_begin + (it - begin);
+  }
+
+  Label ArcLabel(size_t arc) const { return labels_[arc]; }
+
+  // Weight of the arc at position 'arc', which leaves 'st'.
+  Weight ArcWeight(StateId st, size_t arc) const {
+    if (header_.weight_bits == 0) return weights_[arc];
+    return Decode(weight_codes_, arc, Codebook(states_[st].order, false));
+  }
+
+  StateId ArcNextState(size_t arc) const { return nextstates_[arc]; }
+
+  // As NGramModel::FindNGramInModel(): follows backoff arcs from '*mst'
+  // until an arc labeled 'label' is found, and returns the destination of
+  // that arc in '*mst', the order of the state it leaves in '*order' and
+  // the accumulated cost in '*cost'. Returns false if 'label' is not in
+  // the model.
+  bool FindNGramInModel(StateId *mst, int *order, Label label,
+                        double *cost) const {
+    if (label < 0) return false;
+    const Label backoff_label = header_.backoff_label;
+    StateId currstate = *mst;
+    *cost = 0;
+    *mst = -1;
+    while (*mst < 0) {
+      const State &state = states_[currstate];
+      const size_t arc = label == backoff_label ? kNoArc
+                                                : FindArc(currstate, label);
+      if (arc != kNoArc) {
+        *order = state.order;
+        *mst = nextstates_[arc];
+        *cost += NGramModel<Arc>::ScalarValue(ArcWeight(currstate, arc));
+      } else if (state.backoff >= 0) {
+        *cost += NGramModel<Arc>::ScalarValue(BackoffWeight(currstate));
+        if (label == backoff_label) {  // Reads the backoff arc itself.
+          *order = state.order;
+          *mst = state.backoff;
+        } else {
+          currstate = state.backoff;
+        }
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Cost and order of a word scored by ScoreSentences(): as returned by
+  // FindNGramInModel() or, for a word that is not in the model, the cost of
+  // backing off to the unigram state plus OOVCost(), with order -1.
+  struct WordScore {
+    double cost;
+    int order;
+  };
+
+  // Scores each of 'sentences' from the start state as ngramperplexity
+  // does, continuing from the unigram state after a word that is not in
+  // the model. (*scores)[i] gets the scores of the words of sentence i,
+  // followed by that of the end of sentence. Up to kScoreLanes sentences
+  // are scored at a time, a word of each in turn. What the lookup of the
+  // next word of a sentence reads is prefetched in steps over all the
+  // sentences before any is scored, so that the cache misses of a
+  // sentence are waited for while the others are prefetched or scored.
+  void ScoreSentences(const std::vector<std::vector<Label>> &sentences,
+                      std::vector<std::vector<WordScore>> *scores) const {
+    scores->resize(sentences.size());
+    for (auto &sentence_scores : *scores) sentence_scores.clear();
+    std::vector<ScoreLane> lanes;
+    lanes.reserve(kScoreLanes);
+    size_t next_sentence = 0;
+    while (true) {
+      while (lanes.size() < kScoreLanes && next_sentence < sentences.size()) {
+        ScoreLane lane{&sentences[next_sentence], &(*scores)[next_sentence],
+                       0, Start()};
+        ++next_sentence;
+        lane.scores->reserve(lane.sentence->size() + 1);
+        if (lane.sentence->empty()) {
+          AddFinalScore(lane.state, lane.scores);
+        } else {
+          PrefetchState(lane.state);
+          lanes.push_back(lane);
+        }
+      }
+      if (lanes.empty()) break;
+      // The state of each sentence was prefetched when it was reached; its
+      // arcs and backoff state are prefetched next, then the arcs of the
+      // backoff state, which are searched when the n-gram is missing.
+      for (const ScoreLane &lane : lanes) {
+        const StateId backoff = states_[lane.state].backoff;
+        PrefetchArcs(lane.state, (*lane.sentence)[lane.pos]);
+        if (backoff >= 0) PrefetchState(backoff);
+      }
+      for (const ScoreLane &lane : lanes) {
+        const StateId backoff = states_[lane.state].backoff;
+        if (backoff >= 0) PrefetchArcs(backoff, (*lane.sentence)[lane.pos]);
+      }
+      for (size_t i = 0; i < lanes.size();) {
+        if (ScoreWord(&lanes[i])) {
+          ++i;
+        } else {  // Done with the sentence.
+          lanes[i] = lanes.back();
+          lanes.pop_back();
+        }
+      }
+    }
+  }
+
+  // As NGramModel::FinalCostInModel(): follows backoff arcs from 'mst' until
+  // a final state is found, and returns the accumulated cost, with the
+  // order of that state in '*order'.
+  Weight FinalCostInModel(StateId mst, int *order) const {
+    Weight cost = Weight::One();
+    Weight final_weight = Final(mst);
+    while (final_weight == Weight::Zero()) {
+      if (states_[mst].backoff < 0) {
+        NGRAMERROR() << "NGramFlatModel: No final cost in model: " << mst;
+        *order = -1;
+        return Weight::Zero();
+      }
+      cost = Times(cost, BackoffWeight(mst));
+      mst = states_[mst].backoff;
+      final_weight = Final(mst);
+    }
+    *order = states_[mst].order;
+    return Times(cost, final_weight);
+  }
+
+ private:
+  // Large states are searched by interpolation for at most this many probes.
+  static constexpr int kInterpolationProbes = 2;
+  static constexpr ptrdiff_t kMinInterpolationArcs = 64;
+
+  static constexpr int32 kMagic = 0x4e47464c;  // "NGFL"
+
+  // Number of sentences ScoreSentences() scores at a time.
+  static constexpr size_t kScoreLanes = 16;
+
+  // Sentence being scored by ScoreSentences().
+  struct ScoreLane {
+    const std::vector<Label> *sentence;
+    std::vector<WordScore> *scores;
+    size_t pos;     // Position of the next word to score.
+    StateId state;  // State reached by the words before it.
+  };
+
+  static constexpr int kMaxWeightBits = 16;
+
+  // Sections of the file, in order. The weight sections hold codes when the
+  // model is quantized, and the codebooks are empty when it isn't.
+  enum Section {
+    kStates,
+    kLabels,
+    kWeights,
+    kNextStates,
+    kBackoffWeights,
+    kFinalWeights,
+    kCodebooks
+  };
+
+  // Sections start at multiples of this many bytes.
+  static constexpr size_t kAlignment = 64;
+
+  // Offset() of a header whose sections can't fit in memory.
+  static constexpr size_t kNoOffset = static_cast<size_t>(-1);
+
+  struct State {
+    size_t arc_begin;  // Position of the first arc in the arc arrays.
+    uint32 num_arcs;
+    StateId backoff;
+    int32 order;
+  };
+
+  // Starts the file. The sizes of the stored types are checked on reading,
+  // since the arrays are used as they are.
+  struct Header {
+    int32 magic;
+    int32 state_size;
+    int32 label_size;
+    int32 weight_size;
+    int32 hi_order;
+    int32 has_symbols;
+    int32 weight_bits;
+    int64 start;
+    int64 unigram;
+    int64 backoff_label;
+    int64 num_states;
+    int64 num_arcs;
+    int64 oov_label;
+    double oov_cost;
+  };
+
+  // Constructs a model on the file mapped at 'mapped'; Read() sets the
+  // array pointers.
+  NGramFlatModel(void *mapped, size_t mapped_size)
+      : header_(*static_cast<const Header *>(mapped)),
+        mapped_(mapped),
+        mapped_size_(mapped_size) {}
+
+  static size_t Align(size_t offset) {
+    return (offset + kAlignment - 1) / kAlignment * kAlignment;
+  }
+
+  static void Prefetch(const void *address) {
+#if defined(__GNUC__)
+    __builtin_prefetch(address);
+#endif
+  }
+
+  // Prefetches the entry and backoff weight of 'st'.
+  void PrefetchState(StateId st) const {
+    Prefetch(states_ + st);
+    if (header_.weight_bits == 0) {
+      Prefetch(backoff_weights_ + st);
+    } else {
+      Prefetch(backoff_codes_ + st * header_.weight_bits / 8);
+    }
+  }
+
+  // Prefetches where FindArc() first looks for 'label' among the arcs
+  // leaving 'st', with their weights and destinations: the first arcs of
+  // a small state, or the first probe of a large one.
+  void PrefetchArcs(StateId st, Label label) const {
+    const State &state = states_[st];
+    size_t arc = state.arc_begin;
+    if (static_cast<ptrdiff_t>(state.num_arcs) > kMinInterpolationArcs) {
+      const Label *first = labels_ + state.arc_begin;
+      const double low = first[0], high = first[state.num_arcs - 1];
+      if (label < low || label > high) return;
+      arc += static_cast<size_t>((label - low) / (high - low) *
+                                 (state.num_arcs - 1));
+    }
+    Prefetch(labels_ + arc);
+    Prefetch(nextstates_ + arc);
+    if (header_.weight_bits == 0) {
+      Prefetch(weights_ + arc);
+    } else {
+      Prefetch(weight_codes_ + arc * header_.weight_bits / 8);
+    }
+  }
+
+  // Scores the next word of 'lane' and prefetches the entry of the state
+  // it reaches. Returns false once the end of the sentence is scored.
+  bool ScoreWord(ScoreLane *lane) const {
+    const Label label = (*lane->sentence)[lane->pos];
+    int order;
+    double cost = 0;
+    if (!FindNGramInModel(&lane->state, &order, label, &cost)) {
+      cost += OOVCost();
+      order = -1;
+      lane->state = UnigramState() >= 0 ? UnigramState() : Start();
+    }
+    lane->scores->push_back(WordScore{cost, order});
+    if (++lane->pos == lane->sentence->size()) {
+      AddFinalScore(lane->state, lane->scores);
+      return false;
+    }
+    PrefetchState(lane->state);
+    return true;
+  }
+
+  void AddFinalScore(StateId mst, std::vector<WordScore> *scores) const {
+    int order;
+    const double cost =
+        NGramModel<Arc>::ScalarValue(FinalCostInModel(mst, &order));
+    scores->push_back(WordScore{cost, order});
+  }
+
+  // Returns the position of 'section' in the file of a model with 'header',
+  // or kNoOffset if the counts of the header are negative or so large that
+  // the position overflows.
+  static size_t Offset(const Header &header, Section section) {
+    // Bounds the counts so that neither the sizes below nor their sum
+    // overflow.
+    const size_t max_count = kNoOffset / 16 / (sizeof(State) + sizeof(Weight) +
+                                               sizeof(Label) + sizeof(StateId));
+    if (header.num_states < 0 || header.num_arcs < 0 ||
+        static_cast<uint64>(header.num_states) > max_count ||
+        static_cast<uint64>(header.num_arcs) > max_count) {
+      return kNoOffset;
+    }
+    const int bits = header.weight_bits;
+    const size_t sizes[] = {
+        header.num_states * sizeof(State),
+        header.num_arcs * sizeof(Label),
+        bits ? CodesSize(header.num_arcs, bits)
+             : header.num_arcs * sizeof(Weight),
+        header.num_arcs * sizeof(StateId),
+        bits ? CodesSize(header.num_states, bits)
+             : header.num_states * sizeof(Weight),
+        bits ? CodesSize(header.num_states, bits)
+             : header.num_states * sizeof(Weight)};
+    size_t offset = Align(sizeof(Header));
+    for (int i = kStates; i < section; ++i) offset = Align(offset + sizes[i]);
+    return offset;
+  }
+
+  // Returns the position of the symbols, which follow the codebooks.
+  size_t SymbolsOffset() const {
+    size_t offset = Offset(header_, kCodebooks);
+    if (header_.weight_bits == 0) return offset;
+    offset += codebook_sizes_.size() * sizeof(uint32);
+    for (uint32 size : codebook_sizes_) offset += size * sizeof(float);
+    return Align(offset);
+  }
+
+  static int NumCodebooks(int hi_order) { return 2 * hi_order; }
+
+  // Index of the codebook of the n-gram or backoff costs of the states of
+  // 'order'.
+  static int Codebook(int order, bool backoff) {
+    return 2 * (order - 1) + backoff;
+  }
+
+  // Bytes taking 'size' codes of 'bits' bits. Codes are read four bytes at
+  // a time, so this leaves room to read the last one.
+  static size_t CodesSize(size_t size, int bits) {
+    return (size * bits + 7) / 8 + sizeof(uint32);
+  }
+
+  static void PutCode(uint8 *codes, size_t pos, int bits, uint32 code) {
+    const size_t bit = pos * bits;
+    for (int i = 0; i < bits; ++i) {
+      if (code & (1u << i)) codes[(bit + i) / 8] |= 1u << ((bit + i) % 8);
+    }
+  }
+
+  uint32 GetCode(const uint8 *codes, size_t pos) const {
+    const size_t bit = pos * header_.weight_bits;
+    uint32 word;
+    std::memcpy(&word, codes + bit / 8, sizeof(word));
+    return (word >> (bit % 8)) & ((1u << header_.weight_bits) - 1);
+  }
+
+  Weight Decode(const uint8 *codes, size_t pos, int codebook) const {
+    return Weight(codebooks_[codebook][GetCode(codes, pos)]);
+  }
+
+  Weight BackoffWeight(StateId st) const {
+    if (header_.weight_bits == 0) return backoff_weights_[st];
+    if (states_[st].backoff < 0) return Weight::Zero();
+    return Decode(backoff_codes_, st, Codebook(states_[st].order, true));
+  }
+
+  // Makes a codebook of at most 'max_size' values, in increasing order,
+  // for 'costs'. An infinite cost, of a missing final weight, is kept as
+  // such.
+  static void MakeCodebook(std::vector<float> *costs, size_t max_size,
+                           std::vector<float> *codebook) {
+    codebook->clear();
+    std::sort(costs->begin(), costs->end());
+    const bool has_infinity = !costs->empty() && std::isinf(costs->back());
+    if (has_infinity) {
+      costs->erase(std::lower_bound(costs->begin(), costs->end(),
+                                    costs->back()),
+                   costs->end());
+      --max_size;
+    }
+    std::vector<float> distinct(*costs);
+    distinct.erase(std::unique(distinct.begin(), distinct.end()),
+                   distinct.end());
+    if (distinct.size() <= max_size) {
+      codebook->swap(distinct);
+    } else {
+      for (size_t i = 0; i < max_size; ++i) {
+        const size_t begin = costs->size() * i / max_size;
+        const size_t end = costs->size() * (i + 1) / max_size;
+        double sum = 0;
+        for (size_t j = begin; j < end; ++j) sum += (*costs)[j];
+        const float mean = sum / (end - begin);
+        if (codebook->empty() || codebook->back() != mean)
+          codebook->push_back(mean);
+      }
+    }
+    if (has_infinity) codebook->push_back(Weight::Zero().Value());
+  }
+
+  // Returns the code of the value of 'codebook' closest to 'cost'.
+  static uint32 Encode(const std::vector<float> &codebook, float cost) {
+    auto it = std::lower_bound(codebook.begin(), codebook.end(), cost);
+    if (it == codebook.end() ||
+        (it != codebook.begin() && cost - it[-1] < *it - cost)) {
+      --it;
+    }
+    return it - codebook.begin();
+  }
+
+  void SetWeights(const Weight *weights, const Weight *backoff_weights,
+                  const Weight *final_weights) {
+    weights_ = weights;
+    backoff_weights_ = backoff_weights;
+    final_weights_ = final_weights;
+    weight_codes_ = backoff_codes_ = final_codes_ = nullptr;
+  }
+
+  void SetCodes(const uint8 *weight_codes, const uint8 *backoff_codes,
+                const uint8 *final_codes) {
+    weight_codes_ = weight_codes;
+    backoff_codes_ = backoff_codes;
+    final_codes_ = final_codes;
+    weights_ = backoff_weights_ = final_weights_ = nullptr;
+  }
+
+  // Writes zeros up to 'offset'.
+  static void Pad(std::ostream &strm, size_t offset) {
+    while (static_cast<size_t>(strm.tellp()) < offset) strm.put(0);
+  }
+
+  // Writes either 'weights' or, if quantized, the codes of 'size' weights.
+  void WriteWeights(std::ostream &strm, Section section, const Weight *weights,
+                    const uint8 *codes, size_t size) const {
+    if (header_.weight_bits == 0) {
+      WriteArray(strm, section, weights, size);
+    } else {
+      WriteArray(strm, section, codes, CodesSize(size, header_.weight_bits));
+    }
+  }
+
+  template <class T>
+  void WriteArray(std::ostream &strm, Section section, const T *array,
+                  size_t size) const {
+    Pad(strm, Offset(header_, section));
+    strm.write(reinterpret_cast<const char *>(array), size * sizeof(T));
+  }
+
+  Header header_;
+  // Arrays, pointing either to the storage below or into the mapped file.
+  const State *states_;
+  const Label *labels_;
+  const StateId *nextstates_;
+  const Weight *weights_;
+  const Weight *backoff_weights_;
+  const Weight *final_weights_;
+  // Codes of the weights above, when quantized.
+  const uint8 *weight_codes_;
+  const uint8 *backoff_codes_;
+  const uint8 *final_codes_;
+  std::vector<const float *> codebooks_;
+  std::vector<uint32> codebook_sizes_;
+  std::vector<State> state_storage_;
+  std::vector<Label> label_storage_;
+  std::vector<StateId> nextstate_storage_;
+  std::vector<Weight> weight_storage_;
+  std::vector<Weight> backoff_weight_storage_;
+  std::vector<Weight> final_weight_storage_;
+  std::vector<uint8> weight_code_storage_;
+  std::vector<uint8> backoff_code_storage_;
+  std::vector<uint8> final_code_storage_;
+  std::vector<std::vector<float>> codebook_storage_;
+  void *mapped_;
+  size_t mapped_size_;
+  std::unique_ptr<fst::SymbolTable> syms_;
+
+  NGramFlatModel(const NGramFlatModel &) = delete;
+  NGramFlatModel &operator=(const NGramFlatModel &) = delete;
+};
+
+template <class Arc>
+constexpr size_t NGramFlatModel<Arc>::kNoArc;
+
+template <class Arc>
+constexpr int NGramFlatModel<Arc>::kInterpolationProbes;
+
+template <class Arc>
+constexpr ptrdiff_t NGramFlatModel<Arc>::kMinInterpolationArcs;
+
+template <class Arc>
+constexpr int32 NGramFlatModel<Arc>::kMagic;
+
+template <class Arc>
+constexpr size_t NGramFlatModel<Arc>::kScoreLanes;
+
+template <class Arc>
+constexpr int NGramFlatModel<Arc>::kMaxWeightBits;
+
+template <class Arc>
+constexpr size_t NGramFlatModel<Arc>::kAlignment;
+
+typedef NGramFlatModel<StdArc> StdNGramFlatModel;
+
+}  // namespace ngram
+
+#endif  // NGRAM_NGRAM_FLAT_MODEL_H_
@@ -0,0 +1,285 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Read-only n-gram model indexed by hashed n-grams for scoring words given
+// their preceding words.
+
+#ifndef NGRAM_NGRAM_HASH_MODEL_H_
+#define NGRAM_NGRAM_HASH_MODEL_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include <fst/fst.h>
+#include <ngram/ngram-model.h>
+#include <ngram/util.h>
+
+namespace ngram {
+
+// Copy of an n-gram model in which each n-gram, of order k, is an entry of
+// the k-th of a set of open-addressing hash tables. An entry holds the cost
+// of the n-gram and, when the n-gram is also the history of a state, the
+// backoff cost of that state. N-grams are identified by a 64-bit hash of
+// their labels only, so that entries are small; distinct n-grams of the
+// same order are taken to hash differently.
+//
+// Scoring a word then needs no model state: it probes the tables for the
+// word preceded by shorter and shorter suffixes of its history, and adds
+// the backoff costs of the histories longer than the longest n-gram found,
+// as following backoff arcs from the state of the whole history would. As in
+// NGramModel::NGramState(), label 0 stands for the start of the sentence
+// in a history, and end of sentence is scored with FinalCost().
+template <class Arc>
+class NGramHashModel {
+ public:
+  typedef typename Arc::StateId StateId;
+  typedef typename Arc::Label Label;
+  typedef typename Arc::Weight Weight;
+
+  // Builds the tables from 'model', which must have been constructed with
+  // 'state_ngrams' true.
+  explicit NGramHashModel(const NGramModel<Arc> &model)
+      : hi_order_(model.HiOrder()), tables_(model.HiOrder()), error_(false) {
+    const Fst<Arc> &fst = model.GetFst();
+    const Label backoff_label = model.BackoffLabel();
+    // Sizes the tables, counting n-grams once per arc or final weight and
+    // once per state, which is an upper bound.
+    std::vector<size_t> sizes(hi_order_, 0);
+    std::vector<Label> ngram;
+    for (StateId st = 0; st < model.NumStates(); ++st) {
+      model.StateNGram(st, &ngram);
+      const int history = ngram.size();
+      if (history >= hi_order_ ||
+          (st == fst.Start() && model.UnigramState() >= 0 && history == 0)) {
+        NGRAMERROR() << "NGramHashModel: Bad state n-gram: " << st;
+        error_ = true;
+        return;
+      }
+      if (history > 0) ++sizes[history - 1];
+      sizes[history] += fst.NumArcs(st) + 1;
+    }
+    for (int i = 0; i < hi_order_; ++i) tables_[i].Reserve(sizes[i]);
+    for (StateId st = 0; st < model.NumStates(); ++st) {
+      model.StateNGram(st, &ngram);
+      // The history of the state, with its backoff cost.
+      if (!ngram.empty()) {
+        Weight bocost = Weight::One();
+        model.GetBackoff(st, &bocost);
+        FindOrAdd(ngram)->backoff = NGramModel<Arc>::ScalarValue(bocost);
+      }
+      ngram.push_back(kFinalLabel);
+      if (fst.Final(st) != Weight::Zero()) {
+        FindOrAdd(ngram)->cost =
+            NGramModel<Arc>::ScalarValue(fst.Final(st));
+      }
+      for (ArcIterator<Fst<Arc>> aiter(fst, st); !aiter.Done(); aiter.Next()) {
+        const Arc &arc = aiter.Value();
+        if (arc.ilabel == backoff_label || arc.ilabel == kNoLabel) continue;
+        ngram.back() = arc.ilabel;
+        FindOrAdd(ngram)->cost = NGramModel<Arc>::ScalarValue(arc.weight);
+      }
+    }
+  }
+
+  int HiOrder() const { return hi_order_; }
+
+  bool Error() const { return error_; }
+
+  // Number of bytes used by the tables.
+  size_t MemoryUsage() const {
+    size_t bytes = 0;
+    for (const auto &table : tables_) bytes += table.MemoryUsage();
+    return bytes;
+  }
+
+  // As NGramModel::FindNGramInModel() from the state of the history
+  // [begin, end), of which only the last HiOrder() - 1 labels are used:
+  // returns the cost of 'label' given the history in '*cost' and the order
+  // of the longest n-gram found for it in '*order'. Returns false if
+  // 'label' is not in the model.
+  bool FindNGram(const Label *begin, const Label *end, Label label,
+                 int *order, double *cost) const {
+    if (label < 0) return false;
+    return Find(begin, end, label, order, cost);
+  }
+
+  // As NGramModel::FinalCostInModel() from the state of the history
+  // [begin, end).
+  Weight FinalCost(const Label *begin, const Label *end, int *order) const {
+    double cost;
+    if (!Find(begin, end, kFinalLabel, order, &cost)) {
+      NGRAMERROR() << "NGramHashModel: No final cost in model";
+      *order = -1;
+      return Weight::Zero();
+    }
+    return Weight(cost);
+  }
+
+ private:
+  // Label standing for the end of sentence in the n-grams of final costs.
+  static constexpr Label kFinalLabel = kNoLabel;
+
+  struct Entry {
+    uint64 key;
+    float cost;     // Cost of the n-gram, infinite if only a history.
+    float backoff;  // Backoff cost of the state with this history, if any.
+  };
+
+  // Table of the entries of one order, found by linear probing. Sized when
+  // building, it never grows.
+  class Table {
+   public:
+    Table() : mask_(0) {}
+
+    void Reserve(size_t size) {
+      size_t capacity = kMinCapacity;
+      while (size * kMaxLoadDenominator > capacity * kMaxLoadNumerator)
+        capacity *= 2;
+      entries_.assign(capacity, Entry{kEmptyKey, kInfinity, 0});
+      mask_ = capacity - 1;
+    }
+
+    const Entry *Find(uint64 key) const {
+      for (size_t i = key & mask_;; i = (i + 1) & mask_) {
+        const Entry &entry = entries_[i];
+        if (entry.key == key) return &entry;
+        if (entry.key == kEmptyKey) return nullptr;
+      }
+    }
+
+    Entry *FindOrAdd(uint64 key) {
+      size_t i = key & mask_;
+      while (entries_[i].key != key && entries_[i].key != kEmptyKey)
+        i = (i + 1) & mask_;
+      entries_[i].key = key;
+      return &entries_[i];
+    }
+
+    size_t MemoryUsage() const { return entries_.capacity() * sizeof(Entry); }
+
+   private:
+    static constexpr size_t kMinCapacity = 16;
+    // Tables are sized to have at most 3/4 of the slots in use.
+    static constexpr size_t kMaxLoadNumerator = 3;
+    static constexpr size_t kMaxLoadDenominator = 4;
+
+    std::vector<Entry> entries_;
+    size_t mask_;
+  };
+
+  static constexpr uint64 kEmptyKey = 0;
+
+  static const float kInfinity;
+
+  // Scrambles the bits of 'x' (the finalizer of MurmurHash3).
+  static uint64 Mix(uint64 x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+
+  // Hash of a unigram, and of an n-gram preceded by one more label. Keys
+  // are built from the last label of the n-gram backwards, so the keys of
+  // the histories of a word are found by going back over the history once.
+  static uint64 Key(Label label) {
+    return NonEmpty(Mix(static_cast<uint32>(label) + 0x9E3779B97F4A7C15ULL));
+  }
+
+  static uint64 Key(uint64 key, Label label) {
+    return NonEmpty(
+        Mix(key * 0x9E3779B97F4A7C15ULL + static_cast<uint32>(label)));
+  }
+
+  static uint64 NonEmpty(uint64 key) { return key == kEmptyKey ? 1 : key; }
+
+  Entry *FindOrAdd(const std::vector<Label> &ngram) {
+    uint64 key = Key(ngram.back());
+    for (size_t i = ngram.size() - 1; i > 0; --i) key = Key(key, ngram[i - 1]);
+    return tables_[ngram.size() - 1].FindOrAdd(key);
+  }
+
+  // Returns the key of 'label' preceded by the 'history' labels before 'end'.
+  static uint64 NGramKey(const Label *end, int history, Label label) {
+    uint64 key = Key(label);
+    for (int k = 1; k <= history; ++k) key = Key(key, end[-k]);
+    return key;
+  }
+
+  bool Find(const Label *begin, const Label *end, Label label, int *order,
+            double *cost) const {
+    const int history = std::min<ptrdiff_t>(end - begin, hi_order_ - 1);
+    // Finds the longest n-gram ending with 'label', trying the longest
+    // first: when the history is well predicted by the model, as is usual,
+    // this takes a single probe into a large table.
+    double ngram_cost = 0;
+    *order = 0;
+    for (int k = history; k >= 0 && *order == 0; --k) {
+      const Entry *entry = tables_[k].Find(NGramKey(end, k, label));
+      if (entry && entry->cost != kInfinity) {
+        ngram_cost = entry->cost;
+        *order = k + 1;
+      }
+    }
+    if (*order == 0) return false;
+    // Adds the backoff costs of the histories that are too long.
+    *cost = 0;
+    uint64 key = kEmptyKey;
+    for (int k = 1; k <= history; ++k) {
+      key = k == 1 ? Key(end[-1]) : Key(key, end[-k]);
+      if (k < *order) continue;
+      const Entry *entry = tables_[k - 1].Find(key);
+      if (!entry) break;
+      *cost += entry->backoff;
+    }
+    *cost += ngram_cost;
+    return true;
+  }
+
+  int hi_order_;
+  std::vector<Table> tables_;  // Tables of the n-grams of each order.
+  bool error_;
+
+  NGramHashModel(const NGramHashModel &) = delete;
+  NGramHashModel &operator=(const NGramHashModel &) = delete;
+};
+
+template <class Arc>
+constexpr typename Arc::Label NGramHashModel<Arc>::kFinalLabel;
+
+template <class Arc>
+constexpr uint64 NGramHashModel<Arc>::kEmptyKey;
+
+template <class Arc>
+const float NGramHashModel<Arc>::kInfinity =
+    std::numeric_limits<float>::infinity();
+
+template <class Arc>
+constexpr size_t NGramHashModel<Arc>::Table::kMinCapacity;
+
+template <class Arc>
+constexpr size_t NGramHashModel<Arc>::Table::kMaxLoadNumerator;
+
+template <class Arc>
+constexpr size_t NGramHashModel<Arc>::Table::kMaxLoadDenominator;
+
+typedef NGramHashModel<StdArc> StdNGramHashModel;
+
+}  // namespace ngram
+
+#endif  // NGRAM_NGRAM_HASH_MODEL_H_
@@ -0,0 +1,166 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Cache of the results of n-gram lookups by model state and label.
+
+#ifndef NGRAM_NGRAM_LOOKUP_CACHE_H_
+#define NGRAM_NGRAM_LOOKUP_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <fst/fst.h>
+
+namespace ngram {
+
+// Direct-mapped cache in front of the FindNGramInModel() of 'Model', either
+// NGramModel or NGramFlatModel, for callers that look up the same words
+// from the same states over and over, as when decoding or rescoring the
+// hypotheses of an utterance. Each (state, label) pair maps to a single
+// entry, holding the state reached, the cost and the order of the last
+// lookup of a pair mapped there, so that a hit reads a single cache line.
+// Lookups of words not in the model are cached too.
+//
+// The cache is not thread-safe: each thread should use its own.
+template <class Model>
+class NGramLookupCache {
+ public:
+  typedef typename Model::StateId StateId;
+  typedef typename Model::Label Label;
+  typedef typename Model::Weight Weight;
+
+  // Caches the lookups of 'model' in at least 'size' entries, rounded up to
+  // a power of two.
+  NGramLookupCache(const Model &model, size_t size)
+      : model_(model), hits_(0), misses_(0) {
+    size_t capacity = 1;
+    while (capacity < size) capacity *= 2;
+    mask_ = capacity - 1;
+    storage_.resize(capacity * sizeof(Entry) + kCacheLineSize);
+    const uintptr_t address = reinterpret_cast<uintptr_t>(storage_.data());
+    entries_ = reinterpret_cast<Entry *>(
+        (address + kCacheLineSize - 1) / kCacheLineSize * kCacheLineSize);
+    Clear();
+  }
+
+  // As Model::FindNGramInModel(), looking up the cache first.
+  bool FindNGramInModel(StateId *mst, int *order, Label label,
+                        double *cost) {
+    if (label < 0) return false;
+    Entry &entry = entries_[Index(*mst, label)];
+    if (entry.state == *mst && entry.label == label) {
+      ++hits_;
+    } else {
+      ++misses_;
+      entry.state = *mst;
+      entry.label = label;
+      entry.nextstate = *mst;
+      if (!model_.FindNGramInModel(&entry.nextstate, &entry.order, label,
+                                   &entry.cost)) {
+        entry.nextstate = kNoStateId;
+      }
+    }
+    *mst = entry.nextstate;
+    *cost = entry.cost;
+    if (entry.nextstate == kNoStateId) return false;
+    *order = entry.order;
+    return true;
+  }
+
+  // As Model::FinalCostInModel(), which is not cached: it is needed once
+  // per hypothesis rather than once per word.
+  Weight FinalCostInModel(StateId mst, int *order) const {
+    return model_.FinalCostInModel(mst, order);
+  }
+
+  // Number of lookups found in the cache.
+  size_t Hits() const { return hits_; }
+
+  // Number of lookups passed on to the model.
+  size_t Misses() const { return misses_; }
+
+  // Fraction of the lookups found in the cache.
+  double HitRate() const {
+    return hits_ + misses_ == 0
+               ? 0.0
+               : static_cast<double>(hits_) / (hits_ + misses_);
+  }
+
+  // Number of entries.
+  size_t Size() const { return mask_ + 1; }
+
+  // Empties the cache, as needed when the model changes, and resets the
+  // counts.
+  void Clear() {
+    for (size_t i = 0; i <= mask_; ++i) {
+      entries_[i] = Entry{kNoStateId, kNoLabel, kNoStateId, -1, 0.0};
+    }
+    ResetCounts();
+  }
+
+  void ResetCounts() {
+    hits_ = 0;
+    misses_ = 0;
+  }
+
+ private:
+  static constexpr StateId kNoStateId = fst::kNoStateId;
+  static constexpr Label kNoLabel = fst::kNoLabel;
+  static constexpr size_t kCacheLineSize = 64;
+
+  // The state reached and order are those of a successful lookup; the
+  // state reached is kNoStateId if the label is not in the model, the cost
+  // then being that of backing off to the unigram state. Entries are padded
+  // to 32 bytes, two to a cache line.
+  struct alignas(32) Entry {
+    StateId state;
+    Label label;
+    StateId nextstate;
+    int order;
+    double cost;
+  };
+  static_assert(kCacheLineSize % sizeof(Entry) == 0,
+                "Lookup cache entries must tile cache lines");
+
+  size_t Index(StateId st, Label label) const {
+    uint64 key = (static_cast<uint64>(static_cast<uint32>(st)) << 32) |
+                 static_cast<uint32>(label);
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (key ^ (key >> 32)) & mask_;
+  }
+
+  const Model &model_;
+  std::vector<char> storage_;  // Holds the aligned entries.
+  Entry *entries_;
+  size_t mask_;
+  size_t hits_;
+  size_t misses_;
+
+  NGramLookupCache(const NGramLookupCache &) = delete;
+  NGramLookupCache &operator=(const NGramLookupCache &) = delete;
+};
+
+template <class Model>
+constexpr typename Model::StateId NGramLookupCache<Model>::kNoStateId;
+
+template <class Model>
+constexpr typename Model::Label NGramLookupCache<Model>::kNoLabel;
+
+template <class Model>
+constexpr size_t NGramLookupCache<Model>::kCacheLineSize;
+
+}  // namespace ngram
+
+#endif  // NGRAM_NGRAM_LOOKUP_CACHE_H_
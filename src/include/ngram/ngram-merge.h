@@ -341,8 +341,10 @@ class NGramMerge : public NGramMutableModel<Arc> {
     for (StateId ist = 0; ist < ngram2_ns_; ++ist) {  // all states in ngram2
       if (exact_map_2to1_[ist] < 0) {  // no matching state in ngram1
         StateId st = GetMutableFst()->AddState();
+        std::vector<Label> ngram;
+        if (check_consistency_) ngram = ngram2_->StateNGram(ist);
         UpdateState(st, ngram2_->StateOrder(ist), false,
-                    check_consistency_ ? &(ngram2_->StateNGram(ist)) : 0);
+                    check_consistency_ ? &ngram : 0);
         if (Error()) return;
         exact_map_1to2_.push_back(ist);
         exact_map_2to1_[ist] = st;
@@ -355,8 +357,9 @@ class NGramMerge : public NGramMutableModel<Arc> {
       StateId new_start = exact_map_2to1_[ngram2_->GetFst().Start()];
       StateId new_unigram = exact_map_2to1_[ngram2_->UnigramState()];
       GetMutableFst()->SetStart(new_start);
-      UpdateState(new_unigram, 1, true,
-                  check_consistency_ ? &StateNGram(new_unigram) : 0);
+      const std::vector<Label> ngram =
+          check_consistency_ ? StateNGram(new_unigram) : std::vector<Label>();
+      UpdateState(new_unigram, 1, true, check_consistency_ ? &ngram : 0);
       if (Error()) return;
     }
 
@@ -17,7 +17,10 @@
 #ifndef NGRAM_NGRAM_MODEL_H_
 #define NGRAM_NGRAM_MODEL_H_
 
-#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
 #include <vector>
 
 #include <fst/flags.h>
@@ -32,6 +35,7 @@
 namespace ngram {
 
 using fst::kAcceptor;
+using fst::kExpanded;
 using fst::kIDeterministic;
 using fst::kILabelSorted;
 using fst::kNoLabel;
@@ -172,12 +176,25 @@ class NGramModel {
   // Returns n-gram that must be read to reach 'state'. '0' signifies
   // super-initial 'word' in the ngram. Constructor argument 'state_ngrams' must
   // be true.
-  const std::vector<Label> &StateNGram(StateId state) const {
+  std::vector<Label> StateNGram(StateId state) const {
+    std::vector<Label> ngram;
+    StateNGram(state, &ngram);
+    return ngram;
+  }
+
+  // As above, but returns the n-gram in 'ngram', so that its storage can be
+  // reused from state to state.
+  void StateNGram(StateId state, std::vector<Label> *ngram) const {
+    ngram->clear();
     if (!have_state_ngrams_) {
       NGRAMERROR() << "NGramModel: state ngrams not available";
-      return empty_label_vector_;
+      return;
     }
-    return state_ngrams_[state];
+    for (uint32 node = state_ngram_nodes_[state]; node != kRootNGramNode;
+         node = ngram_nodes_[node].parent) {
+      ngram->push_back(ngram_nodes_[node].label);
+    }
+    std::reverse(ngram->begin(), ngram->end());
   }
 
   // Unigram state
@@ -216,26 +233,41 @@ class NGramModel {
     return backoff;
   }
 
-  // Verifies LM topology is sane.
+  // Verifies LM topology is sane. States are checked by ranges in
+  // parallel when --ngram_check_threads is greater than one.
   bool CheckTopology() const {
-    ascending_ngrams_ = 0;
-    // Checks state topology
-    for (StateId st = 0; st < nstates_; ++st)
-      if (!CheckTopologyState(st)) return false;
+    std::atomic<bool> topology_ok(true);
+    std::atomic<size_t> ascending_ngrams(0);  // # of arcs increasing order
+    ParallelForRanges(
+        nstates_, CheckThreads(), kMinCheckStates,
+        [this, &topology_ok, &ascending_ngrams](size_t, size_t begin,
+                                                size_t end) {
+          size_t ascending = 0;
+          for (size_t st = begin; st < end && topology_ok; ++st)
+            if (!CheckTopologyState(st, &ascending)) topology_ok = false;
+          ascending_ngrams += ascending;
+        });
+    if (!topology_ok) return false;
     // All but start and unigram state should have a unique ascending ngram arc
-    if (unigram_ != -1 && ascending_ngrams_ != nstates_ - 2) {
-      VLOG(1) << "Incomplete # of ascending n-grams: " << ascending_ngrams_;
+    if (unigram_ != -1 &&
+        ascending_ngrams != static_cast<size_t>(nstates_ - 2)) {
+      VLOG(1) << "Incomplete # of ascending n-grams: " << ascending_ngrams;
       return false;
     }
     return true;
   }
 
-  // Iterates through all states and validate that they are fully normalized
+  // Iterates through all states and validate that they are fully normalized,
+  // by ranges in parallel when --ngram_check_threads is greater than one.
   bool CheckNormalization() const {
     if (Error()) return false;
-    for (StateId st = 0; st < nstates_; ++st)
-      if (!CheckNormalizationState(st)) return false;
-    return true;
+    std::atomic<bool> normalized(true);
+    ParallelForRanges(nstates_, CheckThreads(), kMinCheckStates,
+                      [this, &normalized](size_t, size_t begin, size_t end) {
+                        for (size_t st = begin; st < end && normalized; ++st)
+                          if (!CheckNormalizationState(st)) normalized = false;
+                      });
+    return normalized;
   }
 
   // Calculate backoff cost from neglog sums of hi and low order arcs
@@ -274,9 +306,9 @@ class NGramModel {
   }
 
   // Calculate marginal state probs.  By default, uses the product of
-  // the order-ascending ngram transition probabilities. If 'stationary'
-  // is true, instead computes the stationary distribution of the Markov
-  // chain. Returns true on success.
+  // the order-ascending ngram transition probabilities, as marginalization
+  // and shrinking do. If 'stationary' is true, instead computes the
+  // stationary distribution of the Markov chain. Returns true on success.
   bool CalculateStateProbs(std::vector<double> *probs, bool stationary = false,
                            size_t maxiters = 10000) const {
     bool ret = true;
@@ -307,7 +339,11 @@ class NGramModel {
       return;
     }
     uint64 need_props = kAcceptor | kIDeterministic | kILabelSorted;
-    uint64 have_props = fst_.Properties(need_props, true);
+    // With --trust_model, the properties stored with the FST are enough when
+    // they are all known to hold, as for models written by these tools.
+    uint64 have_props = fst_.Properties(need_props, false);
+    if (!FLAGS_trust_model || (have_props & need_props) != need_props)
+      have_props = fst_.Properties(need_props, true);
     if (!(have_props & kAcceptor)) {
       NGRAMERROR() << "NGramModel: input not an acceptor";
       SetError();
@@ -333,7 +369,7 @@ class NGramModel {
     nstates_ = CountStates(fst_);
     unigram_ = GetBackoff(fst_.Start(), 0);  // set the unigram state
     ComputeStateOrders();
-    if (!CheckTopology()) {
+    if (!FLAGS_trust_model && !CheckTopology()) {
       NGRAMERROR() << "NGramModel: bad ngram model topology";
       SetError();
       return;
@@ -411,6 +447,38 @@ class NGramModel {
     return cost;
   }
 
+  // Mimic a phi matcher: follow backoff arcs until label found or no backoff
+  bool FindNGramInModel(StateId *mst, int *order, Label label,
+                        double *cost) const {
+    if (label < 0) return false;
+    StateId currstate = *mst;
+    *cost = 0;
+    *mst = -1;
+    while (*mst < 0) {
+      Matcher<Fst<Arc>> matcher(fst_, MATCH_INPUT);
+      matcher.SetState(currstate);
+      if (matcher.Find(label)) {  // arc found out of current state
+        Arc arc = matcher.Value();
+        *order = state_orders_[currstate];
+        *mst = arc.nextstate;  // assign destination as new model state
+        *cost += ScalarValue(arc.weight);         // add cost to total
+      } else if (matcher.Find(backoff_label_)) {  // follow backoff arc
+        currstate = -1;
+        for (; !matcher.Done(); matcher.Next()) {
+          Arc arc = matcher.Value();
+          if (arc.ilabel == backoff_label_) {
+            currstate = arc.nextstate;  // make current state backoff state
+            *cost += ScalarValue(arc.weight);  // add in backoff cost
+          }
+        }
+        if (currstate < 0) return false;
+      } else {
+        return false;  // Found label in symbol list, but not in model
+      }
+    }
+    return true;
+  }
+
   // Mimic a phi matcher: follow backoff links until final state found
   Weight FinalCostInModel(StateId mst, int *order) const {
     Weight cost = Arc::Weight::One();
@@ -454,11 +522,12 @@ class NGramModel {
 
     if (state_orders_.size() == st) {  // add state info
       state_orders_.push_back(order);
-      if (ngram) state_ngrams_.push_back(*ngram);
+      if (have_state_ngrams_)
+        state_ngram_nodes_.push_back(FindNGramNodes(*ngram));
       ++nstates_;
     } else {  // modifies state info
       state_orders_[st] = order;
-      if (ngram) state_ngrams_.push_back(*ngram);
+      if (have_state_ngrams_) state_ngram_nodes_[st] = FindNGramNodes(*ngram);
     }
 
     if (unigram_state) unigram_ = nstates_;
@@ -583,38 +652,6 @@ class NGramModel {
     return cost;
   }
 
-  // Mimic a phi matcher: follow backoff arcs until label found or no backoff
-  bool FindNGramInModel(StateId *mst, int *order, Label label,
-                        double *cost) const {
-    if (label < 0) return false;
-    StateId currstate = *mst;
-    *cost = 0;
-    *mst = -1;
-    while (*mst < 0) {
-      Matcher<Fst<Arc>> matcher(fst_, MATCH_INPUT);
-      matcher.SetState(currstate);
-      if (matcher.Find(label)) {  // arc found out of current state
-        Arc arc = matcher.Value();
-        *order = state_orders_[currstate];
-        *mst = arc.nextstate;  // assign destination as new model state
-        *cost += ScalarValue(arc.weight);         // add cost to total
-      } else if (matcher.Find(backoff_label_)) {  // follow backoff arc
-        currstate = -1;
-        for (; !matcher.Done(); matcher.Next()) {
-          Arc arc = matcher.Value();
-          if (arc.ilabel == backoff_label_) {
-            currstate = arc.nextstate;  // make current state backoff state
-            *cost += ScalarValue(arc.weight);  // add in backoff cost
-          }
-        }
-        if (currstate < 0) return false;
-      } else {
-        return false;  // Found label in symbol list, but not in model
-      }
-    }
-    return true;
-  }
-
   // Sum final + arc probs out of state and for same transitions out of backoff
   bool CalcBONegLogSums(StateId st, double *hi_neglog_sum,
                         double *low_neglog_sum, bool infinite_backoff = false,
@@ -634,8 +671,7 @@ class NGramModel {
   // Prints state ngram to a stream
   bool PrintStateNGram(StateId st, std::ostream &ostrm = std::cerr) const {
     ostrm << "state: " << st << " order: " << state_orders_[st] << " ngram: ";
-    for (int i = 0; i < state_ngrams_[st].size(); ++i)
-      ostrm << state_ngrams_[st][i] << " ";
+    for (Label label : StateNGram(st)) ostrm << label << " ";
     ostrm << "\n";
     return true;
   }
@@ -720,52 +756,83 @@ class NGramModel {
     return NegLogDiff(0.0, low_sum);
   }
 
-  // Traverse n-gram fst and record each state's n-gram order, return highest
+  // Traverse n-gram fst and record each state's n-gram order, return highest.
+  // The states are visited breadth first, one order at a time: the arcs out
+  // of the states of an order, split by ranges over threads, give the states
+  // of the next order, which are then numbered in the order of the arcs.
   void ComputeStateOrders() {
     state_orders_.clear();
     state_orders_.resize(nstates_, -1);
 
     if (have_state_ngrams_) {
-      state_ngrams_.clear();
-      state_ngrams_.resize(nstates_);
+      ngram_nodes_.clear();
+      ngram_nodes_.reserve(nstates_ + 1);  // One per state, and the root.
+      ngram_nodes_.push_back(NGramNode{kRootNGramNode, kNoLabel});
+      state_ngram_nodes_.assign(nstates_, kRootNGramNode);
+      child_ngram_nodes_.clear();
+      indexed_ngram_nodes_ = 1;
     }
 
     hi_order_ = 1;  // calculate highest order in the model
-    std::deque<StateId> state_queue;
+    std::vector<StateId> frontier;       // states of the current order
+    std::vector<StateId> next_frontier;  // states of the next order
     if (unigram_ != kNoStateId) {
       state_orders_[unigram_] = 1;
-      state_queue.push_back(unigram_);
+      frontier.push_back(unigram_);
       state_orders_[fst_.Start()] = hi_order_ = 2;
-      state_queue.push_back(fst_.Start());
-      if (have_state_ngrams_)
-        state_ngrams_[fst_.Start()].push_back(0);  // initial context
+      next_frontier.push_back(fst_.Start());
+      if (have_state_ngrams_)  // initial context
+        state_ngram_nodes_[fst_.Start()] = AddNGramNode(kRootNGramNode, 0);
     } else {
       state_orders_[fst_.Start()] = 1;
-      state_queue.push_back(fst_.Start());
+      frontier.push_back(fst_.Start());
     }
 
-    while (!state_queue.empty()) {
-      StateId state = state_queue.front();
-      state_queue.pop_front();
-      for (ArcIterator<Fst<Arc>> aiter(fst_, state); !aiter.Done();
-           aiter.Next()) {
-        const Arc &arc = aiter.Value();
-        if (state_orders_[arc.nextstate] == -1) {
-          state_orders_[arc.nextstate] = state_orders_[state] + 1;
+    ThreadPool pool(CheckThreads());
+    std::vector<std::vector<FrontierArc>> found(pool.NumThreads());
+    for (int order = 1; !frontier.empty(); ++order) {
+      const size_t ranges = pool.ParallelForRanges(
+          frontier.size(), kMinCheckStates,
+          [this, &frontier, &found](size_t range, size_t begin, size_t end) {
+            std::vector<FrontierArc> &arcs = found[range];
+            arcs.clear();
+            for (size_t i = begin; i < end; ++i) {
+              for (ArcIterator<Fst<Arc>> aiter(fst_, frontier[i]);
+                   !aiter.Done(); aiter.Next()) {
+                const Arc &arc = aiter.Value();
+                if (state_orders_[arc.nextstate] == -1)
+                  arcs.push_back({frontier[i], arc.ilabel, arc.nextstate});
+              }
+            }
+          });
+      for (size_t range = 0; range < ranges; ++range) {
+        for (const FrontierArc &arc : found[range]) {
+          if (state_orders_[arc.nextstate] != -1) continue;
+          state_orders_[arc.nextstate] = order + 1;
           if (have_state_ngrams_) {
-            state_ngrams_[arc.nextstate] = state_ngrams_[state];
-            state_ngrams_[arc.nextstate].push_back(arc.ilabel);
+            state_ngram_nodes_[arc.nextstate] =
+                AddNGramNode(state_ngram_nodes_[arc.state], arc.label);
           }
-          if (state_orders_[state] >= hi_order_)
-            hi_order_ = state_orders_[state] + 1;
-          state_queue.push_back(arc.nextstate);
+          if (order >= hi_order_) hi_order_ = order + 1;
+          next_frontier.push_back(arc.nextstate);
         }
       }
+      frontier.swap(next_frontier);
+      next_frontier.clear();
     }
   }
 
-  // Ensure correct n-gram topology for a given state.
-  bool CheckTopologyState(StateId st) const {
+  // Number of threads used to compute state orders and stationary state
+  // probs and to check the model; only FSTs with all their states in
+  // memory are read from several.
+  int CheckThreads() const {
+    if (!fst_.Properties(kExpanded, false)) return 1;
+    return std::max(FLAGS_ngram_check_threads, 1);
+  }
+
+  // Ensure correct n-gram topology for a given state, adding its arcs that
+  // increase order to '*ascending_ngrams'.
+  bool CheckTopologyState(StateId st, size_t *ascending_ngrams) const {
     if (unigram_ == -1) {  // unigram model
       if (fst_.Final(fst_.Start()) == Arc::Weight::Zero()) {
         VLOG(1) << "CheckTopology: bad final weight for start state";
@@ -783,7 +850,8 @@ class NGramModel {
         VLOG(1) << "CheckTopology: bad final weight for unigram state: "
                 << unigram_;
         return false;
-      } else if (have_state_ngrams_ && !state_ngrams_[unigram_].empty()) {
+      } else if (have_state_ngrams_ &&
+                 state_ngram_nodes_[unigram_] != kRootNGramNode) {
         VLOG(1) << "CheckTopology: bad unigram state: " << unigram_;
         return false;
       }
@@ -811,7 +879,7 @@ class NGramModel {
     for (ArcIterator<Fst<Arc>> aiter(fst_, st); !aiter.Done(); aiter.Next()) {
       Arc arc = aiter.Value();
 
-      if (StateOrder(st) < StateOrder(arc.nextstate)) ++ascending_ngrams_;
+      if (StateOrder(st) < StateOrder(arc.nextstate)) ++*ascending_ngrams;
 
       if (have_state_ngrams_ && !CheckStateNGrams(st, arc)) {
         VLOG(1) << "CheckTopology: inconsistent n-gram states: " << st << " -- "
@@ -831,20 +899,77 @@ class NGramModel {
     return true;
   }
 
-  // Checks state ngrams for consistency
+  // Checks state ngrams for consistency: the n-gram of the destination of
+  // 'arc' must be that of 'st' without its first j labels, followed by the
+  // arc label unless it is a backoff arc. The node chains, which hold the
+  // n-grams from their last label, are compared directly.
   bool CheckStateNGrams(StateId st, const Arc &arc) const {
-    std::vector<Label> state_ngram;
-    bool boa = arc.ilabel == backoff_label_;
-
-    int j = state_orders_[st] - state_orders_[arc.nextstate] + (boa ? 0 : 1);
+    const bool boa = arc.ilabel == backoff_label_;
+    const int j =
+        state_orders_[st] - state_orders_[arc.nextstate] + (boa ? 0 : 1);
     if (j < 0) return false;
 
-    for (int i = j; i < state_ngrams_[st].size(); ++i)
-      state_ngram.push_back(state_ngrams_[st][i]);
-    if (!boa && j <= state_ngrams_[st].size())
-      state_ngram.push_back(arc.ilabel);
+    int length = 0;
+    for (uint32 node = state_ngram_nodes_[st]; node != kRootNGramNode;
+         node = ngram_nodes_[node].parent) {
+      ++length;
+    }
+    uint32 node = state_ngram_nodes_[st];
+    uint32 next_node = state_ngram_nodes_[arc.nextstate];
+    if (j <= length) {
+      if (!boa) {
+        if (next_node == kRootNGramNode ||
+            ngram_nodes_[next_node].label != arc.ilabel) {
+          return false;
+        }
+        next_node = ngram_nodes_[next_node].parent;
+      }
+      for (int i = j; i < length; ++i) {
+        if (next_node == kRootNGramNode ||
+            ngram_nodes_[next_node].label != ngram_nodes_[node].label) {
+          return false;
+        }
+        node = ngram_nodes_[node].parent;
+        next_node = ngram_nodes_[next_node].parent;
+      }
+    }
+    return next_node == kRootNGramNode;
+  }
+
+  // Adds a node for the n-gram of node 'parent' followed by 'label'.
+  uint32 AddNGramNode(uint32 parent, Label label) {
+    ngram_nodes_.push_back(NGramNode{parent, label});
+    return ngram_nodes_.size() - 1;
+  }
+
+  // Returns the node of 'ngram', adding nodes only for those of its
+  // prefixes that have none yet, so that updating states does not grow the
+  // tree with n-grams it already has. The nodes added since the last call
+  // are first indexed by parent and label.
+  uint32 FindNGramNodes(const std::vector<Label> &ngram) {
+    for (; indexed_ngram_nodes_ < ngram_nodes_.size(); ++indexed_ngram_nodes_) {
+      const NGramNode &node = ngram_nodes_[indexed_ngram_nodes_];
+      child_ngram_nodes_.emplace(ChildKey(node.parent, node.label),
+                                 indexed_ngram_nodes_);
+    }
+    uint32 node = kRootNGramNode;
+    for (Label label : ngram) {
+      const uint64 key = ChildKey(node, label);
+      auto it = child_ngram_nodes_.find(key);
+      if (it != child_ngram_nodes_.end()) {
+        node = it->second;
+      } else {
+        node = AddNGramNode(node, label);
+        child_ngram_nodes_.emplace(key, node);
+        ++indexed_ngram_nodes_;
+      }
+    }
+    return node;
+  }
 
-    return state_ngram == state_ngrams_[arc.nextstate];
+  // Key of the node of the n-gram of node 'parent' followed by 'label'.
+  static uint64 ChildKey(uint32 parent, Label label) {
+    return static_cast<uint64>(parent) << 32 | static_cast<uint32>(label);
   }
 
   // Ensure normalization for a given state to error epsilon
@@ -960,22 +1085,10 @@ class NGramModel {
     return true;
   }
 
-  // At a given state, calculate the marginal prob p(h) based on
-  // the smoothed, order-ascending n-gram transition probabilities.
-  void NGramStateProb(StateId st, std::vector<double> *probs) const {
-    for (ArcIterator<Fst<Arc>> aiter(fst_, st); !aiter.Done(); aiter.Next()) {
-      Arc arc = aiter.Value();
-      if (arc.ilabel == backoff_label_) continue;
-      if (state_orders_[arc.nextstate] > state_orders_[st]) {
-        (*probs)[arc.nextstate] = (*probs)[st] * exp(-ScalarValue(arc.weight));
-        NGramStateProb(arc.nextstate, probs);
-      }
-    }
-  }
-
   // Calculate marginal state probs as the product of the smoothed,
   // order-ascending ngram transition probablities: p(abc) =
-  // p(a)p(b|a)p(c|ba) (odd w/KN)
+  // p(a)p(b|a)p(c|ba) (odd w/KN). States are visited by increasing order,
+  // so that the prob of the state an arc ascends from is already known.
   void NGramStateProbs(std::vector<double> *probs, bool norm = false) const {
     probs->clear();
     probs->resize(nstates_, 0.0);
@@ -985,11 +1098,22 @@ class NGramModel {
     } else {
       // p(unigram state) = 1
       (*probs)[unigram_] = 1.0;
-      NGramStateProb(unigram_, probs);
       // p(<s>) = p(</s>)
       (*probs)[fst_.Start()] = exp(-ScalarValue(fst_.Final(unigram_)));
     }
-    NGramStateProb(fst_.Start(), probs);
+    for (const auto &states : StatesByOrder()) {
+      for (StateId st : states) {
+        for (ArcIterator<Fst<Arc>> aiter(fst_, st); !aiter.Done();
+             aiter.Next()) {
+          const Arc &arc = aiter.Value();
+          if (arc.ilabel == backoff_label_) continue;
+          if (state_orders_[arc.nextstate] > state_orders_[st]) {
+            (*probs)[arc.nextstate] =
+                (*probs)[st] * exp(-ScalarValue(arc.weight));
+          }
+        }
+      }
+    }
 
     if (norm) {  // Normalize result, as a starting point for the power method
       double sum = 0.0;
@@ -998,82 +1122,211 @@ class NGramModel {
     }
   }
 
-  // Exponentiates the weights
-  // At a given state, calculate one step of the power method
-  // for the stationary distribution of the closure of the
-  // LM with re-entry probability 'alpha'.
-  void StationaryStateProb(StateId st, std::vector<double> *init_probs,
-                           std::vector<double> *probs, double alpha) const {
-    Matcher<Fst<Arc>> matcher(fst_, MATCH_INPUT);  // for querying backoff
-    Weight bocost;
-    StateId bo = GetBackoff(st, &bocost);
-    if (bo != -1) {
-      // Treats backoff like an epsilon transition
-      matcher.SetState(bo);
-      (*init_probs)[bo] += (*init_probs)[st] * exp(-ScalarValue(bocost));
+  // Returns the states of each order, the i-th list holding those of order
+  // i + 1 in increasing order.
+  std::vector<std::vector<StateId>> StatesByOrder() const {
+    std::vector<std::vector<StateId>> order_states(hi_order_);
+    for (StateId st = 0; st < nstates_; ++st) {
+      const int order = state_orders_[st];
+      if (order > 0) order_states[order - 1].push_back(st);
     }
+    return order_states;
+  }
 
-    for (ArcIterator<Fst<Arc>> aiter(fst_, st); !aiter.Done(); aiter.Next()) {
-      Arc arc = aiter.Value();
-      if (arc.ilabel == backoff_label_) continue;
-      (*probs)[arc.nextstate] +=
-          (*init_probs)[st] * exp(-ScalarValue(arc.weight));
-      if (bo != -1 && matcher.Find(arc.ilabel)) {
-        // Subtracts corrective weight for backed-off arc
-        const Arc &barc = matcher.Value();
-        (*probs)[barc.nextstate] -=
-            (*init_probs)[st] *
-            exp(-ScalarValue(barc.weight) - ScalarValue(bocost));
+  // One step of the power method for the stationary distribution of the
+  // closure of the LM, as a sparse matrix. A step first pushes the prob of
+  // each state down its backoff arc, treated like an epsilon transition,
+  // highest order first, then sums the probs of the transitions into each
+  // state, with backed-off arcs subtracting corrective weights.
+  struct StationaryMatrix {
+    std::vector<std::vector<StateId>> order_states;  // By StatesByOrder()
+    // States backing off to each state, with their backoff probs; those of
+    // state s are in [backoff_begin[s], backoff_begin[s + 1]).
+    std::vector<size_t> backoff_begin;
+    std::vector<StateId> backoff_states;
+    std::vector<double> backoff_probs;
+    // Transitions into each state, with the state they leave and their
+    // prob; those into state s are in [transition_begin[s],
+    // transition_begin[s + 1]).
+    std::vector<size_t> transition_begin;
+    std::vector<StateId> transition_states;
+    std::vector<double> transition_probs;
+  };
+
+  // Builds the matrix of the power method with re-entry probability
+  // 'alpha'. The transitions into a state are stored in the order in which
+  // a step by state, of decreasing order, would add them, so that both
+  // give the same sums.
+  void BuildStationaryMatrix(double alpha, StationaryMatrix *matrix) const {
+    matrix->order_states = StatesByOrder();
+    // Transitions out of each state, in the order of the step.
+    std::vector<StateId> sources, targets;
+    std::vector<double> trans_probs;
+    std::vector<StateId> backoffs(nstates_, kNoStateId);
+    std::vector<double> bo_probs(nstates_, 0.0);
+    Matcher<Fst<Arc>> matcher(fst_, MATCH_INPUT);  // for querying backoff
+    auto add = [&sources, &targets, &trans_probs](StateId st, StateId nextst,
+                                                  double prob) {
+      sources.push_back(st);
+      targets.push_back(nextst);
+      trans_probs.push_back(prob);
+    };
+    for (int order = hi_order_; order > 0; --order) {
+      for (StateId st : matrix->order_states[order - 1]) {
+        Weight bocost;
+        StateId bo = GetBackoff(st, &bocost);
+        if (bo != -1) {
+          matcher.SetState(bo);
+          backoffs[st] = bo;
+          bo_probs[st] = exp(-ScalarValue(bocost));
+        }
+        for (ArcIterator<Fst<Arc>> aiter(fst_, st); !aiter.Done();
+             aiter.Next()) {
+          const Arc &arc = aiter.Value();
+          if (arc.ilabel == backoff_label_) continue;
+          add(st, arc.nextstate, exp(-ScalarValue(arc.weight)));
+          if (bo != -1 && matcher.Find(arc.ilabel)) {
+            // Subtracts corrective weight for backed-off arc
+            const Arc &barc = matcher.Value();
+            add(st, barc.nextstate,
+                -exp(-ScalarValue(barc.weight) - ScalarValue(bocost)));
+          }
+        }
+        if (ScalarValue(fst_.Final(st)) != ScalarValue(Weight::Zero())) {
+          add(st, fst_.Start(), exp(-ScalarValue(fst_.Final(st))) * alpha);
+          if (bo != -1) {
+            // Subtracts corrective weight for backed-off superfinal arc
+            add(st, fst_.Start(),
+                -exp(-ScalarValue(fst_.Final(bo)) - ScalarValue(bocost)) *
+                    alpha);
+          }
+        }
       }
     }
-
-    if (ScalarValue(fst_.Final(st)) != ScalarValue(Weight::Zero())) {
-      (*probs)[fst_.Start()] +=
-          (*init_probs)[st] * exp(-ScalarValue(fst_.Final(st))) * alpha;
-      if (bo != -1) {
-        // Subtracts corrective weight for backed-off superfinal arc
-        (*probs)[fst_.Start()] -=
-            (*init_probs)[st] *
-            exp(-ScalarValue(fst_.Final(bo)) - ScalarValue(bocost)) * alpha;
-      }
+    // Groups the transitions by the state they enter.
+    CountingSort(targets, &matrix->transition_begin);
+    std::vector<size_t> next(matrix->transition_begin.begin(),
+                             matrix->transition_begin.end() - 1);
+    matrix->transition_states.resize(targets.size());
+    matrix->transition_probs.resize(targets.size());
+    for (size_t i = 0; i < targets.size(); ++i) {
+      const size_t j = next[targets[i]]++;
+      matrix->transition_states[j] = sources[i];
+      matrix->transition_probs[j] = trans_probs[i];
+    }
+    // Groups the backoff arcs by the state they enter, by increasing state.
+    sources.clear();
+    targets.clear();
+    for (StateId st = 0; st < nstates_; ++st) {
+      if (backoffs[st] == kNoStateId) continue;
+      sources.push_back(st);
+      targets.push_back(backoffs[st]);
+    }
+    CountingSort(targets, &matrix->backoff_begin);
+    next.assign(matrix->backoff_begin.begin(), matrix->backoff_begin.end() - 1);
+    matrix->backoff_states.resize(targets.size());
+    matrix->backoff_probs.resize(targets.size());
+    for (size_t i = 0; i < targets.size(); ++i) {
+      const size_t j = next[targets[i]]++;
+      matrix->backoff_states[j] = sources[i];
+      matrix->backoff_probs[j] = bo_probs[sources[i]];
     }
   }
 
+  // Sets '*begin' to the nstates_ + 1 offsets of the groups of the states in
+  // 'targets' when sorted.
+  void CountingSort(const std::vector<StateId> &targets,
+                    std::vector<size_t> *begin) const {
+    begin->assign(nstates_ + 1, 0);
+    for (StateId target : targets) ++(*begin)[target + 1];
+    for (StateId st = 0; st < nstates_; ++st)
+      (*begin)[st + 1] += (*begin)[st];
+  }
+
   // Calculate marginal state probs as the stationary distribution
   // of the Markov chain consisting of the closure of the LM
   // with re-entry probability 'alpha'. The convergence is controlled
   // by 'converge_eps' and the number of iterations by 'maxiters'
-  // Returns true on convergence.
+  // Returns true on convergence. The chain is compiled into a sparse
+  // matrix once; each iteration then computes the probs of the states of
+  // an order, or of all states, by ranges over a pool of
+  // --ngram_check_threads threads started once for all iterations.
   bool StationaryStateProbs(std::vector<double> *probs, double alpha,
                             double converge_eps, size_t maxiters) const {
+    const auto start_time = std::chrono::steady_clock::now();
+    StationaryMatrix matrix;
+    BuildStationaryMatrix(alpha, &matrix);
     std::vector<double> init_probs, last_probs;
     // Initialize based on ngram transition probabilities
     NGramStateProbs(&init_probs, true);
     last_probs = init_probs;
+    probs->clear();
+    probs->resize(nstates_, 0.0);
 
-    size_t changed;
+    ThreadPool pool(CheckThreads());
+    std::atomic<size_t> changed;
     size_t iters = 0;
     do {
-      probs->clear();
-      probs->resize(nstates_, 0.0);
+      // Adds the probs backed off to each state, whose own have been
+      // completed at the previous order.
       for (int order = hi_order_; order > 0; --order) {
-        for (size_t st = 0; st < nstates_; ++st) {
-          if (state_orders_[st] == order)
-            StationaryStateProb(st, &init_probs, probs, alpha);
-        }
+        const std::vector<StateId> &states = matrix.order_states[order - 1];
+        pool.ParallelForRanges(
+            states.size(), kMinCheckStates,
+            [&matrix, &states, &init_probs](size_t, size_t begin, size_t end) {
+              for (size_t i = begin; i < end; ++i) {
+                const StateId st = states[i];
+                double prob = init_probs[st];
+                for (size_t j = matrix.backoff_begin[st];
+                     j < matrix.backoff_begin[st + 1]; ++j) {
+                  prob += init_probs[matrix.backoff_states[j]] *
+                          matrix.backoff_probs[j];
+                }
+                init_probs[st] = prob;
+              }
+            });
       }
+      pool.ParallelForRanges(
+          nstates_, kMinCheckStates,
+          [&matrix, &init_probs, probs](size_t, size_t begin, size_t end) {
+            for (size_t st = begin; st < end; ++st) {
+              double prob = 0.0;
+              for (size_t j = matrix.transition_begin[st];
+                   j < matrix.transition_begin[st + 1]; ++j) {
+                prob += init_probs[matrix.transition_states[j]] *
+                        matrix.transition_probs[j];
+              }
+              (*probs)[st] = prob;
+            }
+          });
 
       changed = 0;
-      for (size_t st = 0; st < nstates_; ++st) {
-        if (fabs((*probs)[st] - last_probs[st]) > converge_eps * last_probs[st])
-          ++changed;
-        last_probs[st] = init_probs[st] = (*probs)[st];
-      }
+      pool.ParallelForRanges(
+          nstates_, kMinCheckStates,
+          [converge_eps, &changed, &init_probs, &last_probs, probs](
+              size_t, size_t begin, size_t end) {
+            size_t range_changed = 0;
+            for (size_t st = begin; st < end; ++st) {
+              if (fabs((*probs)[st] - last_probs[st]) >
+                  converge_eps * last_probs[st])
+                ++range_changed;
+              last_probs[st] = init_probs[st] = (*probs)[st];
+            }
+            changed += range_changed;
+          });
       VLOG(2) << "NGramModel::StationaryStateProbs: state probs changed: "
               << changed;
-      if (++iters > maxiters)
+      if (++iters > maxiters) {
+        VLOG(1) << "NGramModel::StationaryStateProbs: no convergence after "
+                << maxiters << " iterations";
         return false;
+      }
     } while (changed > 0);
+    VLOG(1) << "NGramModel::StationaryStateProbs: converged after " << iters
+            << " iterations in "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                             start_time).count()
+            << " seconds";
     return true;
   }
 
@@ -1085,16 +1338,42 @@ class NGramModel {
   double norm_eps_;           // epsilon diff allowed to ensure normalized
   std::vector<int> state_orders_;  // order of each state
   bool have_state_ngrams_;    // compute and store state n-gram info
-  mutable size_t ascending_ngrams_;     // # of n-gram arcs that increase order
-  std::vector<std::vector<Label>>
-      state_ngrams_;  // n-gram always read to reach state
-  const std::vector<Label> empty_label_vector_;
+  // The n-grams always read to reach states form a tree, in which the
+  // n-gram of each node is that of its parent followed by its label; the
+  // n-gram of a state is that of its node. A state whose n-gram is its
+  // parent state's extended by the label of the arc reaching it, as when
+  // computed from the topology, thus takes a single node.
+  struct NGramNode {
+    uint32 parent;
+    Label label;
+  };
+  static constexpr uint32 kRootNGramNode = 0;  // Node of the empty n-gram.
+  std::vector<NGramNode> ngram_nodes_;
+  std::vector<uint32> state_ngram_nodes_;  // Node of each state
+  // Nodes by ChildKey(), for the nodes below 'indexed_ngram_nodes_' other
+  // than the root, filled by FindNGramNodes() when states are updated.
+  std::unordered_map<uint64, uint32> child_ngram_nodes_;
+  size_t indexed_ngram_nodes_ = 1;
+  // Arc from a state of the current order of ComputeStateOrders().
+  struct FrontierArc {
+    StateId state;
+    Label label;
+    StateId nextstate;
+  };
+  // Fewest states checked or visited by a thread of its own.
+  static constexpr size_t kMinCheckStates = 4096;
   mutable bool error_;
 
   NGramModel(const NGramModel &) = delete;
   NGramModel &operator=(const NGramModel &) = delete;
 };
 
+template <class Arc>
+constexpr uint32 NGramModel<Arc>::kRootNGramNode;
+
+template <class Arc>
+constexpr size_t NGramModel<Arc>::kMinCheckStates;
+
 template <typename T>
 double NGramModel<T>::ScalarValue(NGramModel<T>::Weight w) {
   return w.Value();
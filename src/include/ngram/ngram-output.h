@@ -17,11 +17,15 @@
 #ifndef NGRAM_NGRAM_OUTPUT_H_
 #define NGRAM_NGRAM_OUTPUT_H_
 
+#include <iostream>
+#include <memory>
 #include <ostream>
 #include <string>
+#include <vector>
 
 #include <fst/compose.h>
 #include <ngram/ngram-context.h>
+#include <ngram/ngram-flat-model.h>
 #include <ngram/ngram-mutable-model.h>
 #include <ngram/util.h>
 
@@ -37,6 +41,58 @@ using fst::PhiMatcher;
 
 static const int kSpecialLabel = -2;
 
+// Calculates the perplexity of strings under a flat n-gram model, with the
+// same output as NGramOutput without the phi matcher.
+class NGramFlatOutput {
+ public:
+  typedef StdArc::StateId StateId;
+  typedef StdArc::Label Label;
+
+  explicit NGramFlatOutput(const NGramFlatModel<StdArc> &model,
+                           std::ostream &ostrm = std::cout,
+                           const NGramContext &context = NGramContext(),
+                           bool include_all_suffixes = false)
+      : model_(model),
+        ostrm_(ostrm),
+        context_(context),
+        include_all_suffixes_(include_all_suffixes) {}
+
+  // Use n-gram model to calculate perplexity of input strings, giving
+  // OOVs the label and cost stored with the model.
+  bool PerplexityNGramModel(
+      const std::vector<std::unique_ptr<fst::StdVectorFst>> &infsts,
+      int32 v) const;
+
+  // Apply n-gram model to the string in 'input_fst', whose labels are
+  // those of 'syms', and accumulate stats.
+  void ApplyNGramToFst(const Fst<StdArc> &input_fst,
+                       const fst::SymbolTable &syms, bool verbose,
+                       Label OOV_label, double OOV_cost, double *logprob,
+                       int *words, int *oovs, int *words_skipped) const;
+
+ private:
+  bool InContext(const std::vector<Label> &ngram) const;
+
+  void FindNextStateInModel(StateId *mst, Label label,
+                            const std::string &symbol, double OOV_cost,
+                            Label OOV_label, double *neglogprob,
+                            int *word_cnt, int *oov_cnt, int *words_skipped,
+                            std::string *history, bool verbose,
+                            std::vector<Label> *ngram) const;
+
+  // Calculate and show (if verbose) </s> n-gram, and accumulate stats
+  void ApplyFinalCost(StateId mst, const std::string &history, int word_cnt,
+                      int oov_cnt, int skipped, double neglogprob,
+                      double *logprob, int *words, int *oovs,
+                      int *words_skipped, bool verbose,
+                      const std::vector<Label> &ngram) const;
+
+  const NGramFlatModel<StdArc> &model_;
+  std::ostream &ostrm_;
+  NGramContext context_;
+  bool include_all_suffixes_;
+};
+
 class NGramOutput : public NGramMutableModel<StdArc> {
  public:
   typedef StdArc::StateId StateId;
@@ -76,6 +132,13 @@ class NGramOutput : public NGramMutableModel<StdArc> {
       int32 v, bool phimatch, std::string *OOV_symbol, double OOV_class_size,
       double OOV_probability);
 
+  // Returns a flat copy of the model for scoring strings, after
+  // renormalizing the unigram state for OOVs as PerplexityNGramModel()
+  // does. Returns null on error.
+  NGramFlatModel<StdArc> *GetFlatModel(std::string *OOV_symbol,
+                                       double OOV_class_size,
+                                       double OOV_probability);
+
   // Extract random samples from model and output
   void SampleStringsFromModel(int64 samples, bool show_backoff) {
     DeBackoffNGramModel();                  // Convert from backoff
@@ -110,12 +173,16 @@ class NGramOutput : public NGramMutableModel<StdArc> {
   // assumed to be order preserving (as it is with <epsilon> and -2)
   void MakePhiMatcherLM(Label special_label);
 
-  // Apply n-gram model to fst.  For now, assumes linear fst, accumulates stats
+  // Apply n-gram model to fst.  For now, assumes linear fst, accumulates stats.
+  // Without the phi matcher, the string is scored with 'flat_model', a flat
+  // copy of this model with the same OOV label and cost; if null, one is
+  // built for this call only.
   double ApplyNGramToFst(const fst::StdVectorFst &input_fst,
                          const Fst<StdArc> &symbolfst, bool phimatch,
                          bool verbose, Label special_label, Label OOV_label,
                          double OOV_cost, double *logprob, int *words,
-                         int *oovs, int *words_skipped);
+                         int *oovs, int *words_skipped,
+                         const NGramFlatModel<StdArc> *flat_model = nullptr);
 
   // Adds a phi loop (rho) at unigram state for OOVs
   // OOV_class_size (N) and OOV_probability (p) determine weight of loop: p/N
@@ -155,16 +222,6 @@ class NGramOutput : public NGramMutableModel<StdArc> {
                          int special_label, Label OOV_label, double *logprob,
                          int *words, int *oovs, int *words_skipped) const;
 
-  void ShowNonPhiPerplexity(const Fst<StdArc> &infst, bool verbose,
-                            double OOV_cost, Label OOV_label, double *logprob,
-                            int *words, int *oovs, int *words_skipped) const;
-
-  void FindNextStateInModel(StateId *mst, Label label, double OOV_cost,
-                            Label OOV_label, double *neglogprob, int *word_cnt,
-                            int *oov_cnt, int *words_skipped,
-                            std::string *history, bool verbose,
-                            std::vector<Label> *ngram) const;
-
   // add symbol to n-gram history string
   void AppendWordToNGramHistory(std::string *str,
                                 const std::string &symbol) const {
@@ -172,20 +229,8 @@ class NGramOutput : public NGramMutableModel<StdArc> {
     *str += symbol;
   }
 
-  // Calculate and show (if verbose) </s> n-gram, and accumulate stats
-  void ApplyFinalCost(StateId mst, std::string history, int word_cnt,
-                      int oov_cnt, int skipped, double neglogprob,
-                      double *logprob, int *words, int *oovs,
-                      int *words_skipped, bool verbose,
-                      const std::vector<Label> &ngram) const;
-
   // Header for verbose n-gram entries
-  void ShowNGramProbHeader() const {
-    ostrm_ << "                                                ";
-    ostrm_ << "ngram  -logprob\n";
-    ostrm_ << "        N-gram probability                      ";
-    ostrm_ << "found  (base10)\n";
-  }
+  void ShowNGramProbHeader() const;
 
   // Show the verbose n-gram entries with history order and neglogprob
   void ShowNGramProb(std::string symbol, std::string history, bool oov,
@@ -193,19 +238,7 @@ class NGramOutput : public NGramMutableModel<StdArc> {
 
   // Show summary perplexity numbers, similar to summary given by SRILM
   void ShowPerplexity(size_t sentences, int word_cnt, int oov_cnt,
-                      int words_skipped, double logprob) const {
-    ostrm_ << sentences << " sentences, ";
-    ostrm_ << word_cnt << " words, ";
-    ostrm_ << oov_cnt << " OOVs\n";
-    if (words_skipped > 0) {
-      ostrm_ << "NOTE: " << words_skipped << " OOVs with no probability"
-             << " were skipped in perplexity calculation\n";
-      word_cnt -= words_skipped;
-    }
-    ostrm_ << "logprob(base 10)= " << logprob;
-    ostrm_ << ";  perplexity = ";
-    ostrm_ << pow(10, -logprob / (word_cnt + sentences)) << "\n\n";
-  }
+                      int words_skipped, double logprob) const;
 
   // Calculate prob of </s> and add to accum'd prob, and update total prob
   double SetInitRandProb(StateId hi_state, StateId st, double *r) const;
@@ -225,6 +258,12 @@ class NGramOutput : public NGramMutableModel<StdArc> {
   bool GetOOVLabel(double *OOV_probability, std::string *OOV_symbol,
                    StdArc::Label *OOV_label);
 
+  // Sets the OOV label and cost for the perplexity calculation and
+  // renormalizes the unigram state for OOVs accordingly
+  bool RenormForOOVs(std::string *OOV_symbol, double OOV_class_size,
+                     double OOV_probability, Label *OOV_label,
+                     double *OOV_cost);
+
  private:
   std::ostream &ostrm_;
   bool include_all_suffixes_;
@@ -29,11 +29,14 @@
 #include <ngram/ngram-count-merge.h>
 #include <ngram/ngram-count-of-counts.h>
 #include <ngram/ngram-count-prune.h>
+#include <ngram/ngram-flat-model.h>
+#include <ngram/ngram-hash-model.h>
 #include <ngram/ngram-hist-merge.h>
 #include <ngram/ngram-input.h>
 #include <ngram/ngram-katz.h>
 #include <ngram/ngram-kneser-ney.h>
 #include <ngram/ngram-list-prune.h>
+#include <ngram/ngram-lookup-cache.h>
 #include <ngram/ngram-make.h>
 #include <ngram/ngram-marginalize.h>
 #include <ngram/ngram-merge.h>
@@ -15,6 +15,15 @@
 #ifndef NGRAM_UTIL_H_
 #define NGRAM_UTIL_H_
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
 #include <fst/flags.h>
 #include <fst/log.h>
 
@@ -25,4 +34,125 @@ DECLARE_bool(ngram_error_fatal);
 #define NGRAMERROR() \
   (FLAGS_ngram_error_fatal ? LOG(FATAL) : LOG(ERROR))
 
+// MODEL VALIDATION
+
+DECLARE_int32(ngram_check_threads);
+DECLARE_bool(trust_model);
+
+namespace ngram {
+
+// A fixed set of worker threads running scheduled calls, so that code
+// running parallel loops repeatedly, or overlapping them with its own work,
+// starts its threads once. The threads are started by the first scheduled
+// call; calls are scheduled from the thread owning the pool.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int threads) : threads_(std::max(threads, 1)) {}
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    work_ready_.notify_all();
+    for (auto &worker : workers_) worker.join();
+  }
+
+  int NumThreads() const { return threads_; }
+
+  // Schedules 'task' to run on a worker thread and returns at once.
+  void Schedule(std::function<void()> task) {
+    if (workers_.empty()) {
+      for (int t = 0; t < threads_; ++t)
+        workers_.emplace_back([this]() { Work(); });
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push(std::move(task));
+      ++pending_;
+    }
+    work_ready_.notify_one();
+  }
+
+  // Waits for all scheduled calls to complete.
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    all_done_.wait(lock, [this]() { return pending_ == 0; });
+  }
+
+  // Calls func(i) for each i in [0, n), spread over the threads, and waits
+  // for all scheduled calls to complete.
+  template <class Func>
+  void ParallelFor(size_t n, const Func &func) {
+    const size_t threads = std::min<size_t>(NumThreads(), n);
+    for (size_t t = 0; t < threads; ++t) {
+      Schedule([&func, n, threads, t]() {
+        for (size_t i = t; i < n; i += threads) func(i);
+      });
+    }
+    Wait();
+  }
+
+  // Splits [0, n) into at most NumThreads() consecutive ranges of at least
+  // 'min_size' elements and calls func(range, begin, end) for each, on the
+  // calling thread if there is a single range, and waits for all scheduled
+  // calls to complete. Returns the number of ranges.
+  template <class Func>
+  size_t ParallelForRanges(size_t n, size_t min_size, const Func &func) {
+    const size_t max_ranges =
+        std::max<size_t>(n / std::max<size_t>(min_size, 1), 1);
+    const size_t ranges = std::min<size_t>(threads_, max_ranges);
+    if (ranges == 1) {
+      func(0, 0, n);
+      return 1;
+    }
+    for (size_t r = 0; r < ranges; ++r) {
+      Schedule([&func, n, ranges, r]() {
+        func(r, n * r / ranges, n * (r + 1) / ranges);
+      });
+    }
+    Wait();
+    return ranges;
+  }
+
+ private:
+  void Work() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_ready_.wait(lock, [this]() { return done_ || !tasks_.empty(); });
+        if (tasks_.empty()) return;
+        task = std::move(tasks_.front());
+        tasks_.pop();
+      }
+      task();
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--pending_ == 0) all_done_.notify_all();
+    }
+  }
+
+  const int threads_;
+  std::vector<std::thread> workers_;
+  std::queue<std::function<void()>> tasks_;
+  size_t pending_ = 0;  // Scheduled calls not yet completed.
+  bool done_ = false;
+  std::mutex mutex_;
+  std::condition_variable work_ready_;
+  std::condition_variable all_done_;
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+};
+
+// As ThreadPool::ParallelForRanges() with a pool of 'threads' threads.
+template <class Func>
+size_t ParallelForRanges(size_t n, int threads, size_t min_size,
+                         const Func &func) {
+  ThreadPool pool(threads);
+  return pool.ParallelForRanges(n, min_size, func);
+}
+
+}  // namespace ngram
+
 #endif  // NGRAM_UTIL_H_
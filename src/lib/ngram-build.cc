@@ -0,0 +1,94 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Makes a model from the n-gram counts of the input, in memory.
+
+#include <ngram/ngram-build.h>
+
+#include <vector>
+
+#include <fst/vector-fst.h>
+#include <ngram/ngram-count-of-counts.h>
+#include <ngram/ngram-count.h>
+#include <ngram/ngram-make.h>
+
+namespace ngram {
+namespace {
+
+// Returns true if 'method' discounts with the count-of-counts of the raw
+// counts, which can then be collected while counting. Kneser-Ney computes
+// them from its modified lower-order counts instead.
+bool UsesCountOfCounts(const std::string &method) {
+  return method == "katz" || method == "absolute";
+}
+
+// Makes a model from the counts in 'fst', with the count-of-counts in
+// 'count_of_counts' if not null.
+bool MakeModelFromCounts(fst::StdMutableFst *fst,
+                         const NGramCountOfCounts<fst::StdArc> *count_of_counts,
+                         const std::string &method, bool backoff,
+                         bool interpolate, int64 bins, double witten_bell_k,
+                         double discount_D, int64 backoff_label,
+                         double norm_eps, bool check_consistency) {
+  fst::StdVectorFst ccfst;
+  if (count_of_counts) count_of_counts->GetFst(&ccfst);
+  return NGramMakeModel(fst, method, count_of_counts ? &ccfst : nullptr,
+                        backoff, interpolate, bins, witten_bell_k, discount_D,
+                        backoff_label, norm_eps, check_consistency);
+}
+
+}  // namespace
+
+bool NGramBuildModel(fst::FarReader<fst::StdArc> *far_reader,
+                     fst::StdMutableFst *fst, int order,
+                     const NGramCountOptions &count_options,
+                     const std::string &method, bool backoff,
+                     bool interpolate, int64 bins, double witten_bell_k,
+                     double discount_D, int64 backoff_label, double norm_eps,
+                     bool check_consistency) {
+  NGramCountOfCounts<fst::StdArc> count_of_counts;
+  NGramCountOfCounts<fst::StdArc> *collected =
+      UsesCountOfCounts(method) ? &count_of_counts : nullptr;
+  NGramCountOptions options = count_options;
+  options.count_of_counts = collected;
+  if (!GetNGramCounts(far_reader, fst, order, options)) {
+    return false;
+  }
+  return MakeModelFromCounts(fst, collected, method, backoff, interpolate,
+                             bins, witten_bell_k, discount_D, backoff_label,
+                             norm_eps, check_consistency);
+}
+
+bool NGramBuildModelFromText(std::istream &strm, const fst::SymbolTable &syms,
+                             fst::StdMutableFst *fst, int order,
+                             const NGramCountOptions &count_options,
+                             const std::string &method, bool backoff,
+                             bool interpolate, int64 bins,
+                             double witten_bell_k, double discount_D,
+                             int64 backoff_label, double norm_eps,
+                             bool check_consistency) {
+  NGramCountOfCounts<fst::StdArc> count_of_counts;
+  NGramCountOfCounts<fst::StdArc> *collected =
+      UsesCountOfCounts(method) ? &count_of_counts : nullptr;
+  NGramCountOptions options = count_options;
+  options.count_of_counts = collected;
+  if (!GetNGramCountsFromText(strm, syms, fst, order, options)) {
+    return false;
+  }
+  return MakeModelFromCounts(fst, collected, method, backoff, interpolate,
+                             bins, witten_bell_k, discount_D, backoff_label,
+                             norm_eps, check_consistency);
+}
+
+}  // namespace ngram
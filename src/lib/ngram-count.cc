@@ -16,13 +16,36 @@
 
 #include <ngram/ngram-count.h>
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <unordered_map>
 
 #include <ngram/hist-mapper.h>
+#include <ngram/ngram-count-prune.h>
 #include <ngram/ngram-hist-merge.h>
 
 namespace ngram {
 
+// Number of input FSTs given to each counting thread per batch.
+static const size_t kFstsPerThread = 4096;
+
+// Number of input FSTs counted into histograms by each thread per batch;
+// these are typically lattices, with much larger counts than strings.
+static const size_t kHistFstsPerThread = 64;
+
+// Bytes of text buffered by WriteCountStrings() between writes.
+static const size_t kCountStringsBufferSize = 1 << 20;
+
 // Rounds -log count to values corresponding to the rounded integer count;
 // reduces small floating point precision issues when dealing with int counts;
 // primarily for testing that methods for deriving the same model are identical.
@@ -61,27 +84,112 @@ double GetNGramAndCount(
   return ngram_count.second.second;
 }
 
-// Gets ngram counts for the next fst in far_reader.
+// Counts n-grams from a single fst.
+template <class Counter>
+void CountFst(const std::string &countname, const fst::StdVectorFst &ifst,
+              int fstnumber, Counter *ngram_counter) {
+  bool counted = false;
+  if (ifst.Properties(fst::kString, true)) {
+    counted = ngram_counter->Count(ifst);
+  } else {
+    fst::VectorFst<fst::Log64Arc> log_ifst;
+    Map(ifst, &log_ifst, internal::ToLog64Mapper<fst::StdArc>());
+    counted = ngram_counter->Count(&log_ifst);
+  }
+  if (!counted) LOG(ERROR) << countname << ": fst #" << fstnumber << " skipped";
+}
+
+// Maps the labels of input fsts to the labels of the same words in a
+// restricted vocabulary, through a flat array indexed by input label. The
+// array is built from the symbol table of the first input fst, which the
+// other input fsts are assumed to share. Words that are not in the
+// vocabulary are mapped to the OOV label, so that no input is dropped.
+class VocabularyMap {
+ public:
+  using Label = fst::StdArc::Label;
+
+  // Sets the vocabulary and the OOV symbol. Returns false if the OOV symbol
+  // is empty or not in the vocabulary.
+  bool Init(const fst::SymbolTable &vocab, const std::string &oov_symbol) {
+    vocab_ = &vocab;
+    if (oov_symbol.empty()) {
+      LOG(ERROR) << "ngramcount: a vocabulary requires an OOV symbol";
+      return false;
+    }
+    oov_label_ = vocab.Find(oov_symbol);
+    if (oov_label_ == fst::kNoSymbol) {
+      LOG(ERROR) << "ngramcount: OOV symbol not in vocabulary: "
+                 << oov_symbol;
+      return false;
+    }
+    return true;
+  }
+
+  const fst::SymbolTable &Vocabulary() const { return *vocab_; }
+
+  // Relabels 'fst' in place with vocabulary labels, labels missing from the
+  // input symbol table being mapped to the OOV label as well. Returns false
+  // if no input symbol table is known.
+  bool Relabel(fst::StdMutableFst *fst) {
+    if (label_map_.empty() && !InitLabelMap(fst->InputSymbols())) {
+      return false;
+    }
+    for (fst::StdArc::StateId s = 0; s < fst->NumStates(); ++s) {
+      for (fst::MutableArcIterator<fst::StdMutableFst> aiter(fst, s);
+           !aiter.Done(); aiter.Next()) {
+        fst::StdArc arc = aiter.Value();
+        if (arc.ilabel == 0) continue;
+        Label label = static_cast<size_t>(arc.ilabel) < label_map_.size()
+                          ? label_map_[arc.ilabel]
+                          : oov_label_;
+        if (label == arc.ilabel) continue;
+        arc.ilabel = arc.olabel = label;
+        aiter.SetValue(arc);
+      }
+    }
+    return true;
+  }
+
+ private:
+  bool InitLabelMap(const fst::SymbolTable *syms) {
+    if (syms == nullptr || syms->NumSymbols() == 0) {
+      LOG(ERROR) << "ngramcount: input fst has no symbol table to map to "
+                 << "the vocabulary";
+      return false;
+    }
+    label_map_.assign(std::max<int64>(syms->AvailableKey(), 1), oov_label_);
+    for (const auto &sitem : *syms) {
+      int64 label = vocab_->Find(sitem.Symbol());
+      label_map_[sitem.Label()] = label == fst::kNoSymbol ? oov_label_ : label;
+    }
+    label_map_[0] = 0;
+    return true;
+  }
+
+  const fst::SymbolTable *vocab_ = nullptr;
+  Label oov_label_ = fst::kNoLabel;
+  std::vector<Label> label_map_;  // Indexed by input label.
+};
+
+// Gets ngram counts for the next fst in far_reader, first relabeling it with
+// vocab_map if not null.
+template <class Counter>
 bool GetCounts(const std::string &countname,
-               NGramCounter<fst::Log64Weight> *ngram_counter,
+               Counter *ngram_counter,
                fst::FarReader<fst::StdArc> *far_reader, int fstnumber,
-               fst::SymbolTable *syms) {
-  std::unique_ptr<const fst::StdVectorFst> ifst(
+               fst::SymbolTable *syms, VocabularyMap *vocab_map = nullptr) {
+  std::unique_ptr<fst::StdVectorFst> ifst(
       new fst::StdVectorFst(*far_reader->GetFst()));
   if (!ifst) {
     LOG(ERROR) << countname << ": unable to read fst #" << fstnumber;
     return false;
   }
 
-  bool counted = false;
-  if (ifst->Properties(fst::kString, true)) {
-    counted = ngram_counter->Count(*ifst);
+  if (vocab_map && !vocab_map->Relabel(ifst.get())) {
+    LOG(ERROR) << countname << ": fst #" << fstnumber << " skipped";
   } else {
-    fst::VectorFst<fst::Log64Arc> log_ifst;
-    Map(*ifst, &log_ifst, internal::ToLog64Mapper<fst::StdArc>());
-    counted = ngram_counter->Count(&log_ifst);
+    CountFst(countname, *ifst, fstnumber, ngram_counter);
   }
-  if (!counted) LOG(ERROR) << countname << ": fst #" << fstnumber << " skipped";
   if (ifst->InputSymbols() != nullptr && syms->NumSymbols() == 0) {
     // Retains symbol table if available and not yet retained.
     *syms = *ifst->InputSymbols();
@@ -90,6 +198,214 @@ bool GetCounts(const std::string &countname,
   return true;
 }
 
+// Opens a new temporary file for reading and writing. The file is removed
+// from the file system right away and is deleted once the stream is closed.
+std::fstream *OpenTempFile() {
+  const char *tmpdir = std::getenv("TMPDIR");
+  std::string name = std::string(tmpdir ? tmpdir : "/tmp") + "/ngram-XXXXXX";
+  std::vector<char> filename(name.begin(), name.end());
+  filename.push_back('\0');
+  int fd = mkstemp(filename.data());
+  if (fd < 0) return nullptr;
+  close(fd);
+  std::unique_ptr<std::fstream> strm(new std::fstream(
+      filename.data(), std::ios_base::in | std::ios_base::out |
+                           std::ios_base::binary | std::ios_base::trunc));
+  std::remove(filename.data());
+  if (!*strm) return nullptr;
+  return strm.release();
+}
+
+// Writes the counts held by ngram_counter to a new sorted run on disk and
+// clears the counter.
+template <class Counter>
+bool SpillCounts(Counter *ngram_counter,
+                 std::vector<std::unique_ptr<std::fstream>> *runs) {
+  std::unique_ptr<std::fstream> run(OpenTempFile());
+  if (!run) {
+    NGRAMERROR() << "SpillCounts: unable to open temporary file";
+    return false;
+  }
+  if (!ngram_counter->WriteSortedNGrams(*run)) return false;
+  run->flush();
+  VLOG(1) << "SpillCounts: spilled run #" << runs->size() + 1 << " ("
+          << ngram_counter->MemoryUsage() << " bytes)";
+  ngram_counter->Clear();
+  runs->push_back(std::move(run));
+  return true;
+}
+
+// Spills the counts of ngram_counter to disk if they exceed max_memory bytes.
+template <class Counter>
+bool MaybeSpillCounts(Counter *ngram_counter,
+                      size_t max_memory,
+                      std::vector<std::unique_ptr<std::fstream>> *runs) {
+  if (max_memory == 0 || ngram_counter->MemoryUsage() <= max_memory)
+    return true;
+  return SpillCounts(ngram_counter, runs);
+}
+
+// A batch of input fsts, split into consecutive shards that are each
+// counted by a thread of the pool into a private counter, which spills its
+// counts to runs of its own when they exceed 'max_memory' bytes. Only one
+// batch of a pool is counted at a time.
+template <class Counter>
+struct CountBatch {
+  std::vector<std::unique_ptr<const fst::StdVectorFst>> fsts;
+  std::vector<std::unique_ptr<Counter>> counters;
+  std::vector<std::vector<std::unique_ptr<std::fstream>>> runs;
+  std::vector<char> spilled;  // Whether each shard could spill its counts.
+  ThreadPool *pool = nullptr;  // Pool counting the batch, if started.
+  int fstnumber;      // Number of the first fst in the batch.
+  size_t max_memory;  // Memory budget of each shard counter (0: none).
+
+  ~CountBatch() { Join(); }
+
+  // Waits for all shards to be counted.
+  void Join() {
+    if (pool) pool->Wait();
+  }
+};
+
+// Counts fsts [begin, end) of the batch into the counter of shard 't',
+// skipping null ones.
+template <class Counter>
+void CountShard(CountBatch<Counter> *batch, size_t t, size_t begin,
+                size_t end) {
+  Counter *ngram_counter = batch->counters[t].get();
+  for (size_t i = begin; i < end; ++i) {
+    if (!batch->fsts[i]) continue;
+    CountFst("ngramcount", *batch->fsts[i], batch->fstnumber + i,
+             ngram_counter);
+    if (!MaybeSpillCounts(ngram_counter, batch->max_memory,
+                          &batch->runs[t])) {
+      batch->spilled[t] = false;
+      return;
+    }
+  }
+}
+
+// Reads up to 'threads' * kFstsPerThread fsts from far_reader into the
+// batch, relabeling them with vocab_map if not null. Returns false if there
+// was nothing left to read.
+template <class Counter>
+bool ReadCountBatch(fst::FarReader<fst::StdArc> *far_reader, int threads,
+                    int *fstnumber, fst::SymbolTable *syms,
+                    VocabularyMap *vocab_map, CountBatch<Counter> *batch) {
+  batch->fstnumber = *fstnumber;
+  for (; !far_reader->Done() && batch->fsts.size() < threads * kFstsPerThread;
+       far_reader->Next()) {
+    std::unique_ptr<fst::StdVectorFst> ifst(
+        new fst::StdVectorFst(*far_reader->GetFst()));
+    const fst::SymbolTable *isyms = ifst->InputSymbols();
+    if (isyms != nullptr && syms->NumSymbols() == 0) {
+      // Retains symbol table if available and not yet retained.
+      *syms = *isyms;
+    }
+    if (vocab_map && !vocab_map->Relabel(ifst.get())) {
+      // Keeps a null fst in its place, so that fsts keep their numbers.
+      LOG(ERROR) << "ngramcount: fst #" << *fstnumber << " skipped";
+      ifst.reset();
+    }
+    batch->fsts.push_back(std::move(ifst));
+    ++*fstnumber;
+  }
+  return !batch->fsts.empty();
+}
+
+// Schedules the counting of each shard of the batch on the pool, one shard
+// per thread, each shard counter having a budget of 'max_memory' bytes if
+// non-zero.
+template <class Counter>
+void StartCountBatch(ThreadPool *pool, size_t max_memory,
+                     const Counter &ngram_counter,
+                     CountBatch<Counter> *batch) {
+  const int threads = pool->NumThreads();
+  batch->max_memory = max_memory;
+  batch->pool = pool;
+  batch->runs.resize(threads);
+  batch->spilled.assign(threads, true);
+  for (int t = 0; t < threads; ++t) {
+    batch->counters.emplace_back(new Counter(
+        ngram_counter.Order(), ngram_counter.EpsilonAsBackoff(),
+        kCountDelta, ngram_counter.DeferBackoffCounts()));
+  }
+  size_t begin = 0;
+  for (int t = 0; t < threads; ++t) {
+    size_t end = batch->fsts.size() * (t + 1) / threads;
+    pool->Schedule([batch, t, begin, end]() {
+      CountShard(batch, t, begin, end);
+    });
+    begin = end;
+  }
+}
+
+// Merges the shard counts of a completed batch, in input order, into
+// ngram_counter, moves the runs spilled by the shards to 'runs' and clears
+// the batch. The merged counts are spilled as soon as they exceed
+// 'max_memory' bytes, if non-zero.
+template <class Counter>
+bool MergeCountBatch(CountBatch<Counter> *batch, size_t max_memory,
+                     Counter *ngram_counter,
+                     std::vector<std::unique_ptr<std::fstream>> *runs) {
+  bool merged = true;
+  for (size_t t = 0; t < batch->counters.size(); ++t) {
+    if (!batch->spilled[t] ||
+        !ngram_counter->MergeCounts(*batch->counters[t]) ||
+        !MaybeSpillCounts(ngram_counter, max_memory, runs)) {
+      merged = false;
+      break;
+    }
+    batch->counters[t].reset();
+    for (auto &run : batch->runs[t]) runs->push_back(std::move(run));
+  }
+  batch->fsts.clear();
+  batch->counters.clear();
+  batch->runs.clear();
+  batch->pool = nullptr;
+  return merged;
+}
+
+// Counts all fsts in far_reader using 'threads' counting threads. Reading
+// the next batch and merging the previous one are overlapped with counting.
+// With a memory budget, half of it goes to the merged counts and the other
+// half is shared by the shard counters of the two batches in flight.
+template <class Counter>
+bool GetNGramsInParallel(fst::FarReader<fst::StdArc> *far_reader,
+                         Counter *ngram_counter,
+                         fst::SymbolTable *syms, int threads,
+                         size_t max_memory,
+                         std::vector<std::unique_ptr<std::fstream>> *runs,
+                         VocabularyMap *vocab_map) {
+  const size_t merged_memory = max_memory / 2;
+  const size_t shard_memory =
+      max_memory == 0 ? 0 : std::max<size_t>(max_memory / (4 * threads), 1);
+  int fstnumber = 1;
+  ThreadPool pool(threads);
+  CountBatch<Counter> batches[2];
+  int current = 0;
+  bool more = ReadCountBatch(far_reader, threads, &fstnumber, syms, vocab_map,
+                             &batches[current]);
+  if (more) {
+    StartCountBatch(&pool, shard_memory, *ngram_counter, &batches[current]);
+  }
+  while (more) {
+    int next = 1 - current;
+    more = ReadCountBatch(far_reader, threads, &fstnumber, syms, vocab_map,
+                          &batches[next]);
+    batches[current].Join();
+    if (more) {
+      StartCountBatch(&pool, shard_memory, *ngram_counter, &batches[next]);
+    }
+    if (!MergeCountBatch(&batches[current], merged_memory, ngram_counter,
+                         runs)) {
+      return false;
+    }
+    current = next;
+  }
+  return true;
+}
+
 // Builds a count WFST from a single input.
 bool GetSingleCountFst(fst::FarReader<fst::StdArc> *far_reader,
                        fst::StdMutableFst *fst, int fstnumber, int order,
@@ -113,12 +429,164 @@ bool GetSingleCountFst(fst::FarReader<fst::StdArc> *far_reader,
   return true;
 }
 
+// Builds a histogram count WFST from a single input fst, as
+// GetSingleCountFst() followed by conversion to HistogramArc.
+bool GetSingleHistFst(const fst::StdVectorFst &ifst, int fstnumber, int order,
+                      bool epsilon_as_backoff,
+                      fst::VectorFst<HistogramArc> *hist_fst) {
+  NGramCounter<fst::Log64Weight> ngram_counter(order, epsilon_as_backoff);
+  if (ngram_counter.Error()) {
+    return false;
+  }
+  CountFst("ngramhistcount", ifst, fstnumber, &ngram_counter);
+  fst::StdVectorFst count_fst;
+  ngram_counter.GetFst(&count_fst);
+  fst::ArcSort(&count_fst, fst::StdILabelCompare());
+  const fst::SymbolTable *syms = ifst.InputSymbols();
+  if (syms != nullptr && syms->NumSymbols() > 0) {
+    count_fst.SetInputSymbols(syms);
+    count_fst.SetOutputSymbols(syms);
+  }
+  Map(count_fst, hist_fst, fst::ToHistogramMapper<fst::StdArc>());
+  return true;
+}
+
+// Computes the histogram counts of ifsts [begin, end) into hist_fst,
+// merging them in input order.
+bool GetShardHistograms(
+    const std::vector<std::unique_ptr<const fst::StdVectorFst>> &ifsts,
+    size_t begin, size_t end, int fstnumber, int order,
+    bool epsilon_as_backoff, int backoff_label, double norm_eps,
+    bool check_consistency, double alpha, double beta,
+    fst::VectorFst<HistogramArc> *hist_fst) {
+  std::unique_ptr<NGramHistMerge> ngramrg;
+  for (size_t i = begin; i < end; ++i) {
+    fst::VectorFst<HistogramArc> in_hist_fst;
+    if (!GetSingleHistFst(*ifsts[i], fstnumber + i, order, epsilon_as_backoff,
+                          ngramrg ? &in_hist_fst : hist_fst)) {
+      LOG(ERROR) << "failed to count fst number " << fstnumber + i;
+      return false;
+    }
+    if (ngramrg == nullptr) {
+      ngramrg.reset(new NGramHistMerge(hist_fst, backoff_label, norm_eps,
+                                       check_consistency));
+    } else {
+      ngramrg->MergeNGramModels(in_hist_fst, alpha, beta);
+    }
+    if (ngramrg->Error()) return false;
+  }
+  return true;
+}
+
+// Merges the histogram counts of hist_fst2 into hist_fst1.
+bool MergeHistFsts(fst::VectorFst<HistogramArc> *hist_fst1,
+                   const fst::VectorFst<HistogramArc> &hist_fst2,
+                   int backoff_label, double norm_eps, bool check_consistency,
+                   double alpha, double beta) {
+  NGramHistMerge ngramrg(hist_fst1, backoff_label, norm_eps,
+                         check_consistency);
+  ngramrg.MergeNGramModels(hist_fst2, alpha, beta);
+  return !ngramrg.Error();
+}
+
+// Merges the histogram fsts into the first one with a reduction tree, each
+// round merging adjacent pairs in parallel. Since a merge numbers the new
+// states of its second argument after all states of the first, the result
+// has the same states, in the same order, as merging the fsts one by one.
+bool ReduceHistFsts(
+    std::vector<std::unique_ptr<fst::VectorFst<HistogramArc>>> *hist_fsts,
+    ThreadPool *pool, int backoff_label, double norm_eps,
+    bool check_consistency, double alpha, double beta) {
+  while (hist_fsts->size() > 1) {
+    const size_t pairs = hist_fsts->size() / 2;
+    std::vector<char> merged(pairs, false);
+    pool->ParallelFor(pairs, [&](size_t p) {
+      merged[p] = MergeHistFsts((*hist_fsts)[2 * p].get(),
+                                *(*hist_fsts)[2 * p + 1], backoff_label,
+                                norm_eps, check_consistency, alpha, beta);
+    });
+    for (char m : merged) {
+      if (!m) return false;
+    }
+    for (size_t p = 1; p < pairs; ++p) {
+      (*hist_fsts)[p] = std::move((*hist_fsts)[2 * p]);
+    }
+    if (hist_fsts->size() % 2 == 1) {
+      (*hist_fsts)[pairs] = std::move(hist_fsts->back());
+    }
+    hist_fsts->resize((hist_fsts->size() + 1) / 2);
+  }
+  return true;
+}
+
+// Computes histogram counts using 'threads' threads. The fsts of
+// far_reader are read in batches, each split into consecutive shards whose
+// histogram counts are computed in parallel and then merged by
+// ReduceHistFsts(). Each batch result is merged into the counts of the
+// previous batches.
+bool GetNGramHistogramsInParallel(fst::FarReader<fst::StdArc> *far_reader,
+                                  fst::VectorFst<HistogramArc> *fst,
+                                  int order, bool epsilon_as_backoff,
+                                  int backoff_label, double norm_eps,
+                                  bool check_consistency, double alpha,
+                                  double beta, int threads) {
+  int fstnumber = 1;
+  ThreadPool pool(threads);
+  std::unique_ptr<NGramHistMerge> ngramrg;
+  while (!far_reader->Done()) {
+    std::vector<std::unique_ptr<const fst::StdVectorFst>> ifsts;
+    for (; !far_reader->Done() && ifsts.size() < threads * kHistFstsPerThread;
+         far_reader->Next()) {
+      ifsts.emplace_back(new fst::StdVectorFst(*far_reader->GetFst()));
+    }
+    const size_t shards = std::min<size_t>(threads, ifsts.size());
+    std::vector<std::unique_ptr<fst::VectorFst<HistogramArc>>> hist_fsts;
+    for (size_t t = 0; t < shards; ++t) {
+      hist_fsts.emplace_back(new fst::VectorFst<HistogramArc>());
+    }
+    std::vector<char> counted(shards, false);
+    pool.ParallelFor(shards, [&](size_t t) {
+      counted[t] = GetShardHistograms(
+          ifsts, ifsts.size() * t / shards, ifsts.size() * (t + 1) / shards,
+          fstnumber, order, epsilon_as_backoff, backoff_label, norm_eps,
+          check_consistency, alpha, beta, hist_fsts[t].get());
+    });
+    for (char c : counted) {
+      if (!c) return false;
+    }
+    fstnumber += ifsts.size();
+    ifsts.clear();
+    if (!ReduceHistFsts(&hist_fsts, &pool, backoff_label, norm_eps,
+                        check_consistency, alpha, beta)) {
+      return false;
+    }
+    if (ngramrg == nullptr) {
+      *fst = *hist_fsts[0];
+      hist_fsts.clear();
+      ngramrg.reset(new NGramHistMerge(fst, backoff_label, norm_eps,
+                                       check_consistency));
+    } else {
+      ngramrg->MergeNGramModels(*hist_fsts[0], alpha, beta);
+    }
+    if (ngramrg->Error()) return false;
+  }
+  return true;
+}
+
 // Computes counts using the HistogramArc template.
 bool GetNGramHistograms(fst::FarReader<fst::StdArc> *far_reader,
                         fst::VectorFst<HistogramArc> *fst,
                         int order, bool epsilon_as_backoff, int backoff_label,
                         double norm_eps, bool check_consistency, bool normalize,
-                        double alpha, double beta) {
+                        double alpha, double beta, int threads) {
+  // Normalization is done by the last pairwise merge, so it is left to the
+  // sequential merges below.
+  if (threads > 1 && !normalize) {
+    return GetNGramHistogramsInParallel(far_reader, fst, order,
+                                        epsilon_as_backoff, backoff_label,
+                                        norm_eps, check_consistency, alpha,
+                                        beta, threads);
+  }
   int fstnumber = 1;
   std::unique_ptr<NGramHistMerge> ngramrg;
   while (!far_reader->Done()) {
@@ -144,41 +612,632 @@ bool GetNGramHistograms(fst::FarReader<fst::StdArc> *far_reader,
   return true;
 }
 
-// Derives n-gram counts (and symbols) from input FAR reader.
+// Builds an ngram format count FST from n-grams given in lexicographic
+// order, as written by NGramCounter::WriteSortedNGrams. States are created
+// in the order of their histories. Since the destination of highest-order
+// n-grams and backoff arcs are not known before all n-grams have been
+// added, they are filled in by Finish(). If 'count_of_counts' is not null,
+// its histograms are filled from the n-grams as they are added.
+class SortedNGramFstBuilder {
+ public:
+  SortedNGramFstBuilder(
+      int order, fst::StdMutableFst *fst,
+      NGramCountOfCounts<fst::StdArc> *count_of_counts = nullptr)
+      : order_(order), fst_(fst), count_of_counts_(count_of_counts) {
+    fst_->DeleteStates();
+    if (count_of_counts_) count_of_counts_->InitCounts(order_);
+    unigram_ = AddState(fst::kNoStateId, 0, std::vector<int>());
+    path_.push_back(unigram_);
+    start_ = unigram_;
+    if (order_ > 1) {
+      start_ = AddState(unigram_, 0, std::vector<int>(1, 0));
+      path_.push_back(start_);
+    }
+    fst_->SetStart(start_);
+  }
+
+  // Adds an n-gram and its count, the n-gram following the previously
+  // added one in lexicographic order.
+  bool AddNGram(const std::vector<int> &ngram, fst::Log64Weight count) {
+    if (ngram.empty() || ngram.size() > order_ ||
+        ngram.size() > path_.size() || !(last_ngram_ < ngram)) {
+      NGRAMERROR() << "SortedNGramFstBuilder: n-grams not in order";
+      return false;
+    }
+    last_ngram_ = ngram;
+    size_t length = ngram.size();
+    fst::StdArc::StateId origin = path_[length - 1];
+    int label = ngram.back();
+    totals_[origin] = Plus(totals_[origin], count);
+    if (count_of_counts_ && in_context_[origin])
+      count_of_counts_->AddCount(length - 1, count.Value());
+    if (label == 0) {
+      fst_->SetFinal(origin, count.Value());
+      return true;
+    }
+    fst::StdArc::StateId destination = fst::kNoStateId;
+    if (length < order_) {
+      destination = AddState(origin, label, ngram);
+      path_.resize(length);
+      path_.push_back(destination);
+    }
+    fst_->AddArc(origin,
+                 fst::StdArc(label, label, count.Value(), destination));
+    return true;
+  }
+
+  // Sets the destination of backoff and highest-order arcs, and the
+  // weights of backoff arcs to the total count of their origin state.
+  bool Finish() {
+    std::vector<fst::StdArc::StateId> backoffs(fst_->NumStates(),
+                                               fst::kNoStateId);
+    for (fst::StdArc::StateId s = 0; s < fst_->NumStates(); ++s) {
+      if (s == unigram_) continue;
+      fst::StdArc::StateId parent = parents_[s];
+      backoffs[s] = s == start_ || parent == unigram_
+                        ? unigram_
+                        : FindNextState(backoffs[parent], labels_[s]);
+      if (backoffs[s] == fst::kNoStateId) return false;
+      fst::MutableArcIterator<fst::StdMutableFst> aiter(fst_, s);
+      fst::StdArc arc = aiter.Value();
+      arc.weight = totals_[s].Value();
+      arc.nextstate = backoffs[s];
+      aiter.SetValue(arc);
+    }
+    for (fst::StdArc::StateId s = 0; s < fst_->NumStates(); ++s) {
+      for (fst::MutableArcIterator<fst::StdMutableFst> aiter(fst_, s);
+           !aiter.Done(); aiter.Next()) {
+        fst::StdArc arc = aiter.Value();
+        if (arc.nextstate != fst::kNoStateId) continue;
+        arc.nextstate = s == unigram_
+                            ? unigram_
+                            : FindNextState(backoffs[s], arc.ilabel);
+        if (arc.nextstate == fst::kNoStateId) return false;
+        aiter.SetValue(arc);
+      }
+    }
+    return true;
+  }
+
+ private:
+  // Adds a state with n-gram 'ngram' reached from 'parent' with 'label',
+  // with a backoff arc unless it is the unigram state.
+  fst::StdArc::StateId AddState(fst::StdArc::StateId parent, int label,
+                                const std::vector<int> &ngram) {
+    fst::StdArc::StateId s = fst_->AddState();
+    parents_.push_back(parent);
+    labels_.push_back(label);
+    totals_.push_back(fst::Log64Weight::Zero());
+    in_context_.push_back(count_of_counts_ &&
+                          count_of_counts_->HasContext(ngram));
+    if (parent != fst::kNoStateId) {
+      fst_->AddArc(s, fst::StdArc(0, 0, fst::StdArc::Weight::Zero(),
+                                  fst::kNoStateId));
+    }
+    return s;
+  }
+
+  // Returns the destination of the arc labeled 'label' leaving state 's',
+  // whose arcs are sorted by label.
+  fst::StdArc::StateId FindNextState(fst::StdArc::StateId s, int label) {
+    fst::ArcIterator<fst::StdMutableFst> aiter(*fst_, s);
+    size_t low = 0, high = fst_->NumArcs(s);
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      aiter.Seek(mid);
+      if (aiter.Value().ilabel < label) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    if (low < fst_->NumArcs(s)) {
+      aiter.Seek(low);
+      if (aiter.Value().ilabel == label) return aiter.Value().nextstate;
+    }
+    NGRAMERROR() << "SortedNGramFstBuilder: missing lower-order n-gram "
+                 << "with label " << label << " at state " << s;
+    return fst::kNoStateId;
+  }
+
+  size_t order_;
+  fst::StdMutableFst *fst_;
+  NGramCountOfCounts<fst::StdArc> *count_of_counts_;
+  fst::StdArc::StateId unigram_;
+  fst::StdArc::StateId start_;
+  std::vector<fst::StdArc::StateId> path_;  // States on the current history.
+  std::vector<fst::StdArc::StateId> parents_;
+  std::vector<int> labels_;                  // Last label of state history.
+  std::vector<fst::Log64Weight> totals_;     // Total count leaving state.
+  std::vector<bool> in_context_;  // State n-grams added to count_of_counts_.
+  std::vector<int> last_ngram_;
+};
+
+// Reads the next n-gram and its count from a sorted run. Returns false at
+// the end of the run or on read failure.
+bool ReadNGramCount(std::istream *strm, std::vector<int> *ngram,
+                    fst::Log64Weight *count) {
+  if (strm->peek() == EOF) return false;
+  fst::ReadType(*strm, ngram);
+  fst::ReadType(*strm, count);
+  return !strm->fail();
+}
+
+bool MergeSortedNGramCounts(
+    const std::vector<std::istream *> &strms, int order,
+    fst::StdMutableFst *fst,
+    NGramCountOfCounts<fst::StdArc> *count_of_counts) {
+  std::vector<std::vector<int>> ngrams(strms.size());
+  std::vector<fst::Log64Weight> counts(strms.size());
+  // Keeps the streams in a heap ordered by their current n-gram.
+  auto compare = [&ngrams](size_t i, size_t j) { return ngrams[j] < ngrams[i]; };
+  std::vector<size_t> heap;
+  for (size_t i = 0; i < strms.size(); ++i) {
+    if (ReadNGramCount(strms[i], &ngrams[i], &counts[i])) heap.push_back(i);
+  }
+  std::make_heap(heap.begin(), heap.end(), compare);
+  SortedNGramFstBuilder builder(order, fst, count_of_counts);
+  std::vector<int> ngram;
+  while (!heap.empty()) {
+    ngram = ngrams[heap.front()];
+    fst::Log64Weight count = fst::Log64Weight::Zero();
+    while (!heap.empty() && ngrams[heap.front()] == ngram) {
+      std::pop_heap(heap.begin(), heap.end(), compare);
+      size_t i = heap.back();
+      count = Plus(count, counts[i]);
+      if (ReadNGramCount(strms[i], &ngrams[i], &counts[i])) {
+        std::push_heap(heap.begin(), heap.end(), compare);
+      } else {
+        heap.pop_back();
+      }
+    }
+    if (!builder.AddNGram(ngram, count)) return false;
+  }
+  for (size_t i = 0; i < strms.size(); ++i) {
+    if (strms[i]->fail()) {
+      NGRAMERROR() << "MergeSortedNGramCounts: read failed on stream #" << i;
+      return false;
+    }
+  }
+  return builder.Finish();
+}
+
+constexpr size_t NGramSuffixArrayCounter::kMaxOrder;
+
+NGramSuffixArrayCounter::NGramSuffixArrayCounter(
+    size_t order, bool epsilon_as_backoff, float /*delta*/,
+    bool defer_backoff_counts, const std::vector<double> &min_counts,
+    size_t /*sketch_memory*/)
+    : order_(order),
+      unit_counts_(true),
+      defer_backoff_counts_(defer_backoff_counts),
+      error_(false) {
+  if (order == 0 || order > kMaxOrder) {
+    NGRAMERROR() << "NGramSuffixArrayCounter: order must be between 1 and "
+                 << kMaxOrder;
+    SetError();
+  }
+  if (epsilon_as_backoff) {
+    NGRAMERROR() << "NGramSuffixArrayCounter: epsilons as backoff "
+                 << "transitions are not supported";
+    SetError();
+  }
+  if (!min_counts.empty()) {
+    NGRAMERROR() << "NGramSuffixArrayCounter: minimum counts are not "
+                 << "supported";
+    SetError();
+  }
+}
+
+bool NGramSuffixArrayCounter::CountLabels(const int32 *labels, size_t size,
+                                          double count) {
+  if (Error()) return false;
+  if (tokens_.size() + size + 2 >= std::numeric_limits<uint32>::max()) {
+    NGRAMERROR() << "NGramSuffixArrayCounter: too many tokens";
+    SetError();
+    return false;
+  }
+  size_t begin = tokens_.size();
+  AddSegment(count);
+  if (order_ > 1) tokens_.push_back(0);
+  for (size_t i = 0; i < size; ++i) {
+    if (labels[i]) tokens_.push_back(labels[i]);
+  }
+  tokens_.push_back(0);
+  for (size_t pos = begin; pos < tokens_.size(); ++pos)
+    spans_.push_back(std::min(order_, tokens_.size() - pos));
+  return true;
+}
+
+bool NGramSuffixArrayCounter::MergeCounts(
+    const NGramSuffixArrayCounter &counter) {
+  if (Error() || counter.Error()) return false;
+  if (counter.Order() != order_ ||
+      tokens_.size() + counter.tokens_.size() >=
+          std::numeric_limits<uint32>::max()) {
+    NGRAMERROR() << "NGramSuffixArrayCounter: cannot merge counts";
+    SetError();
+    return false;
+  }
+  uint32 offset = tokens_.size();
+  tokens_.insert(tokens_.end(), counter.tokens_.begin(),
+                 counter.tokens_.end());
+  spans_.insert(spans_.end(), counter.spans_.begin(), counter.spans_.end());
+  for (size_t i = 0; i < counter.segment_starts_.size(); ++i) {
+    segment_starts_.push_back(offset + counter.segment_starts_[i]);
+    segment_counts_.push_back(counter.segment_counts_[i]);
+  }
+  unit_counts_ = unit_counts_ && counter.unit_counts_;
+  return true;
+}
+
+void NGramSuffixArrayCounter::AddCountToSymbolUnigrams(
+    const fst::SymbolTable &syms, double neg_log_count) {
+  if (Error()) return;
+  // Each symbol is a segment of its own, too short for longer n-grams; a
+  // label 0 then counts as </s>.
+  for (const auto &sitem : syms) {
+    AddSegment(std::exp(-neg_log_count));
+    tokens_.push_back(sitem.Label());
+    spans_.push_back(1);
+  }
+}
+
+bool NGramSuffixArrayCounter::Write(std::ostream &strm) const {
+  if (Error()) return false;
+  fst::WriteType(strm, kNGramSuffixArrayCounterMagic);
+  fst::WriteType(strm, static_cast<int64>(order_));
+  fst::WriteType(strm, unit_counts_);
+  fst::WriteType(strm, tokens_);
+  fst::WriteType(strm, spans_);
+  fst::WriteType(strm, segment_starts_);
+  fst::WriteType(strm, segment_counts_);
+  if (!strm) {
+    NGRAMERROR() << "NGramSuffixArrayCounter::Write: write failed";
+    return false;
+  }
+  return true;
+}
+
+bool NGramSuffixArrayCounter::Read(std::istream &strm) {
+  if (Error()) return false;
+  int32 magic = 0;
+  int64 order = 0;
+  fst::ReadType(strm, &magic);
+  fst::ReadType(strm, &order);
+  if (!strm || magic != kNGramSuffixArrayCounterMagic ||
+      order != static_cast<int64>(order_)) {
+    NGRAMERROR() << "NGramSuffixArrayCounter::Read: not a suffix array "
+                 << "counter snapshot of order " << order_;
+    SetError();
+    return false;
+  }
+  fst::ReadType(strm, &unit_counts_);
+  fst::ReadType(strm, &tokens_);
+  fst::ReadType(strm, &spans_);
+  fst::ReadType(strm, &segment_starts_);
+  fst::ReadType(strm, &segment_counts_);
+  if (!strm || spans_.size() != tokens_.size() ||
+      segment_counts_.size() != segment_starts_.size()) {
+    NGRAMERROR() << "NGramSuffixArrayCounter::Read: read failed";
+    SetError();
+    return false;
+  }
+  return true;
+}
+
+size_t NGramSuffixArrayCounter::MemoryUsage() const {
+  return tokens_.capacity() * sizeof(int32) +
+         spans_.capacity() * sizeof(uint8) +
+         segment_starts_.capacity() * sizeof(uint32) +
+         segment_counts_.capacity() * sizeof(double);
+}
+
+void NGramSuffixArrayCounter::Clear() {
+  std::vector<int32>().swap(tokens_);
+  std::vector<uint8>().swap(spans_);
+  std::vector<uint32>().swap(segment_starts_);
+  std::vector<double>().swap(segment_counts_);
+  unit_counts_ = true;
+}
+
+void NGramSuffixArrayCounter::AddSegment(double count) {
+  segment_starts_.push_back(tokens_.size());
+  segment_counts_.push_back(count);
+  if (count != 1.0) unit_counts_ = false;
+}
+
+double NGramSuffixArrayCounter::PositionCount(uint32 pos) const {
+  if (unit_counts_) return 1.0;
+  auto segment = std::upper_bound(segment_starts_.begin(),
+                                  segment_starts_.end(), pos);
+  return segment_counts_[segment - segment_starts_.begin() - 1];
+}
+
+size_t NGramSuffixArrayCounter::CommonPrefix(uint32 pos1, uint32 pos2) const {
+  size_t length = std::min(spans_[pos1], spans_[pos2]);
+  size_t k = 0;
+  while (k < length && tokens_[pos1 + k] == tokens_[pos2 + k]) ++k;
+  return k;
+}
+
+// Sorts by prefix doubling: after the round for 'h', positions are ranked
+// by their first 2h tokens, pairing the rank of each position with that of
+// the position h tokens further. Tokens past the span of a position compare
+// lower than any label, so that an n-gram sorts before its extensions.
+// Since n-grams are at most 'order_' long, only log2(order_) rounds are
+// needed.
+void NGramSuffixArrayCounter::BuildSuffixArray(
+    std::vector<uint32> *suffixes) const {
+  size_t size = tokens_.size();
+  suffixes->resize(size);
+  std::iota(suffixes->begin(), suffixes->end(), 0);
+  std::sort(suffixes->begin(), suffixes->end(), [this](uint32 p1, uint32 p2) {
+    return tokens_[p1] < tokens_[p2];
+  });
+  std::vector<uint32> ranks(size), next_ranks(size);
+  for (size_t i = 1; i < size; ++i) {
+    ranks[(*suffixes)[i]] =
+        ranks[(*suffixes)[i - 1]] +
+        (tokens_[(*suffixes)[i]] != tokens_[(*suffixes)[i - 1]]);
+  }
+  for (size_t h = 1; h < order_ && size > 0 &&
+                     ranks[(*suffixes)[size - 1]] + 1 < size;
+       h *= 2) {
+    auto key = [this, h, &ranks](uint32 pos) {
+      uint64 next = h < spans_[pos] ? ranks[pos + h] + 1 : 0;
+      return (static_cast<uint64>(ranks[pos]) << 32) | next;
+    };
+    std::sort(suffixes->begin(), suffixes->end(),
+              [&key](uint32 p1, uint32 p2) { return key(p1) < key(p2); });
+    next_ranks[(*suffixes)[0]] = 0;
+    for (size_t i = 1; i < size; ++i) {
+      next_ranks[(*suffixes)[i]] =
+          next_ranks[(*suffixes)[i - 1]] +
+          (key((*suffixes)[i]) != key((*suffixes)[i - 1]));
+    }
+    ranks.swap(next_ranks);
+  }
+}
+
+// The positions where an n-gram starts are consecutive in the suffix array
+// and it is first found at the position sharing fewer tokens with the
+// previous one than its length. Its count is only known at the end of that
+// range, while it must be visited before its extensions, so the counts are
+// summed in a backward scan and the n-grams visited in a forward scan.
+template <class Visitor>
+bool NGramSuffixArrayCounter::VisitNGrams(Visitor visit) {
+  if (Error()) return false;
+  std::vector<uint32> suffixes;
+  BuildSuffixArray(&suffixes);
+  std::vector<double> sums(order_ + 1, 0.0);
+  std::vector<double> counts;  // In reverse visiting order.
+  for (size_t i = suffixes.size(); i-- > 0;) {
+    uint32 pos = suffixes[i];
+    double count = PositionCount(pos);
+    size_t min_length = MinLength(pos);
+    for (size_t k = min_length; k <= spans_[pos]; ++k) sums[k] += count;
+    size_t shared = i > 0 ? CommonPrefix(suffixes[i - 1], pos) : 0;
+    for (size_t k = spans_[pos]; k > shared && k >= min_length; --k) {
+      counts.push_back(sums[k]);
+      sums[k] = 0.0;
+    }
+  }
+  std::vector<int> ngram;
+  for (size_t i = 0; i < suffixes.size(); ++i) {
+    uint32 pos = suffixes[i];
+    size_t shared = i > 0 ? CommonPrefix(suffixes[i - 1], pos) : 0;
+    for (size_t k = std::max(shared + 1, MinLength(pos)); k <= spans_[pos];
+         ++k) {
+      ngram.assign(tokens_.begin() + pos, tokens_.begin() + pos + k);
+      if (!visit(ngram, fst::Log64Weight(0.0 - std::log(counts.back()))))
+        return false;
+      counts.pop_back();
+    }
+  }
+  return true;
+}
+
+void NGramSuffixArrayCounter::GetFst(
+    fst::StdMutableFst *fst,
+    NGramCountOfCounts<fst::StdArc> *count_of_counts) {
+  SortedNGramFstBuilder builder(order_, fst, count_of_counts);
+  auto add = [&builder](const std::vector<int> &ngram,
+                        fst::Log64Weight count) {
+    return builder.AddNGram(ngram, count);
+  };
+  if (!VisitNGrams(add) || !builder.Finish()) {
+    SetError();
+    fst->DeleteStates();
+  }
+}
+
+bool NGramSuffixArrayCounter::WriteSortedNGrams(std::ostream &strm) {
+  auto write = [&strm](const std::vector<int> &ngram,
+                       fst::Log64Weight count) {
+    fst::WriteType(strm, ngram);
+    fst::WriteType(strm, count);
+    return true;
+  };
+  if (!VisitNGrams(write)) return false;
+  if (!strm) {
+    NGRAMERROR() << "NGramSuffixArrayCounter::WriteSortedNGrams: write failed";
+    return false;
+  }
+  return true;
+}
+
+// Returns true if the minimum counts of 'options', if any, are to be
+// applied by count pruning the counts once merged, rather than by a single
+// counter that sees all of the input: the sketch of its pending counts is
+// neither merged across threads, nor kept across spills, nor saved in
+// snapshots. The counts are then computed without minimum counts.
+bool MinCountsAfterMerge(const NGramCountOptions &options, int threads) {
+  return !options.min_counts.empty() &&
+         (threads > 1 || options.max_memory > 0 ||
+          !options.resume_from.empty() || !options.save_snapshot.empty());
+}
+
+// Count prunes the n-grams of order > 1 of the count fst below their
+// minimum count, as a counter with these minimum counts would not have
+// counted them, and fills count_of_counts, if not null, from the result.
+bool PruneToMinCounts(const std::vector<double> &min_counts,
+                      StdMutableFst *fst,
+                      NGramCountOfCounts<fst::StdArc> *count_of_counts) {
+  std::ostringstream count_pattern;
+  count_pattern.precision(std::numeric_limits<double>::max_digits10);
+  for (size_t o = 1; o <= min_counts.size(); ++o) {
+    if (o > 1) count_pattern << ';';
+    count_pattern << o << (o == min_counts.size() ? "+:" : ":")
+                  << min_counts[o - 1];
+  }
+  NGramCountPrune ngramsh(fst, count_pattern.str());
+  ngramsh.ShrinkNGramModel();
+  if (ngramsh.Error()) return false;
+  if (count_of_counts) {
+    NGramModel<fst::StdArc> model(*fst);
+    if (model.Error()) return false;
+    count_of_counts->CalculateCounts(model);
+  }
+  return true;
+}
+
+// Restores the counts of ngram_counter from the snapshot file 'filename',
+// if not empty, and returns the symbol table saved with them in 'syms'.
+template <class Counter>
+bool ResumeCounts(const std::string &filename, Counter *ngram_counter,
+                  std::unique_ptr<fst::SymbolTable> *syms) {
+  if (filename.empty()) return true;
+  std::ifstream strm(filename, std::ios_base::in | std::ios_base::binary);
+  if (!strm) {
+    NGRAMERROR() << "ResumeCounts: unable to open snapshot: " << filename;
+    return false;
+  }
+  if (!ngram_counter->Read(strm)) return false;
+  syms->reset(fst::SymbolTable::Read(strm, filename));
+  if (!*syms) {
+    NGRAMERROR() << "ResumeCounts: no symbol table in snapshot: " << filename;
+    return false;
+  }
+  return true;
+}
+
+// Adds the symbols of the snapshot symbol table 'snapshot_syms', if not
+// null, to 'syms', the symbol table of the input counted after resuming.
+// Returns false if the two tables disagree on a label or on a symbol they
+// share, the counts of the snapshot then having different words than those
+// of the input.
+bool MergeSnapshotSymbols(const fst::SymbolTable *snapshot_syms,
+                          fst::SymbolTable *syms) {
+  if (!snapshot_syms) return true;
+  for (const auto &sitem : *snapshot_syms) {
+    const std::string symbol = syms->Find(sitem.Label());
+    if (symbol.empty() && syms->Find(sitem.Symbol()) == fst::kNoSymbol) {
+      syms->AddSymbol(sitem.Symbol(), sitem.Label());
+    } else if (symbol != sitem.Symbol()) {
+      NGRAMERROR() << "ResumeCounts: symbol table of snapshot incompatible "
+                   << "with that of the input at symbol " << sitem.Symbol()
+                   << ", label " << sitem.Label();
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes the counts of ngram_counter and their symbol table 'syms' to the
+// snapshot file 'filename', if not empty. Counts spilled to disk cannot be
+// included. The snapshot is saved before AddSymbolUnigramCounts(), so that
+// resuming from it does not add those counts twice.
+template <class Counter>
+bool SaveCounts(const std::string &filename, const Counter &ngram_counter,
+                const fst::SymbolTable &syms,
+                const std::vector<std::unique_ptr<std::fstream>> &runs) {
+  if (filename.empty()) return true;
+  if (!runs.empty()) {
+    NGRAMERROR() << "SaveCounts: counts spilled to disk cannot be saved";
+    return false;
+  }
+  std::ofstream strm(filename, std::ios_base::out | std::ios_base::binary);
+  if (!strm) {
+    NGRAMERROR() << "SaveCounts: unable to open snapshot: " << filename;
+    return false;
+  }
+  return ngram_counter.Write(strm) && syms.Write(strm);
+}
+
+// Adds 'add_to_symbol_unigram_count', if positive, to the unigram count of
+// each symbol of 'syms'.
+template <class Counter>
+void AddSymbolUnigramCounts(const fst::SymbolTable &syms,
+                            double add_to_symbol_unigram_count,
+                            Counter *ngram_counter) {
+  if (add_to_symbol_unigram_count > 0.0) {
+    ngram_counter->AddCountToSymbolUnigrams(
+        syms, /*neg_log_count=*/-log(add_to_symbol_unigram_count));
+  }
+}
+
+// Derives n-gram counts (and symbols) from input FAR reader. If vocab_map
+// is not null, the input labels are mapped to its vocabulary, which is
+// returned as the symbols.
+template <class Counter>
 bool GetNGramsAndSyms(fst::FarReader<fst::StdArc> *far_reader,
-                      NGramCounter<fst::Log64Weight> *ngram_counter,
+                      Counter *ngram_counter,
                       fst::SymbolTable *syms, bool require_symbols,
-                      double add_to_symbol_unigram_count) {
-  int fstnumber = 1;
-  while (!far_reader->Done()) {
-    if (!GetCounts("ngramcount", ngram_counter, far_reader, fstnumber, syms))
+                      int threads, size_t max_memory = 0,
+                      std::vector<std::unique_ptr<std::fstream>> *runs =
+                          nullptr,
+                      VocabularyMap *vocab_map = nullptr) {
+  if (threads > 1) {
+    if (!GetNGramsInParallel(far_reader, ngram_counter, syms, threads,
+                             max_memory, runs, vocab_map)) {
       return false;
-    far_reader->Next();
-    ++fstnumber;
+    }
+  } else {
+    int fstnumber = 1;
+    while (!far_reader->Done()) {
+      if (!GetCounts("ngramcount", ngram_counter, far_reader, fstnumber, syms,
+                     vocab_map)) {
+        return false;
+      }
+      if (!MaybeSpillCounts(ngram_counter, max_memory, runs)) return false;
+      far_reader->Next();
+      ++fstnumber;
+    }
   }
+  if (vocab_map) *syms = vocab_map->Vocabulary();
   if (require_symbols && syms->NumSymbols() == 0) {
     LOG(ERROR) << "None of the input FSTs had a symbol table";
     return false;
   }
-  if (add_to_symbol_unigram_count > 0.0 && require_symbols) {
-    ngram_counter->AddCountToSymbolUnigrams(
-        *syms, /*neg_log_count=*/-log(add_to_symbol_unigram_count));
-  }
   return true;
 }
 
-// Computes ngram counts and returns ngram format FST.
-bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
-                    StdMutableFst *fst, int order, bool require_symbols,
-                    bool epsilon_as_backoff, bool round_to_int,
-                    double add_to_symbol_unigram_count) {
-  NGramCounter<fst::Log64Weight> ngram_counter(order, epsilon_as_backoff);
-  fst::SymbolTable syms;
-  if (!GetNGramsAndSyms(far_reader, &ngram_counter, &syms, require_symbols,
-                        add_to_symbol_unigram_count)) {
-    return false;
+// Returns ngram format FST from the counts of ngram_counter and of the runs
+// spilled from it, if any, filling the histograms of count_of_counts if not
+// null.
+template <class Counter>
+bool GetCountFst(Counter *ngram_counter,
+                 const fst::SymbolTable &syms,
+                 std::vector<std::unique_ptr<std::fstream>> *runs,
+                 bool round_to_int, StdMutableFst *fst,
+                 NGramCountOfCounts<fst::StdArc> *count_of_counts) {
+  if (runs->empty()) {
+    ngram_counter->GetFst(fst, count_of_counts);
+    if (ngram_counter->Error()) return false;
+  } else {
+    // Merges the spilled runs, together with the remaining counts.
+    if (!SpillCounts(ngram_counter, runs)) return false;
+    std::vector<std::istream *> strms;
+    for (const auto &run : *runs) {
+      run->seekg(0);
+      strms.push_back(run.get());
+    }
+    if (!MergeSortedNGramCounts(strms, ngram_counter->Order(), fst,
+                                count_of_counts)) {
+      return false;
+    }
   }
-  ngram_counter.GetFst(fst);
   fst::ArcSort(fst, fst::StdILabelCompare());
   if (syms.NumSymbols() > 0) {
     fst->SetInputSymbols(&syms);
@@ -188,27 +1247,360 @@ bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
   return true;
 }
 
+// Returns strings of the counts of ngram_counter.
+template <class Counter>
+void GetCountStrings(Counter *ngram_counter,
+                     const fst::SymbolTable &syms,
+                     std::vector<std::string> *ngrams) {
+  std::vector<std::pair<std::vector<int>, std::pair<int, double>>> ngram_counts;
+  ngram_counter->template GetReverseContextNGrams<fst::StdArc>(&ngram_counts);
+  for (size_t i = 0; i < ngram_counts.size(); ++i) {
+    std::string ngram;
+    double count = GetNGramAndCount(ngram_counts[i], &ngram, syms);
+    ngrams->push_back(ngram + '\t' + std::to_string(count));
+  }
+}
+
+// Writes the counts of ngram_counter to strm, one per line as returned by
+// GetCountStrings(). Lines are formatted into a reused buffer as the counts
+// are visited, so that neither the lines nor the n-gram histories are held
+// in memory.
+template <class Counter>
+bool WriteCountStrings(Counter *ngram_counter, const fst::SymbolTable &syms,
+                       std::ostream *strm) {
+  // Symbols are looked up once per label, as SymbolTable::Find() returns a
+  // new string.
+  std::unordered_map<int, std::string> words;
+  auto word = [&words, &syms](int label) -> const std::string & {
+    auto it = words.find(label);
+    if (it == words.end()) it = words.emplace(label, syms.Find(label)).first;
+    return it->second;
+  };
+  std::string buffer;
+  buffer.reserve(kCountStringsBufferSize);
+  char count_buffer[64];
+  ngram_counter->VisitReverseContextNGrams(
+      [&](const std::vector<int> &reverse_context, int label, double count) {
+        for (int context_label : reverse_context) {
+          buffer += context_label > 0 ? word(context_label) : "<s>";
+          buffer += ' ';
+        }
+        buffer += label > 0 ? word(label) : "</s>";
+        buffer += '\t';
+        // Same format as std::to_string(count).
+        buffer.append(count_buffer, snprintf(count_buffer,
+                                             sizeof(count_buffer), "%f",
+                                             count));
+        buffer += '\n';
+        if (buffer.size() >= kCountStringsBufferSize) {
+          strm->write(buffer.data(), buffer.size());
+          buffer.clear();
+        }
+      });
+  strm->write(buffer.data(), buffer.size());
+  if (!*strm) {
+    NGRAMERROR() << "WriteCountStrings: write failed";
+    return false;
+  }
+  return true;
+}
+
+// Counts n-grams from a FAR, with a counter of the type given to Run(), and
+// returns ngram format FST.
+struct FarCountFst {
+  fst::FarReader<fst::StdArc> *far_reader;
+  StdMutableFst *fst;
+  int order;
+  const NGramCountOptions *options;
+
+  template <class Counter>
+  bool Run() const {
+    const bool prune = MinCountsAfterMerge(*options, options->threads);
+    Counter ngram_counter(order, options->epsilon_as_backoff, kCountDelta,
+                          options->defer_backoff_counts,
+                          prune ? std::vector<double>() : options->min_counts,
+                          options->sketch_memory);
+    VocabularyMap vocab_map;
+    if (options->vocab &&
+        !vocab_map.Init(*options->vocab, options->oov_symbol)) {
+      return false;
+    }
+    fst::SymbolTable syms;
+    std::unique_ptr<fst::SymbolTable> snapshot_syms;
+    std::vector<std::unique_ptr<std::fstream>> runs;
+    if (!ResumeCounts(options->resume_from, &ngram_counter, &snapshot_syms) ||
+        !GetNGramsAndSyms(far_reader, &ngram_counter, &syms,
+                          options->require_symbols, options->threads,
+                          options->max_memory, &runs,
+                          options->vocab ? &vocab_map : nullptr) ||
+        !MergeSnapshotSymbols(snapshot_syms.get(), &syms) ||
+        !SaveCounts(options->save_snapshot, ngram_counter, syms, runs)) {
+      return false;
+    }
+    if (options->require_symbols) {
+      AddSymbolUnigramCounts(syms, options->add_to_symbol_unigram_count,
+                             &ngram_counter);
+    }
+    if (!GetCountFst(&ngram_counter, syms, &runs, options->round_to_int,
+                     fst, prune ? nullptr : options->count_of_counts)) {
+      return false;
+    }
+    return !prune ||
+           PruneToMinCounts(options->min_counts, fst, options->count_of_counts);
+  }
+};
+
+// Counts n-grams from a FAR, with a counter of the type given to Run(), and
+// returns vector of strings, or writes them to 'out' if 'ngrams' is null.
+struct FarCountStrings {
+  fst::FarReader<fst::StdArc> *far_reader;
+  std::vector<std::string> *ngrams;
+  std::ostream *out;
+  int order;
+  const NGramCountOptions *options;
+
+  template <class Counter>
+  bool Run() const {
+    Counter ngram_counter(order, options->epsilon_as_backoff, kCountDelta,
+                          options->defer_backoff_counts);
+    VocabularyMap vocab_map;
+    if (options->vocab &&
+        !vocab_map.Init(*options->vocab, options->oov_symbol)) {
+      return false;
+    }
+    fst::SymbolTable syms;
+    if (!GetNGramsAndSyms(far_reader, &ngram_counter, &syms,
+                          /* require_symbols = */ true, options->threads,
+                          /* max_memory = */ 0, /* runs = */ nullptr,
+                          options->vocab ? &vocab_map : nullptr)) {
+      // Requires symbols from input far to output as vector of strings.
+      return false;
+    }
+    AddSymbolUnigramCounts(syms, options->add_to_symbol_unigram_count,
+                           &ngram_counter);
+    if (!ngrams) return WriteCountStrings(&ngram_counter, syms, out);
+    GetCountStrings(&ngram_counter, syms, ngrams);
+    return true;
+  }
+};
+
+// Runs 'counting' with the counter type selected by the 'compact' and
+// 'real_counts' options.
+template <class Counting>
+bool RunCounting(const Counting &counting, const NGramCountOptions &options) {
+  if (options.real_counts) {
+    return options.compact
+               ? counting.template Run<NGramCompactCounter<RealCountWeight>>()
+               : counting.template Run<NGramCounter<RealCountWeight>>();
+  }
+  return options.compact
+             ? counting.template Run<NGramCompactCounter<fst::Log64Weight>>()
+             : counting.template Run<NGramCounter<fst::Log64Weight>>();
+}
+
+// Computes ngram counts and returns ngram format FST.
+bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
+                    StdMutableFst *fst, int order,
+                    const NGramCountOptions &options) {
+  FarCountFst counting = {far_reader, fst, order, &options};
+  if (options.suffix_array) return counting.Run<NGramSuffixArrayCounter>();
+  return RunCounting(counting, options);
+}
+
+bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
+                    StdMutableFst *fst, int order, bool require_symbols,
+                    bool epsilon_as_backoff, bool round_to_int,
+                    double add_to_symbol_unigram_count) {
+  NGramCountOptions options;
+  options.require_symbols = require_symbols;
+  options.epsilon_as_backoff = epsilon_as_backoff;
+  options.round_to_int = round_to_int;
+  options.add_to_symbol_unigram_count = add_to_symbol_unigram_count;
+  return GetNGramCounts(far_reader, fst, order, options);
+}
+
 // Computes ngram counts and returns vector of strings.
+bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
+                    std::vector<std::string> *ngrams, int order,
+                    const NGramCountOptions &options) {
+  FarCountStrings counting = {far_reader, ngrams, nullptr, order, &options};
+  return RunCounting(counting, options);
+}
+
 bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
                     std::vector<std::string> *ngrams, int order,
                     bool epsilon_as_backoff,
                     double add_to_symbol_unigram_count) {
-  NGramCounter<fst::Log64Weight> ngram_counter(order, epsilon_as_backoff);
-  fst::SymbolTable syms;
-  if (!GetNGramsAndSyms(far_reader, &ngram_counter, &syms,
-                        /* require_symbols = */ true,
-                        add_to_symbol_unigram_count)) {
-    // Requires symbols from input far to output as vector of strings.
-    return false;
+  NGramCountOptions options;
+  options.epsilon_as_backoff = epsilon_as_backoff;
+  options.add_to_symbol_unigram_count = add_to_symbol_unigram_count;
+  return GetNGramCounts(far_reader, ngrams, order, options);
+}
+
+// Computes ngram counts and writes them to a stream as strings.
+bool GetNGramCounts(fst::FarReader<fst::StdArc> *far_reader,
+                    std::ostream *strm, int order,
+                    const NGramCountOptions &options) {
+  FarCountStrings counting = {far_reader, nullptr, strm, order, &options};
+  return RunCounting(counting, options);
+}
+
+inline bool IsSpace(char c) {
+  return std::isspace(static_cast<unsigned char>(c));
+}
+
+// Derives n-gram counts from the sentences in strm, one per line.
+template <class Counter>
+bool GetTextCounts(std::istream &strm, const fst::SymbolTable &syms,
+                   const std::string &oov_symbol,
+                   Counter *ngram_counter, size_t max_memory = 0,
+                   std::vector<std::unique_ptr<std::fstream>> *runs =
+                       nullptr) {
+  int64 oov_label = fst::kNoSymbol;
+  if (!oov_symbol.empty()) {
+    oov_label = syms.Find(oov_symbol);
+    if (oov_label == fst::kNoSymbol) {
+      LOG(ERROR) << "ngramcount: OOV symbol not in symbol table: "
+                 << oov_symbol;
+      return false;
+    }
   }
-  std::vector<std::pair<std::vector<int>, std::pair<int, double>>> ngram_counts;
-  ngram_counter.GetReverseContextNGrams<fst::StdArc>(&ngram_counts);
-  for (size_t i = 0; i < ngram_counts.size(); ++i) {
-    std::string ngram;
-    double count = GetNGramAndCount(ngram_counts[i], &ngram, syms);
-    ngrams->push_back(ngram + '\t' + std::to_string(count));
+  std::string line;
+  std::string word;
+  std::vector<int> labels;
+  size_t linenumber = 0;
+  while (std::getline(strm, line)) {
+    ++linenumber;
+    labels.clear();
+    bool skipped = false;
+    size_t i = 0;
+    while (i < line.size()) {
+      while (i < line.size() && IsSpace(line[i])) ++i;
+      size_t begin = i;
+      while (i < line.size() && !IsSpace(line[i])) ++i;
+      if (i == begin) break;
+      word.assign(line, begin, i - begin);
+      int64 label = syms.Find(word);
+      if (label == fst::kNoSymbol) {
+        if (oov_label == fst::kNoSymbol) {
+          LOG(ERROR) << "ngramcount: line " << linenumber
+                     << " skipped: word not in symbol table: " << word;
+          skipped = true;
+          break;
+        }
+        label = oov_label;
+      }
+      labels.push_back(label);
+    }
+    if (skipped) continue;
+    if (!ngram_counter->CountLabels(labels.data(), labels.size()))
+      return false;
+    if (!MaybeSpillCounts(ngram_counter, max_memory, runs)) return false;
+  }
+  if (strm.bad()) {
+    LOG(ERROR) << "ngramcount: read failed at line " << linenumber + 1;
+    return false;
   }
   return true;
 }
 
+// Counts n-grams from text, with a counter of the type given to Run(), and
+// returns ngram format FST.
+struct TextCountFst {
+  std::istream *strm;
+  const fst::SymbolTable *syms;
+  StdMutableFst *fst;
+  int order;
+  const NGramCountOptions *options;
+
+  template <class Counter>
+  bool Run() const {
+    const bool prune = MinCountsAfterMerge(*options, 1);
+    Counter ngram_counter(order, options->epsilon_as_backoff, kCountDelta,
+                          options->defer_backoff_counts,
+                          prune ? std::vector<double>() : options->min_counts,
+                          options->sketch_memory);
+    fst::SymbolTable merged_syms(*syms);
+    std::unique_ptr<fst::SymbolTable> snapshot_syms;
+    std::vector<std::unique_ptr<std::fstream>> runs;
+    if (!ResumeCounts(options->resume_from, &ngram_counter, &snapshot_syms) ||
+        !MergeSnapshotSymbols(snapshot_syms.get(), &merged_syms) ||
+        !GetTextCounts(*strm, *syms, options->oov_symbol, &ngram_counter,
+                       options->max_memory, &runs) ||
+        !SaveCounts(options->save_snapshot, ngram_counter, merged_syms,
+                    runs)) {
+      return false;
+    }
+    AddSymbolUnigramCounts(merged_syms, options->add_to_symbol_unigram_count,
+                           &ngram_counter);
+    if (!GetCountFst(&ngram_counter, merged_syms, &runs,
+                     options->round_to_int, fst,
+                     prune ? nullptr : options->count_of_counts)) {
+      return false;
+    }
+    return !prune ||
+           PruneToMinCounts(options->min_counts, fst, options->count_of_counts);
+  }
+};
+
+// Counts n-grams from text, with a counter of the type given to Run(), and
+// returns vector of strings, or writes them to 'out' if 'ngrams' is null.
+struct TextCountStrings {
+  std::istream *strm;
+  const fst::SymbolTable *syms;
+  std::vector<std::string> *ngrams;
+  std::ostream *out;
+  int order;
+  const NGramCountOptions *options;
+
+  template <class Counter>
+  bool Run() const {
+    Counter ngram_counter(order, options->epsilon_as_backoff, kCountDelta,
+                          options->defer_backoff_counts);
+    if (!GetTextCounts(*strm, *syms, options->oov_symbol, &ngram_counter)) {
+      return false;
+    }
+    AddSymbolUnigramCounts(*syms, options->add_to_symbol_unigram_count,
+                           &ngram_counter);
+    if (!ngrams) return WriteCountStrings(&ngram_counter, *syms, out);
+    GetCountStrings(&ngram_counter, *syms, ngrams);
+    return true;
+  }
+};
+
+// Computes ngram counts from text and returns ngram format FST.
+bool GetNGramCountsFromText(std::istream &strm, const fst::SymbolTable &syms,
+                            StdMutableFst *fst, int order,
+                            const NGramCountOptions &options) {
+  TextCountFst counting = {&strm, &syms, fst, order, &options};
+  if (options.suffix_array) return counting.Run<NGramSuffixArrayCounter>();
+  return RunCounting(counting, options);
+}
+
+// Computes ngram counts from text and returns vector of strings.
+bool GetNGramCountsFromText(std::istream &strm, const fst::SymbolTable &syms,
+                            std::vector<std::string> *ngrams, int order,
+                            const NGramCountOptions &options) {
+  TextCountStrings counting = {&strm,
+                               &syms,
+                               ngrams,
+                               nullptr,
+                               order,
+                               &options};
+  return RunCounting(counting, options);
+}
+
+// Computes ngram counts from text and writes them to a stream as strings.
+bool GetNGramCountsFromText(std::istream &strm, const fst::SymbolTable &syms,
+                            std::ostream *ostrm, int order,
+                            const NGramCountOptions &options) {
+  TextCountStrings counting = {&strm,
+                               &syms,
+                               nullptr,
+                               ostrm,
+                               order,
+                               &options};
+  return RunCounting(counting, options);
+}
+
 }  // namespace ngram
@@ -32,6 +32,189 @@ namespace ngram {
 using fst::StdExpandedFst;
 using fst::StdILabelCompare;
 
+namespace {
+
+// Convert to a new log base for printing
+double LogNewBase(double neglogcost, double base) {
+  return -neglogcost / log(base);
+}
+
+// Header for verbose n-gram entries
+void WriteNGramProbHeader(std::ostream &ostrm) {
+  ostrm << "                                                ";
+  ostrm << "ngram  -logprob\n";
+  ostrm << "        N-gram probability                      ";
+  ostrm << "found  (base10)\n";
+}
+
+// Show the verbose n-gram entries with history order and neglogprob
+void WriteNGramProb(std::ostream &ostrm, const std::string &symbol,
+                    const std::string &history, bool oov, int order,
+                    double ngram_cost) {
+  ostrm << "        p( " << symbol;
+  if (history.empty())
+    ostrm << " )  ";
+  else
+    ostrm << " | " << history << ")";
+  for (int i = symbol.size() + history.size(); i < 30; ++i) ostrm << " ";
+  ostrm << "= ";
+  if (oov)  // reporting OOV
+    ostrm << "[OOV]    " << ngram_cost << '\n';
+  else if (order < 0)
+    ostrm << "[NGram]  " << ngram_cost << '\n';
+  else  // order of the state out of which the arc came
+    ostrm << "[" << order << "gram]  " << ngram_cost << '\n';
+}
+
+// Show summary perplexity numbers, similar to summary given by SRILM
+void WritePerplexity(std::ostream &ostrm, size_t sentences, int word_cnt,
+                     int oov_cnt, int words_skipped, double logprob) {
+  ostrm << sentences << " sentences, ";
+  ostrm << word_cnt << " words, ";
+  ostrm << oov_cnt << " OOVs\n";
+  if (words_skipped > 0) {
+    ostrm << "NOTE: " << words_skipped << " OOVs with no probability"
+          << " were skipped in perplexity calculation\n";
+    word_cnt -= words_skipped;
+  }
+  ostrm << "logprob(base 10)= " << logprob;
+  ostrm << ";  perplexity = ";
+  ostrm << pow(10, -logprob / (word_cnt + sentences)) << "\n\n";
+}
+
+}  // namespace
+
+bool NGramFlatOutput::PerplexityNGramModel(
+    const std::vector<std::unique_ptr<fst::StdVectorFst>> &infsts,
+    int32 v) const {
+  bool verbose = v > 0;
+  const fst::SymbolTable *syms = !infsts.empty() && infsts[0]->InputSymbols()
+                                     ? infsts[0]->InputSymbols()
+                                     : model_.InputSymbols();
+  if (!syms) {
+    NGRAMERROR() << "NGramFlatOutput: no symbol tables provided";
+    return false;
+  }
+  double logprob = 0;
+  int word_cnt = 0, oov_cnt = 0, words_skipped = 0;
+  for (const auto &infst : infsts)
+    ApplyNGramToFst(*infst, *syms, verbose, model_.OOVLabel(),
+                    model_.OOVCost(), &logprob, &word_cnt, &oov_cnt,
+                    &words_skipped);
+  WritePerplexity(ostrm_, infsts.size(), word_cnt, oov_cnt, words_skipped,
+                  logprob);
+  return true;
+}
+
+// Apply n-gram model to fst.  Assumes linear fst, accumulates stats
+void NGramFlatOutput::ApplyNGramToFst(const Fst<StdArc> &input_fst,
+                                      const fst::SymbolTable &syms,
+                                      bool verbose, Label OOV_label,
+                                      double OOV_cost, double *logprob,
+                                      int *words, int *oovs,
+                                      int *words_skipped) const {
+  // Symbols not in the model are given a label that is not in it either, so
+  // that they are scored as OOVs after backing off to the unigram state.
+  const fst::SymbolTable *model_syms = model_.InputSymbols();
+  bool relabel = model_syms && model_syms != &syms;
+  Label unknown_label = relabel ? model_syms->AvailableKey() : kNoLabel;
+  if (verbose) {
+    for (StateId st = input_fst.Start(); input_fst.NumArcs(st) != 0;) {
+      ArcIterator<Fst<StdArc>> aiter(input_fst, st);
+      if (st != input_fst.Start()) ostrm_ << " ";
+      ostrm_ << syms.Find(aiter.Value().ilabel);
+      st = aiter.Value().nextstate;
+    }
+    ostrm_ << '\n';
+    WriteNGramProbHeader(ostrm_);
+  }
+  StateId st = input_fst.Start(), mst = model_.Start();
+  int word_cnt = 0, oov_cnt = 0, skipped = 0;
+  double neglogprob = 0;
+  std::string history = FLAGS_start_symbol + " ";
+  std::vector<Label> ngram(model_.HiOrder(), 0);
+  while (input_fst.NumArcs(st) != 0) {  // assumes linear fst (string)
+    ArcIterator<Fst<StdArc>> aiter(input_fst, st);
+    const StdArc &arc = aiter.Value();
+    st = arc.nextstate;
+    std::string symbol = syms.Find(arc.ilabel);
+    Label label = arc.ilabel;
+    if (relabel) {
+      label = model_syms->Find(symbol);
+      if (label < 0) label = unknown_label;
+    }
+    FindNextStateInModel(&mst, label, symbol, OOV_cost, OOV_label,
+                         &neglogprob, &word_cnt, &oov_cnt, &skipped, &history,
+                         verbose, &ngram);
+  }
+  ApplyFinalCost(mst, history, word_cnt, oov_cnt, skipped, neglogprob, logprob,
+                 words, oovs, words_skipped, verbose, ngram);
+}
+
+// Determine whether n-gram state is in context or not
+bool NGramFlatOutput::InContext(const std::vector<Label> &ngram) const {
+  if (context_.NullContext()) return true;
+  return context_.HasContext(ngram, include_all_suffixes_);
+}
+
+void NGramFlatOutput::FindNextStateInModel(
+    StateId *mst, Label label, const std::string &symbol, double OOV_cost,
+    Label OOV_label, double *neglogprob, int *word_cnt, int *oov_cnt,
+    int *skipped, std::string *history, bool verbose,
+    std::vector<Label> *ngram) const {
+  bool in_context = InContext(*ngram);
+  int order;
+  double ngram_cost;
+  ++(*word_cnt);
+  if (!model_.FindNGramInModel(mst, &order, label, &ngram_cost)) {  // OOV
+    ++(*oov_cnt);
+    // Unigram state.
+    ngram_cost += OOV_cost;
+    ngram_cost = LogNewBase(-ngram_cost, 10);
+    if (OOV_cost != StdArc::Weight::Zero().Value()) {
+      if (in_context) *neglogprob += ngram_cost;
+    } else {
+      ++(*skipped);
+    }
+    *mst = (model_.UnigramState() >= 0) ? model_.UnigramState()
+                                        : model_.Start();
+    if (verbose) WriteNGramProb(ostrm_, symbol, *history, true, -1, ngram_cost);
+    *history = "";
+    *ngram = std::vector<Label>(model_.HiOrder(), 0);
+  } else {
+    if (label == OOV_label) ++(*oov_cnt);
+    ngram_cost = LogNewBase(-ngram_cost, 10);
+    if (in_context) *neglogprob += ngram_cost;
+    if (verbose)
+      WriteNGramProb(ostrm_, symbol, *history, false, order, ngram_cost);
+    *history = symbol + " ...";
+    ngram->erase(ngram->begin());
+    ngram->push_back(label);
+  }
+}
+
+//  Calculate and show (if verbose) </s> n-gram, and accumulate stats
+void NGramFlatOutput::ApplyFinalCost(StateId mst, const std::string &history,
+                                     int word_cnt, int oov_cnt, int skipped,
+                                     double neglogprob, double *logprob,
+                                     int *words, int *oovs, int *words_skipped,
+                                     bool verbose,
+                                     const std::vector<Label> &ngram) const {
+  int order;
+  double ngram_cost =
+      LogNewBase(-model_.FinalCostInModel(mst, &order).Value(), 10);
+  if (InContext(ngram)) neglogprob += ngram_cost;
+  if (verbose) {
+    WriteNGramProb(ostrm_, FLAGS_end_symbol, history, (order < 0), order,
+                   ngram_cost);
+    WritePerplexity(ostrm_, 1, word_cnt, oov_cnt, skipped, -neglogprob);
+  }
+  *logprob -= neglogprob;
+  *words += word_cnt;
+  *oovs += oov_cnt;
+  *words_skipped += skipped;
+}
+
 // Determine whether n-gram state is in context or not
 bool NGramOutput::InContext(StateId st) const {
   if (context_.NullContext()) return true;
@@ -88,24 +271,44 @@ bool NGramOutput::PerplexityNGramModel(
   if (Error()) return false;
   bool verbose = v > 0;
   Label OOV_label;
-  if (!GetOOVLabel(&OOV_probability, OOV_symbol, &OOV_label)) return false;
+  double OOV_cost;
+  if (!RenormForOOVs(OOV_symbol, OOV_class_size, OOV_probability, &OOV_label,
+                     &OOV_cost)) {
+    return false;
+  }
   std::unique_ptr<StdMutableFst> symbol_fst(
       !infsts[0]->InputSymbols() ? GetMutableFst()->Copy() : infsts[0]->Copy());
-  double logprob = 0, OOV_cost = StdArc::Weight::Zero().Value();
+  double logprob = 0;
   int word_cnt = 0, oov_cnt = 0, words_skipped = 0;
-  if (OOV_probability > 0) OOV_cost = -log(OOV_probability / OOV_class_size);
-  RenormUnigramForOOV(kSpecialLabel, OOV_label, OOV_class_size,
-                      OOV_probability);
-  if (Error()) return false;
-  if (phimatch) MakePhiMatcherLM(kSpecialLabel);
+  // Without the phi matcher, strings are scored with a flat copy of the
+  // model, built once for all of them.
+  std::unique_ptr<NGramFlatModel<StdArc>> flat_model;
+  if (phimatch) {
+    MakePhiMatcherLM(kSpecialLabel);
+  } else {
+    flat_model.reset(new NGramFlatModel<StdArc>(*this, OOV_label, OOV_cost));
+  }
   for (StateId i = 0; i < infsts.size(); ++i)
     ApplyNGramToFst(*(infsts[i]), *symbol_fst, phimatch, verbose, kSpecialLabel,
                     OOV_label, OOV_cost, &logprob, &word_cnt, &oov_cnt,
-                    &words_skipped);
+                    &words_skipped, flat_model.get());
   ShowPerplexity(infsts.size(), word_cnt, oov_cnt, words_skipped, logprob);
   return true;
 }
 
+NGramFlatModel<StdArc> *NGramOutput::GetFlatModel(std::string *OOV_symbol,
+                                                  double OOV_class_size,
+                                                  double OOV_probability) {
+  if (Error()) return nullptr;
+  Label OOV_label;
+  double OOV_cost;
+  if (!RenormForOOVs(OOV_symbol, OOV_class_size, OOV_probability, &OOV_label,
+                     &OOV_cost)) {
+    return nullptr;
+  }
+  return new NGramFlatModel<StdArc>(*this, OOV_label, OOV_cost);
+}
+
 // Print the header portion of the ARPA model format
 void NGramOutput::ShowARPAHeader() const {
   // initialize and fill output vector
@@ -272,22 +475,31 @@ double NGramOutput::ApplyNGramToFst(const fst::StdVectorFst &input_fst,
                                     bool verbose, Label special_label,
                                     Label OOV_label, double OOV_cost,
                                     double *logprob, int *words, int *oovs,
-                                    int *words_skipped) {
+                                    int *words_skipped,
+                                    const NGramFlatModel<StdArc> *flat_model) {
+  if (!phimatch) {
+    std::unique_ptr<NGramFlatModel<StdArc>> call_model;
+    if (!flat_model) {
+      call_model.reset(new NGramFlatModel<StdArc>(*this, OOV_label, OOV_cost));
+      flat_model = call_model.get();
+    }
+    NGramFlatOutput flat_output(*flat_model, ostrm_, context_,
+                                include_all_suffixes_);
+    flat_output.ApplyNGramToFst(input_fst, *symbolfst.InputSymbols(), verbose,
+                                OOV_label, OOV_cost, logprob, words, oovs,
+                                words_skipped);
+    return *logprob;
+  }
   std::unique_ptr<fst::StdVectorFst> infst(input_fst.Copy());
   RelabelAndSetSymbols(infst.get(), symbolfst);
   if (verbose) {
     ShowStringFst(*infst);
     ShowNGramProbHeader();
   }
-  if (phimatch) {
-    std::unique_ptr<ComposeFst<StdArc>> cfst(
-        FailLMCompose(*infst, special_label));
-    ShowPhiPerplexity(*cfst, verbose, special_label, OOV_label, logprob, words,
-                      oovs, words_skipped);
-  } else {
-    ShowNonPhiPerplexity(*infst, verbose, OOV_cost, OOV_label, logprob, words,
-                         oovs, words_skipped);
-  }
+  std::unique_ptr<ComposeFst<StdArc>> cfst(
+      FailLMCompose(*infst, special_label));
+  ShowPhiPerplexity(*cfst, verbose, special_label, OOV_label, logprob, words,
+                    oovs, words_skipped);
   return *logprob;
 }
 
@@ -334,99 +546,20 @@ void NGramOutput::ShowPhiPerplexity(const ComposeFst<StdArc> &cfst,
   *words_skipped += skipped;
 }
 
-void NGramOutput::ShowNonPhiPerplexity(const Fst<StdArc> &infst, bool verbose,
-                                       double OOV_cost, Label OOV_label,
-                                       double *logprob, int *words, int *oovs,
-                                       int *words_skipped) const {
-  StateId st = infst.Start(), mst = GetFst().Start();
-  int word_cnt = 0, oov_cnt = 0, skipped = 0;
-  double neglogprob = 0;
-  std::string history = FLAGS_start_symbol + " ";
-  std::vector<Label> ngram(HiOrder(), 0);
-  while (infst.NumArcs(st) != 0) {  // assumes linear fst (string)
-    ArcIterator<Fst<StdArc>> aiter(infst, st);
-    StdArc arc = aiter.Value();
-    st = arc.nextstate;
-    FindNextStateInModel(&mst, arc.ilabel, OOV_cost, OOV_label, &neglogprob,
-                         &word_cnt, &oov_cnt, &skipped, &history, verbose,
-                         &ngram);
-  }
-  ApplyFinalCost(mst, history, word_cnt, oov_cnt, skipped, neglogprob, logprob,
-                 words, oovs, words_skipped, verbose, ngram);
-}
-
-void NGramOutput::FindNextStateInModel(StateId *mst, Label label,
-                                       double OOV_cost, Label OOV_label,
-                                       double *neglogprob, int *word_cnt,
-                                       int *oov_cnt, int *skipped,
-                                       std::string *history, bool verbose,
-                                       std::vector<Label> *ngram) const {
-  bool in_context = InContext(*ngram);
-  int order;
-  double ngram_cost;
-  std::string symbol = GetFst().InputSymbols()->Find(label);
-  ++(*word_cnt);
-  if (!FindNGramInModel(mst, &order, label, &ngram_cost)) {  // OOV
-    ++(*oov_cnt);
-    // Unigram state.
-    ngram_cost += OOV_cost;
-    ngram_cost = ShowLogNewBase(-ngram_cost, 10);
-    if (OOV_cost != StdArc::Weight::Zero().Value()) {
-      if (in_context) *neglogprob += ngram_cost;
-    } else {
-      ++(*skipped);
-    }
-    *mst = (UnigramState() >= 0) ? UnigramState() : GetFst().Start();
-    if (verbose) ShowNGramProb(symbol, *history, true, -1, ngram_cost);
-    *history = "";
-    *ngram = std::vector<Label>(HiOrder(), 0);
-  } else {
-    if (label == OOV_label) ++(*oov_cnt);
-    ngram_cost = ShowLogNewBase(-ngram_cost, 10);
-    if (in_context) *neglogprob += ngram_cost;
-    if (verbose) ShowNGramProb(symbol, *history, false, order, ngram_cost);
-    *history = symbol + " ...";
-    ngram->erase(ngram->begin());
-    ngram->push_back(label);
-  }
-}
-
-//  Calculate and show (if verbose) </s> n-gram, and accumulate stats
-void NGramOutput::ApplyFinalCost(StateId mst, std::string history, int word_cnt,
-                                 int oov_cnt, int skipped, double neglogprob,
-                                 double *logprob, int *words, int *oovs,
-                                 int *words_skipped, bool verbose,
-                                 const std::vector<Label> &ngram) const {
-  int order;
-  double ngram_cost =
-      ShowLogNewBase(-ScalarValue(FinalCostInModel(mst, &order)), 10);
-  if (InContext(ngram)) neglogprob += ngram_cost;
-  if (verbose) {
-    ShowNGramProb(FLAGS_end_symbol, history, (order < 0), order, ngram_cost);
-    ShowPerplexity(1, word_cnt, oov_cnt, skipped, -neglogprob);
-  }
-  *logprob -= neglogprob;
-  *words += word_cnt;
-  *oovs += oov_cnt;
-  *words_skipped += skipped;
-}
+// Header for verbose n-gram entries
+void NGramOutput::ShowNGramProbHeader() const { WriteNGramProbHeader(ostrm_); }
 
 // Show the verbose n-gram entries with history order and neglogprob
 void NGramOutput::ShowNGramProb(std::string symbol, std::string history,
                                 bool oov, int order, double ngram_cost) const {
-  ostrm_ << "        p( " << symbol;
-  if (history.empty())
-    ostrm_ << " )  ";
-  else
-    ostrm_ << " | " << history << ")";
-  for (int i = symbol.size() + history.size(); i < 30; ++i) ostrm_ << " ";
-  ostrm_ << "= ";
-  if (oov)  // reporting OOV
-    ostrm_ << "[OOV]    " << ngram_cost << '\n';
-  else if (order < 0)
-    ostrm_ << "[NGram]  " << ngram_cost << '\n';
-  else  // order of the state out of which the arc came
-    ostrm_ << "[" << order << "gram]  " << ngram_cost << '\n';
+  WriteNGramProb(ostrm_, symbol, history, oov, order, ngram_cost);
+}
+
+// Show summary perplexity numbers, similar to summary given by SRILM
+void NGramOutput::ShowPerplexity(size_t sentences, int word_cnt, int oov_cnt,
+                                 int words_skipped, double logprob) const {
+  WritePerplexity(ostrm_, sentences, word_cnt, oov_cnt, words_skipped,
+                  logprob);
 }
 
 // Calculate prob of </s> and add to accum'd prob, and update total prob
@@ -551,6 +684,18 @@ bool NGramOutput::GetOOVLabel(double *OOV_probability, std::string *OOV_symbol,
   return true;
 }
 
+// Sets OOV label and cost, and renormalizes unigram state for OOVs
+bool NGramOutput::RenormForOOVs(std::string *OOV_symbol,
+                                double OOV_class_size, double OOV_probability,
+                                Label *OOV_label, double *OOV_cost) {
+  if (!GetOOVLabel(&OOV_probability, OOV_symbol, OOV_label)) return false;
+  *OOV_cost = StdArc::Weight::Zero().Value();
+  if (OOV_probability > 0) *OOV_cost = -log(OOV_probability / OOV_class_size);
+  RenormUnigramForOOV(kSpecialLabel, *OOV_label, OOV_class_size,
+                      OOV_probability);
+  return !Error();
+}
+
 // Adds a phi loop (rho) at unigram state for OOVs
 // OOV_class_size (N) and OOV_probability (p) determine weight of loop: p/N
 // Rest of unigrams renormalized accordingly, by 1-p
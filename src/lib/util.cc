@@ -19,3 +19,12 @@
 DEFINE_bool(ngram_error_fatal, true,
             "NGram errors are fatal if true; otherwise returns objects flagged "
             "as bad: e.g., NGramModel::Error() is true");
+
+DEFINE_int32(ngram_check_threads, 1,
+             "Number of threads used to compute the state orders and "
+             "stationary state probabilities of n-gram models and to check "
+             "their topology and normalization");
+
+DEFINE_bool(trust_model, false,
+            "Trusts the FST properties stored with n-gram models and skips "
+            "checking their topology when loading them");
@@ -0,0 +1,201 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Compares the insert and lookup throughput and the memory footprint of the
+// flat (label, state) to arc ID map used by NGramCounter with those of the
+// node-based std::unordered_map it replaced.
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fst/flags.h>
+#include <fst/log.h>
+#include <ngram/flat-arc-map.h>
+#include <ngram/util.h>
+
+DECLARE_int64(num_ngrams);
+DECLARE_int64(num_lookups);
+DECLARE_double(hit_rate);
+DECLARE_int32(vocabulary);
+DECLARE_int32(seed);
+DECLARE_bool(reserve);
+
+namespace {
+
+using Pair = std::pair<ssize_t, ssize_t>;
+
+// Hash function formerly used by NGramCounter.
+struct PairHash {
+  size_t operator()(const Pair &p) const {
+    return (static_cast<size_t>(p.first) * 55697) ^
+           (static_cast<size_t>(p.second) * 54631);
+  }
+};
+
+// Allocator keeping track of the number of bytes allocated.
+template <class T>
+struct CountingAllocator {
+  using value_type = T;
+
+  explicit CountingAllocator(size_t *bytes) : bytes(bytes) {}
+
+  template <class U>
+  CountingAllocator(const CountingAllocator<U> &other)  // NOLINT
+      : bytes(other.bytes) {}
+
+  T *allocate(size_t n) {
+    *bytes += n * sizeof(T);
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t n) {
+    *bytes -= n * sizeof(T);
+    ::operator delete(p);
+  }
+
+  size_t *bytes;
+};
+
+template <class T, class U>
+bool operator==(const CountingAllocator<T> &a, const CountingAllocator<U> &b) {
+  return a.bytes == b.bytes;
+}
+
+template <class T, class U>
+bool operator!=(const CountingAllocator<T> &a, const CountingAllocator<U> &b) {
+  return !(a == b);
+}
+
+using PairArcMap =
+    std::unordered_map<Pair, size_t, PairHash, std::equal_to<Pair>,
+                       CountingAllocator<std::pair<const Pair, size_t>>>;
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start).count();
+}
+
+void Report(const std::string &name, double insert_seconds,
+            double lookup_seconds, size_t bytes, size_t checksum) {
+  std::cout << std::left << std::setw(16) << name << std::right
+            << std::fixed << std::setprecision(2) << std::setw(12)
+            << FLAGS_num_ngrams / insert_seconds / 1e6 << std::setw(12)
+            << FLAGS_num_lookups / lookup_seconds / 1e6 << std::setw(12)
+            << static_cast<double>(bytes) / FLAGS_num_ngrams << "  ("
+            << checksum << ")" << std::endl;
+}
+
+}  // namespace
+
+int ngramarcmapbench_main(int argc, char **argv) {
+  std::string usage =
+      "Benchmarks maps from (label, state) pairs to arc IDs.\n\n  Usage: ";
+  usage += argv[0];
+  usage += " [--options]\n";
+  std::set_new_handler(FailedNewHandler);
+  SET_FLAGS(usage.c_str(), &argc, &argv, true);
+
+  if (argc != 1 || FLAGS_num_ngrams <= 0 || FLAGS_num_lookups <= 0 ||
+      FLAGS_vocabulary <= 0) {
+    ShowUsage();
+    return 1;
+  }
+
+  // Draws distinct n-grams, as (label, state) pairs, with Zipfian labels and
+  // state IDs in order of creation, as they arise when counting.
+  std::mt19937_64 rng(FLAGS_seed);
+  std::vector<double> label_weights(FLAGS_vocabulary);
+  for (int l = 0; l < FLAGS_vocabulary; ++l) label_weights[l] = 1.0 / (l + 1);
+  std::discrete_distribution<int> label_dist(label_weights.begin(),
+                                             label_weights.end());
+  const ssize_t num_states = FLAGS_num_ngrams / 4 + 1;
+  std::uniform_int_distribution<ssize_t> state_dist(0, num_states - 1);
+  std::vector<Pair> ngrams;
+  ngrams.reserve(FLAGS_num_ngrams);
+  {
+    ngram::FlatArcMap seen(FLAGS_num_ngrams);
+    while (ngrams.size() < static_cast<size_t>(FLAGS_num_ngrams)) {
+      Pair ngram(label_dist(rng) + 1, state_dist(rng));
+      uint64 key = ngram::FlatArcMap::Key(ngram.first, ngram.second);
+      if (seen.Find(key) != ngram::FlatArcMap::kNoArc) continue;
+      seen.Insert(key, ngrams.size());
+      ngrams.push_back(ngram);
+    }
+  }
+  // Lookups of inserted n-grams and of n-grams with unseen states.
+  std::vector<Pair> lookups;
+  lookups.reserve(FLAGS_num_lookups);
+  std::uniform_int_distribution<size_t> ngram_dist(0, ngrams.size() - 1);
+  std::bernoulli_distribution hit_dist(FLAGS_hit_rate);
+  for (int64 i = 0; i < FLAGS_num_lookups; ++i) {
+    if (hit_dist(rng)) {
+      lookups.push_back(ngrams[ngram_dist(rng)]);
+    } else {
+      lookups.push_back(Pair(label_dist(rng) + 1, num_states + i));
+    }
+  }
+
+  std::cout << std::left << std::setw(16) << "map" << std::right
+            << std::setw(12) << "insert M/s" << std::setw(12) << "lookup M/s"
+            << std::setw(12) << "bytes/ngram" << std::endl;
+
+  {
+    size_t bytes = 0;
+    PairArcMap arc_map(0, PairHash(), std::equal_to<Pair>(),
+                       PairArcMap::allocator_type(&bytes));
+    if (FLAGS_reserve) arc_map.reserve(FLAGS_num_ngrams);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t a = 0; a < ngrams.size(); ++a) {
+      arc_map.insert(std::make_pair(ngrams[a], a));
+    }
+    double insert_seconds = Seconds(start);
+    size_t checksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (const auto &ngram : lookups) {
+      auto iter = arc_map.find(ngram);
+      if (iter != arc_map.end()) checksum += iter->second;
+    }
+    double lookup_seconds = Seconds(start);
+    Report("unordered_map", insert_seconds, lookup_seconds, bytes, checksum);
+  }
+
+  {
+    ngram::FlatArcMap arc_map(FLAGS_reserve ? FLAGS_num_ngrams : 0);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t a = 0; a < ngrams.size(); ++a) {
+      arc_map.Insert(
+          ngram::FlatArcMap::Key(ngrams[a].first, ngrams[a].second), a);
+    }
+    double insert_seconds = Seconds(start);
+    size_t checksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (const auto &ngram : lookups) {
+      uint32 arc_id =
+          arc_map.Find(ngram::FlatArcMap::Key(ngram.first, ngram.second));
+      if (arc_id != ngram::FlatArcMap::kNoArc) checksum += arc_id;
+    }
+    double lookup_seconds = Seconds(start);
+    Report("FlatArcMap", insert_seconds, lookup_seconds,
+           arc_map.MemoryUsage(), checksum);
+  }
+  return 0;
+}
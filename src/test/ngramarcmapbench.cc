@@ -0,0 +1,27 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+#include <fst/flags.h>
+
+DEFINE_int64(num_ngrams, 1000000, "Number of n-grams inserted");
+DEFINE_int64(num_lookups, 10000000, "Number of lookups");
+DEFINE_double(hit_rate, 0.9, "Fraction of lookups of existing n-grams");
+DEFINE_int32(vocabulary, 50000, "Vocabulary size");
+DEFINE_int32(seed, 1, "Randomization seed");
+DEFINE_bool(reserve, false, "Reserve space for all n-grams before inserting");
+
+int ngramarcmapbench_main(int argc, char** argv);
+int main(int argc, char** argv) {
+  return ngramarcmapbench_main(argc, argv);
+}
@@ -0,0 +1,75 @@
+#!/bin/bash
+# Tests the command line binary ngrambuild.
+
+set -eou pipefail
+
+readonly BIN="../bin"
+readonly TESTDATA="${srcdir}/testdata"
+readonly TEST_TMPDIR="${TEST_TMPDIR:-$(mktemp -d)}"
+
+compile_test_fst() {
+  fstcompile \
+    --isymbols="${TESTDATA}/${1}.sym" \
+    --osymbols="${TESTDATA}/${1}.sym" \
+    --keep_isymbols \
+    --keep_osymbols \
+    --keep_state_numbering \
+    "${TESTDATA}/${1}.txt" \
+    "${TEST_TMPDIR}/${1}.ref"
+}
+
+farcompilestrings \
+  --fst_type=compact \
+  --symbols="${TESTDATA}/earnest.sym" \
+  --keep_symbols \
+  "${TESTDATA}/earnest.txt" \
+  "${TEST_TMPDIR}/earnest.far"
+
+# Default method.
+compile_test_fst earnest.mod
+"${BIN}/ngrambuild" \
+  --order=5 \
+  --check_consistency \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.mod"
+fstequal \
+  "${TEST_TMPDIR}/earnest.mod.ref" \
+  "${TEST_TMPDIR}/earnest.mod"
+
+# Specified methods.
+for METHOD in absolute katz witten_bell kneser_ney unsmoothed; do
+  compile_test_fst "earnest-${METHOD}.mod"
+  "${BIN}/ngrambuild" \
+    --order=5 \
+    --method="${METHOD}" \
+    --check_consistency \
+    "${TEST_TMPDIR}/earnest.far" \
+    "${TEST_TMPDIR}/earnest-${METHOD}.mod"
+  fstequal \
+    "${TEST_TMPDIR}/earnest-${METHOD}.mod.ref" \
+    "${TEST_TMPDIR}/earnest-${METHOD}.mod"
+done
+
+# Building directly from text.
+"${BIN}/ngrambuild" \
+  --order=5 \
+  --input_format=text \
+  --symbols="${TESTDATA}/earnest.sym" \
+  "${TESTDATA}/earnest.txt" \
+  "${TEST_TMPDIR}/earnest.mod"
+fstequal \
+  "${TEST_TMPDIR}/earnest.mod.ref" \
+  "${TEST_TMPDIR}/earnest.mod"
+
+# Building and shrinking.
+compile_test_fst earnest-seymore.pru
+"${BIN}/ngrambuild" \
+  --order=5 \
+  --method=witten_bell \
+  --shrink_method=seymore \
+  --theta=4 \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest-seymore.pru"
+fstequal \
+  "${TEST_TMPDIR}/earnest-seymore.pru.ref" \
+  "${TEST_TMPDIR}/earnest-seymore.pru"
@@ -53,3 +53,14 @@ farcreate \
 "./ngramhisttest" \
   --ifile="${TEST_TMPDIR}/test.cnts" \
   --cfile="${TEST_TMPDIR}/hist.ref.ref"
+
+# Counting with multiple threads.
+"${BIN}/ngramcount" \
+   --order=2 \
+   --method=histograms \
+   --threads=2 \
+  "${TEST_TMPDIR}/test.far" \
+  "${TEST_TMPDIR}/test.cnts"
+"./ngramhisttest" \
+  --ifile="${TEST_TMPDIR}/test.cnts" \
+  --cfile="${TEST_TMPDIR}/hist.ref.ref"
@@ -42,6 +42,288 @@ fstequal \
   "${TEST_TMPDIR}/earnest.cnts.ref" \
   "${TEST_TMPDIR}/earnest.cnts"
 
+# Counting directly from text.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --input_format=text \
+  --symbols="${TESTDATA}/earnest.sym" \
+  "${TESTDATA}/earnest.txt" \
+  "${TEST_TMPDIR}/earnest.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest.cnts.ref" \
+  "${TEST_TMPDIR}/earnest.cnts"
+
+# Counting from a FAR of string FSTs with multiple threads.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --threads=4 \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest.cnts.ref" \
+  "${TEST_TMPDIR}/earnest.cnts"
+
+# Counting from a FAR of string FSTs, spilling counts to disk; the states
+# of the result are in lexicographic order.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --max_memory=1 \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts"
+"${BIN}/ngramsort" \
+  "${TEST_TMPDIR}/earnest.cnts.ref" \
+  "${TEST_TMPDIR}/earnest.cnts.sorted.ref"
+fstequal \
+  "${TEST_TMPDIR}/earnest.cnts.sorted.ref" \
+  "${TEST_TMPDIR}/earnest.cnts"
+
+# Spilling counts to disk with multiple threads, each shard counter
+# spilling its own runs.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --threads=3 \
+  --max_memory=1 \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest.cnts.sorted.ref" \
+  "${TEST_TMPDIR}/earnest.cnts"
+
+# Counting with the compact in-memory layout.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --compact_counts \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest.cnts.ref" \
+  "${TEST_TMPDIR}/earnest.cnts"
+
+# Counting with deferred backoff counts.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --defer_backoff_counts \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest.cnts.ref" \
+  "${TEST_TMPDIR}/earnest.cnts"
+
+# Counting with real-domain count sums.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --real_counts \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest.cnts.ref" \
+  "${TEST_TMPDIR}/earnest.cnts"
+
+# Counting in two steps, resuming from a snapshot of the counts.
+head -n 500 "${TESTDATA}/earnest.txt" > "${TEST_TMPDIR}/earnest.1.txt"
+tail -n +501 "${TESTDATA}/earnest.txt" > "${TEST_TMPDIR}/earnest.2.txt"
+"${BIN}/ngramcount" \
+  --order=5 \
+  --input_format=text \
+  --symbols="${TESTDATA}/earnest.sym" \
+  --save_snapshot="${TEST_TMPDIR}/earnest.snapshot" \
+  "${TEST_TMPDIR}/earnest.1.txt" \
+  "${TEST_TMPDIR}/earnest.cnts"
+"${BIN}/ngramcount" \
+  --order=5 \
+  --input_format=text \
+  --symbols="${TESTDATA}/earnest.sym" \
+  --resume_from="${TEST_TMPDIR}/earnest.snapshot" \
+  "${TEST_TMPDIR}/earnest.2.txt" \
+  "${TEST_TMPDIR}/earnest.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest.cnts.ref" \
+  "${TEST_TMPDIR}/earnest.cnts"
+
+# Resuming is rejected with a symbol table giving other words to the labels
+# of the snapshot, whose counts would then be for the wrong words.
+awk 'NR == 2 { $1 = "ROOM" } NR == 3 { $1 = "MORNING" } { print }' \
+  "${TESTDATA}/earnest.sym" > "${TEST_TMPDIR}/earnest-swapped.sym"
+if "${BIN}/ngramcount" \
+  --order=5 \
+  --input_format=text \
+  --symbols="${TEST_TMPDIR}/earnest-swapped.sym" \
+  --resume_from="${TEST_TMPDIR}/earnest.snapshot" \
+  "${TEST_TMPDIR}/earnest.2.txt" \
+  "${TEST_TMPDIR}/earnest.cnts"; then
+  echo "ngramcount: snapshot resumed with another symbol table" >&2
+  exit 1
+fi
+
+# Resuming with --add_to_symbol_unigram_count, which must only add the
+# symbol counts once, as counting in a single step does.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --input_format=text \
+  --symbols="${TESTDATA}/earnest.sym" \
+  --add_to_symbol_unigram_count=0.5 \
+  "${TESTDATA}/earnest.txt" \
+  "${TEST_TMPDIR}/earnest-add.cnts.ref"
+"${BIN}/ngramcount" \
+  --order=5 \
+  --input_format=text \
+  --symbols="${TESTDATA}/earnest.sym" \
+  --add_to_symbol_unigram_count=0.5 \
+  --save_snapshot="${TEST_TMPDIR}/earnest.snapshot" \
+  "${TEST_TMPDIR}/earnest.1.txt" \
+  "${TEST_TMPDIR}/earnest-add.cnts"
+"${BIN}/ngramcount" \
+  --order=5 \
+  --input_format=text \
+  --symbols="${TESTDATA}/earnest.sym" \
+  --add_to_symbol_unigram_count=0.5 \
+  --resume_from="${TEST_TMPDIR}/earnest.snapshot" \
+  "${TEST_TMPDIR}/earnest.2.txt" \
+  "${TEST_TMPDIR}/earnest-add.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest-add.cnts.ref" \
+  "${TEST_TMPDIR}/earnest-add.cnts"
+
+# Counting with a suffix array; the states of the result are in
+# lexicographic order.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --suffix_array \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest.cnts.sorted.ref" \
+  "${TEST_TMPDIR}/earnest.cnts"
+
+# Counting with minimum counts keeps the n-grams, and their counts, that
+# count pruning keeps. As the counter also keeps the states of the n-grams
+# that pruning empties, both are pruned and sorted before comparing.
+"${BIN}/ngramshrink" \
+  --method=count_prune \
+  --count_pattern=3+:2 \
+  "${TEST_TMPDIR}/earnest.cnts.ref" \
+  "${TEST_TMPDIR}/earnest.pru"
+"${BIN}/ngramsort" \
+  "${TEST_TMPDIR}/earnest.pru" \
+  "${TEST_TMPDIR}/earnest.pru.ref"
+"${BIN}/ngramcount" \
+  --order=5 \
+  --min_counts=1,1,2 \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts"
+"${BIN}/ngramshrink" \
+  --method=count_prune \
+  --count_pattern=3+:2 \
+  "${TEST_TMPDIR}/earnest.cnts" \
+  "${TEST_TMPDIR}/earnest.pru"
+"${BIN}/ngramsort" \
+  "${TEST_TMPDIR}/earnest.pru" \
+  "${TEST_TMPDIR}/earnest.pru.sorted"
+fstequal \
+  "${TEST_TMPDIR}/earnest.pru.ref" \
+  "${TEST_TMPDIR}/earnest.pru.sorted"
+
+# With multiple threads, whose shard counters would each only see part of
+# the occurrences of an n-gram, all n-grams are counted and the result is
+# count pruned.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --min_counts=1,1,2 \
+  --threads=2 \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.pru"
+"${BIN}/ngramsort" \
+  "${TEST_TMPDIR}/earnest.pru" \
+  "${TEST_TMPDIR}/earnest.pru.sorted"
+fstequal \
+  "${TEST_TMPDIR}/earnest.pru.ref" \
+  "${TEST_TMPDIR}/earnest.pru.sorted"
+
+# Counting to strings, each line holding the reversed context, the word and
+# the negated log count; once converted to n-grams with integer counts,
+# these are those printed by ngramprint, but for <s>.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --output_fst=false \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts.str"
+grep -v "^<s>	" "${TESTDATA}/earnest.cnt.print" |
+  awk -F'\t' '{ printf "%s\t%d\n", $1, $2 + 0.5 }' |
+  LC_ALL=C sort > "${TEST_TMPDIR}/earnest.cnt.print.ref"
+awk -F'\t' '{
+  n = split($1, words, " ");
+  ngram = "";
+  for (i = n - 1; i >= 1; --i) ngram = ngram words[i] " ";
+  printf "%s%s\t%d\n", ngram, words[n], exp(-$2) + 0.5;
+}' "${TEST_TMPDIR}/earnest.cnts.str" |
+  LC_ALL=C sort > "${TEST_TMPDIR}/earnest.cnt.print"
+cmp "${TEST_TMPDIR}/earnest.cnt.print.ref" "${TEST_TMPDIR}/earnest.cnt.print"
+
+# Counting to strings with multiple threads.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --output_fst=false \
+  --threads=2 \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts.str2"
+cmp "${TEST_TMPDIR}/earnest.cnts.str" "${TEST_TMPDIR}/earnest.cnts.str2"
+
+# Counting with a restricted vocabulary, mapping other words to <unk>, as
+# counting text with that vocabulary as symbol table does.
+head -n 1001 "${TESTDATA}/earnest.sym" > "${TEST_TMPDIR}/vocab.sym"
+echo "<unk> 1001" >> "${TEST_TMPDIR}/vocab.sym"
+"${BIN}/ngramcount" \
+  --order=5 \
+  --input_format=text \
+  --symbols="${TEST_TMPDIR}/vocab.sym" \
+  --OOV_symbol="<unk>" \
+  "${TESTDATA}/earnest.txt" \
+  "${TEST_TMPDIR}/earnest-vocab.cnts.ref"
+"${BIN}/ngramcount" \
+  --order=5 \
+  --vocab="${TEST_TMPDIR}/vocab.sym" \
+  --OOV_symbol="<unk>" \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest-vocab.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest-vocab.cnts.ref" \
+  "${TEST_TMPDIR}/earnest-vocab.cnts"
+
+# A vocabulary is rejected without an OOV symbol, which would leave no label
+# for the words not in it.
+if "${BIN}/ngramcount" \
+  --order=5 \
+  --vocab="${TEST_TMPDIR}/vocab.sym" \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest-vocab.cnts"; then
+  echo "ngramcount: --vocab accepted without --OOV_symbol" >&2
+  exit 1
+fi
+
+# Counting to strings with a restricted vocabulary, with one or more
+# threads, as counting text with that vocabulary does.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --output_fst=false \
+  --input_format=text \
+  --symbols="${TEST_TMPDIR}/vocab.sym" \
+  --OOV_symbol="<unk>" \
+  "${TESTDATA}/earnest.txt" \
+  "${TEST_TMPDIR}/earnest-vocab.cnts.str.ref"
+for threads in 1 2; do
+  "${BIN}/ngramcount" \
+    --order=5 \
+    --output_fst=false \
+    --threads="${threads}" \
+    --vocab="${TEST_TMPDIR}/vocab.sym" \
+    --OOV_symbol="<unk>" \
+    "${TEST_TMPDIR}/earnest.far" \
+    "${TEST_TMPDIR}/earnest-vocab.cnts.str"
+  cmp \
+    "${TEST_TMPDIR}/earnest-vocab.cnts.str.ref" \
+    "${TEST_TMPDIR}/earnest-vocab.cnts.str"
+done
+
 compile_test_far earnest.fst
 compile_test_fst earnest-fst.cnts
 # Counting from an FST representing a union of paths.
@@ -53,6 +335,18 @@ fstequal \
   "${TEST_TMPDIR}/earnest-fst.cnts.ref" \
   "${TEST_TMPDIR}/earnest.cnts"
 
+# Counting from lattices with real-domain count sums and multiple threads.
+for flags in "--real_counts" "--threads=2" "--real_counts --threads=2"; do
+  "${BIN}/ngramcount" \
+    --order=5 \
+    ${flags} \
+    "${TEST_TMPDIR}/earnest.fst.far" \
+    "${TEST_TMPDIR}/earnest.cnts"
+  fstequal \
+    "${TEST_TMPDIR}/earnest-fst.cnts.ref" \
+    "${TEST_TMPDIR}/earnest.cnts"
+done
+
 compile_test_far earnest.det
 compile_test_fst earnest-det.cnts
 # Counting from the deterministic "tree" FST representing the corpus.
@@ -64,6 +358,17 @@ fstequal \
   "${TEST_TMPDIR}/earnest-det.cnts.ref" \
   "${TEST_TMPDIR}/earnest-det.cnts"
 
+for flags in "--real_counts" "--threads=2" "--real_counts --threads=2"; do
+  "${BIN}/ngramcount" \
+    --order=5 \
+    ${flags} \
+    "${TEST_TMPDIR}/earnest.det.far" \
+    "${TEST_TMPDIR}/earnest-det.cnts"
+  fstequal \
+    "${TEST_TMPDIR}/earnest-det.cnts.ref" \
+    "${TEST_TMPDIR}/earnest-det.cnts"
+done
+
 compile_test_far earnest.min
 compile_test_fst earnest-min.cnts
 # Counting from the minimal deterministic FST representing the corpus.
@@ -84,3 +389,31 @@ compile_test_fst earnest.cnt_of_cnts
 fstequal \
   "${TEST_TMPDIR}/earnest.cnt_of_cnts.ref" \
   "${TEST_TMPDIR}/earnest.cnt_of_cnts"
+
+# Count-of-counts computed while counting.
+"${BIN}/ngramcount" \
+  --order=5 \
+  --count_of_counts="${TEST_TMPDIR}/earnest.cnt_of_cnts" \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest.cnt_of_cnts.ref" \
+  "${TEST_TMPDIR}/earnest.cnt_of_cnts"
+
+# Count-of-counts restricted to a context, computed while counting and from
+# the counts.
+"${BIN}/ngramcount" \
+  --method=count_of_counts \
+  --order=5 \
+  --context_pattern="23 44 : 23 300" \
+  "${TEST_TMPDIR}/earnest.cnts.ref" \
+  "${TEST_TMPDIR}/earnest.context.cnt_of_cnts.ref"
+"${BIN}/ngramcount" \
+  --order=5 \
+  --context_pattern="23 44 : 23 300" \
+  --count_of_counts="${TEST_TMPDIR}/earnest.context.cnt_of_cnts" \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.cnts"
+fstequal \
+  "${TEST_TMPDIR}/earnest.context.cnt_of_cnts.ref" \
+  "${TEST_TMPDIR}/earnest.context.cnt_of_cnts"
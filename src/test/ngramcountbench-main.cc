@@ -0,0 +1,153 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Compares the per-token counting time of NGramCounter when the counts of
+// all backoff n-grams are updated at each position with that when they are
+// derived after counting, and when counts are summed in the log semiring with
+// that when they are summed as plain numbers, on the strings of a FAR or on
+// synthetic sentences.
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fst/extensions/far/far.h>
+#include <fst/flags.h>
+#include <fst/log.h>
+#include <ngram/ngram-count.h>
+#include <ngram/util.h>
+
+DECLARE_int64(order);
+DECLARE_int64(num_sentences);
+DECLARE_int32(sentence_length);
+DECLARE_int32(vocabulary);
+DECLARE_int32(seed);
+DECLARE_int32(repeat);
+
+namespace {
+
+using Sentence = std::vector<int32>;
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start).count();
+}
+
+// Reads the label sequences of the string FSTs in the FAR.
+bool ReadSentences(const std::string &far_name,
+                   std::vector<Sentence> *sentences) {
+  std::unique_ptr<fst::FarReader<fst::StdArc>> far_reader(
+      fst::FarReader<fst::StdArc>::Open(far_name));
+  if (!far_reader) {
+    LOG(ERROR) << "Unable to open FAR: " << far_name;
+    return false;
+  }
+  for (; !far_reader->Done(); far_reader->Next()) {
+    const fst::StdFst &fst = *far_reader->GetFst();
+    if (!fst.Properties(fst::kString, true)) {
+      LOG(ERROR) << "FST " << far_reader->GetKey() << " is not a string";
+      return false;
+    }
+    sentences->emplace_back();
+    auto s = fst.Start();
+    while (s != fst::kNoStateId && fst.Final(s) == fst::StdArc::Weight::Zero()) {
+      fst::ArcIterator<fst::StdFst> aiter(fst, s);
+      sentences->back().push_back(aiter.Value().ilabel);
+      s = aiter.Value().nextstate;
+    }
+  }
+  return true;
+}
+
+// Draws sentences of geometrically distributed length with Zipfian labels.
+void DrawSentences(std::vector<Sentence> *sentences) {
+  std::mt19937_64 rng(FLAGS_seed);
+  std::vector<double> label_weights(FLAGS_vocabulary);
+  for (int l = 0; l < FLAGS_vocabulary; ++l) label_weights[l] = 1.0 / (l + 1);
+  std::discrete_distribution<int32> label_dist(label_weights.begin(),
+                                               label_weights.end());
+  std::geometric_distribution<int> length_dist(1.0 / FLAGS_sentence_length);
+  for (int64 i = 0; i < FLAGS_num_sentences; ++i) {
+    sentences->emplace_back(length_dist(rng) + 1);
+    for (auto &label : sentences->back()) label = label_dist(rng) + 1;
+  }
+}
+
+// Counts the sentences, reporting the time per token spent counting and
+// then completing the counts.
+template <class Weight>
+void Run(const std::string &name, const std::vector<Sentence> &sentences,
+         size_t num_tokens, bool defer_backoff_counts) {
+  ngram::NGramCounter<Weight> counter(
+      FLAGS_order, false, ngram::kCountDelta, defer_backoff_counts);
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < FLAGS_repeat; ++r) {
+    for (const auto &sentence : sentences)
+      counter.CountLabels(sentence.data(), sentence.size());
+  }
+  double count_seconds = Seconds(start);
+  start = std::chrono::steady_clock::now();
+  counter.PropagateCounts();
+  double propagate_seconds = Seconds(start);
+  std::cout << std::left << std::setw(16) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12)
+            << count_seconds / num_tokens * 1e9 << std::setw(14)
+            << propagate_seconds / num_tokens * 1e9 << std::setw(12)
+            << (count_seconds + propagate_seconds) / num_tokens * 1e9
+            << std::setw(12) << counter.GetSize() << std::endl;
+}
+
+}  // namespace
+
+int ngramcountbench_main(int argc, char **argv) {
+  std::string usage =
+      "Benchmarks deferred and real-domain n-gram counting.\n\n  Usage: ";
+  usage += argv[0];
+  usage += " [--options] [in.far]\n";
+  std::set_new_handler(FailedNewHandler);
+  SET_FLAGS(usage.c_str(), &argc, &argv, true);
+
+  if (argc > 2 || FLAGS_order <= 0 || FLAGS_order > 255 ||
+      FLAGS_num_sentences <= 0 || FLAGS_sentence_length <= 0 ||
+      FLAGS_vocabulary <= 0 || FLAGS_repeat <= 0) {
+    ShowUsage();
+    return 1;
+  }
+
+  std::vector<Sentence> sentences;
+  if (argc == 2) {
+    if (!ReadSentences(argv[1], &sentences)) return 1;
+  } else {
+    DrawSentences(&sentences);
+  }
+  size_t num_tokens = 0;
+  for (const auto &sentence : sentences) num_tokens += sentence.size() + 1;
+  num_tokens *= FLAGS_repeat;
+  std::cout << sentences.size() << " sentences counted " << FLAGS_repeat
+            << " times, " << num_tokens
+            << " tokens (including </s>), order " << FLAGS_order << std::endl;
+
+  std::cout << std::left << std::setw(16) << "counts" << std::right
+            << std::setw(12) << "count ns" << std::setw(14) << "propagate ns"
+            << std::setw(12) << "total ns" << std::setw(12) << "size"
+            << std::endl;
+  Run<fst::Log64Weight>("log", sentences, num_tokens, false);
+  Run<fst::Log64Weight>("log deferred", sentences, num_tokens, true);
+  Run<ngram::RealCountWeight>("real", sentences, num_tokens, false);
+  Run<ngram::RealCountWeight>("real deferred", sentences, num_tokens, true);
+  return 0;
+}
@@ -0,0 +1,27 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include <fst/flags.h>
+
+DEFINE_int64(order, 5, "Maximal order of n-grams counted");
+DEFINE_int64(num_sentences, 200000,
+             "Number of synthetic sentences, when no input FAR is given");
+DEFINE_int32(sentence_length, 20, "Mean length of synthetic sentences");
+DEFINE_int32(vocabulary, 20000, "Vocabulary size of synthetic sentences");
+DEFINE_int32(seed, 1, "Randomization seed");
+DEFINE_int32(repeat, 1, "Number of times the sentences are counted");
+
+int ngramcountbench_main(int argc, char** argv);
+int main(int argc, char** argv) {
+  return ngramcountbench_main(argc, argv);
+}
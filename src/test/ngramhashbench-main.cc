@@ -0,0 +1,256 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Compares the per-token time of scoring the strings of a FAR with a model
+// by following its arcs with NGramModel::FindNGramInModel(), with the flat
+// copy of the model used by ngramperplexity, one sentence at a time or in
+// batches with NGramFlatModel::ScoreSentences(), and by probing the hash
+// tables of NGramHashModel with the preceding words of each word. The
+// lookups by state are also timed through an NGramLookupCache.
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fst/extensions/far/far.h>
+#include <fst/flags.h>
+#include <fst/fst.h>
+#include <fst/log.h>
+#include <ngram/ngram-flat-model.h>
+#include <ngram/ngram-hash-model.h>
+#include <ngram/ngram-lookup-cache.h>
+#include <ngram/ngram-model.h>
+#include <ngram/util.h>
+
+DECLARE_int32(repeat);
+DECLARE_int32(batch_size);
+DECLARE_int32(cache_size);
+
+namespace {
+
+using fst::StdArc;
+using Sentence = std::vector<StdArc::Label>;
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start).count();
+}
+
+// Reads the label sequences of the string FSTs in the FAR.
+bool ReadSentences(const std::string &far_name,
+                   std::vector<Sentence> *sentences) {
+  std::unique_ptr<fst::FarReader<StdArc>> far_reader(
+      fst::FarReader<StdArc>::Open(far_name));
+  if (!far_reader) {
+    LOG(ERROR) << "Unable to open FAR: " << far_name;
+    return false;
+  }
+  for (; !far_reader->Done(); far_reader->Next()) {
+    const fst::StdFst &fst = *far_reader->GetFst();
+    if (!fst.Properties(fst::kString, true)) {
+      LOG(ERROR) << "FST " << far_reader->GetKey() << " is not a string";
+      return false;
+    }
+    sentences->emplace_back();
+    auto s = fst.Start();
+    while (s != fst::kNoStateId && fst.Final(s) == StdArc::Weight::Zero()) {
+      fst::ArcIterator<fst::StdFst> aiter(fst, s);
+      sentences->back().push_back(aiter.Value().ilabel);
+      s = aiter.Value().nextstate;
+    }
+  }
+  return true;
+}
+
+// Scores the sentences by following the model from state to state, with
+// 'model' either the model, its flat copy or a cache of the lookups of
+// either, and returns their total cost, not counting OOVs.
+template <class Model>
+double ScoreByState(Model &model, StdArc::StateId start,
+                    StdArc::StateId unigram,
+                    const std::vector<Sentence> &sentences) {
+  double total = 0;
+  for (const auto &sentence : sentences) {
+    StdArc::StateId mst = start;
+    for (auto label : sentence) {
+      int order;
+      double cost;
+      if (model.FindNGramInModel(&mst, &order, label, &cost)) {
+        total += cost;
+      } else {
+        mst = unigram;
+      }
+    }
+    int order;
+    total += model.FinalCostInModel(mst, &order).Value();
+  }
+  return total;
+}
+
+// Scores the sentences with the hash tables, keeping the words since the
+// start of the sentence or the last OOV as history.
+double ScoreByHistory(const ngram::StdNGramHashModel &model,
+                      const std::vector<Sentence> &sentences) {
+  double total = 0;
+  Sentence history;
+  for (const auto &sentence : sentences) {
+    history.assign(1, 0);  // Start of sentence.
+    for (auto label : sentence) {
+      int order;
+      double cost;
+      const StdArc::Label *end = history.data() + history.size();
+      if (model.FindNGram(history.data(), end, label, &order, &cost)) {
+        total += cost;
+        history.push_back(label);
+      } else {
+        history.clear();
+      }
+    }
+    int order;
+    total += model.FinalCost(history.data(), history.data() + history.size(),
+                             &order).Value();
+  }
+  return total;
+}
+
+// Scores the batches of sentences with the flat model and returns their
+// total cost, not counting OOVs.
+double ScoreInBatches(const ngram::StdNGramFlatModel &model,
+                      const std::vector<std::vector<Sentence>> &batches) {
+  double total = 0;
+  std::vector<std::vector<ngram::StdNGramFlatModel::WordScore>> scores;
+  for (const auto &batch : batches) {
+    model.ScoreSentences(batch, &scores);
+    for (const auto &sentence_scores : scores) {
+      for (const auto &score : sentence_scores) {
+        if (score.order >= 0) total += score.cost;
+      }
+    }
+  }
+  return total;
+}
+
+void Report(const std::string &name, double seconds, size_t num_tokens,
+            double build_seconds, double total) {
+  std::cout << std::left << std::setw(16) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12)
+            << seconds / num_tokens * 1e9 << std::setw(12)
+            << build_seconds * 1e3 << std::setprecision(4) << std::setw(16)
+            << total / FLAGS_repeat << std::endl;
+}
+
+template <class Score>
+double Run(const std::string &name, size_t num_tokens, double build_seconds,
+           Score score) {
+  double total = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < FLAGS_repeat; ++r) total += score();
+  Report(name, Seconds(start), num_tokens, build_seconds, total);
+  return total;
+}
+
+}  // namespace
+
+int ngramhashbench_main(int argc, char **argv) {
+  std::string usage =
+      "Benchmarks n-gram lookups by state, in batches and by hashed "
+      "history.\n\n  Usage: ";
+  usage += argv[0];
+  usage += " [--options] in.mod in.far\n";
+  std::set_new_handler(FailedNewHandler);
+  SET_FLAGS(usage.c_str(), &argc, &argv, true);
+
+  if (argc != 3 || FLAGS_repeat <= 0 || FLAGS_batch_size <= 0 ||
+      FLAGS_cache_size <= 0) {
+    ShowUsage();
+    return 1;
+  }
+
+  std::unique_ptr<fst::StdFst> fst(fst::StdFst::Read(argv[1]));
+  if (!fst) return 1;
+  std::vector<Sentence> sentences;
+  if (!ReadSentences(argv[2], &sentences)) return 1;
+  size_t num_tokens = 0;
+  for (const auto &sentence : sentences) num_tokens += sentence.size() + 1;
+  std::vector<std::vector<Sentence>> batches;
+  for (size_t i = 0; i < sentences.size(); ++i) {
+    if (i % FLAGS_batch_size == 0) batches.emplace_back();
+    batches.back().push_back(sentences[i]);
+  }
+  num_tokens *= FLAGS_repeat;
+
+  ngram::NGramModel<StdArc> model(*fst, 0, ngram::kNormEps, true);
+  if (model.Error()) return 1;
+  auto start = std::chrono::steady_clock::now();
+  ngram::StdNGramFlatModel flat_model(model);
+  const double flat_seconds = Seconds(start);
+  start = std::chrono::steady_clock::now();
+  ngram::StdNGramHashModel hash_model(model);
+  const double hash_seconds = Seconds(start);
+  if (hash_model.Error()) return 1;
+  const StdArc::StateId start_state = fst->Start();
+  const StdArc::StateId unigram =
+      model.UnigramState() >= 0 ? model.UnigramState() : start_state;
+
+  std::cout << sentences.size() << " sentences scored " << FLAGS_repeat
+            << " times, " << num_tokens << " tokens (including </s>), order "
+            << model.HiOrder() << ", " << hash_model.MemoryUsage()
+            << " bytes of hash tables" << std::endl;
+  std::cout << std::left << std::setw(16) << "lookup" << std::right
+            << std::setw(12) << "ns/token" << std::setw(12) << "build ms"
+            << std::setw(16) << "cost" << std::endl;
+  const double model_total = Run("FindNGramInModel", num_tokens, 0, [&]() {
+    return ScoreByState(model, start_state, unigram, sentences);
+  });
+  ngram::NGramLookupCache<ngram::NGramModel<StdArc>> model_cache(
+      model, FLAGS_cache_size);
+  const double model_cache_total =
+      Run("  cached", num_tokens, 0, [&]() {
+        return ScoreByState(model_cache, start_state, unigram, sentences);
+      });
+  const double flat_total =
+      Run("NGramFlatModel", num_tokens, flat_seconds, [&]() {
+        return ScoreByState(flat_model, start_state, unigram, sentences);
+      });
+  ngram::NGramLookupCache<ngram::StdNGramFlatModel> flat_cache(
+      flat_model, FLAGS_cache_size);
+  const double flat_cache_total =
+      Run("  cached", num_tokens, flat_seconds, [&]() {
+        return ScoreByState(flat_cache, start_state, unigram, sentences);
+      });
+  const double batch_total =
+      Run("ScoreSentences", num_tokens, flat_seconds, [&]() {
+        return ScoreInBatches(flat_model, batches);
+      });
+  const double hash_total =
+      Run("NGramHashModel", num_tokens, hash_seconds,
+          [&]() { return ScoreByHistory(hash_model, sentences); });
+  std::cout << "Lookup cache of " << model_cache.Size()
+            << " entries, over all repeats: hit rate "
+            << std::setprecision(3) << model_cache.HitRate() << " ("
+            << model_cache.Hits() << " hits, " << model_cache.Misses()
+            << " misses)" << std::endl;
+  for (double total : {model_cache_total, flat_total, flat_cache_total,
+                       batch_total, hash_total}) {
+    if (std::fabs(total - model_total) > 1e-6 * std::fabs(model_total)) {
+      LOG(ERROR) << "Costs differ: " << model_total << " " << total;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,24 @@
+
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+#include <fst/flags.h>
+
+DEFINE_int32(repeat, 10, "Number of times the sentences are scored");
+DEFINE_int32(batch_size, 64, "Number of sentences scored together in batches");
+DEFINE_int32(cache_size, 1 << 16, "Number of entries of the lookup caches");
+
+int ngramhashbench_main(int argc, char** argv);
+int main(int argc, char** argv) {
+  return ngramhashbench_main(argc, argv);
+}
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Tests the benchmark ngramhashbench, which fails if its lookups don't all
+# give the costs of the model.
+
+set -eou pipefail
+
+readonly TESTDATA="${srcdir}/testdata"
+readonly TEST_TMPDIR="${TEST_TMPDIR:-$(mktemp -d)}"
+
+fstcompile \
+  --isymbols="${TESTDATA}/earnest.mod.sym" \
+  --osymbols="${TESTDATA}/earnest.mod.sym" \
+  --keep_isymbols \
+  --keep_osymbols \
+  --keep_state_numbering \
+  "${TESTDATA}/earnest.mod.txt" \
+  "${TEST_TMPDIR}/earnest.mod"
+
+farcompilestrings \
+  --fst_type=compact \
+  --symbols="${TESTDATA}/earnest.sym" \
+  --keep_symbols \
+  "${TESTDATA}/earnest.txt" \
+  "${TEST_TMPDIR}/earnest.far"
+
+"./ngramhashbench" \
+  --repeat=1 \
+  "${TEST_TMPDIR}/earnest.mod" \
+  "${TEST_TMPDIR}/earnest.far"
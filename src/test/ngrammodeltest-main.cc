@@ -0,0 +1,367 @@
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+// Checks results of the NGramModel library against reference results
+// computed from the model by following its arcs one label at a time:
+// the stationary state probs must be left unchanged by a step of the
+// Markov chain whose transitions are given by FindNGramInModel() and
+// FinalCostInModel(), lookups through an NGramLookupCache must give the
+// results of the model, and, given the strings of a FAR, the scores of
+// NGramFlatModel::ScoreSentences() must be those of scoring each sentence
+// alone with these.
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <fst/extensions/far/far.h>
+#include <fst/flags.h>
+#include <fst/fst.h>
+#include <fst/log.h>
+#include <ngram/ngram-flat-model.h>
+#include <ngram/ngram-lookup-cache.h>
+#include <ngram/ngram-model.h>
+#include <ngram/util.h>
+
+DECLARE_double(converge_eps);
+DECLARE_double(tolerance);
+DECLARE_string(state_probs);
+
+namespace {
+
+using fst::StdArc;
+using Model = ngram::NGramModel<StdArc>;
+using LookupCache = ngram::NGramLookupCache<Model>;
+using Sentence = std::vector<StdArc::Label>;
+using WordScore = ngram::StdNGramFlatModel::WordScore;
+
+bool Near(double x, double y) {
+  return std::fabs(x - y) <= FLAGS_tolerance * std::max(std::fabs(x),
+                                                        std::fabs(y));
+}
+
+// Returns the labels of the arcs of the model, other than backoff arcs.
+std::vector<StdArc::Label> Vocabulary(const Model &model) {
+  const fst::StdFst &fst = model.GetFst();
+  std::set<StdArc::Label> labels;
+  for (StdArc::StateId st = 0; st < model.NumStates(); ++st) {
+    for (fst::ArcIterator<fst::StdFst> aiter(fst, st); !aiter.Done();
+         aiter.Next()) {
+      if (aiter.Value().ilabel != model.BackoffLabel())
+        labels.insert(aiter.Value().ilabel);
+    }
+  }
+  return std::vector<StdArc::Label>(labels.begin(), labels.end());
+}
+
+// Writes the state probs to 'filename', one per line, exactly.
+bool WriteStateProbs(const std::vector<double> &probs,
+                     const std::string &filename) {
+  std::ofstream strm(filename);
+  strm << std::setprecision(std::numeric_limits<double>::max_digits10);
+  for (double prob : probs) strm << prob << "\n";
+  if (!strm) {
+    LOG(ERROR) << "Unable to write state probs: " << filename;
+    return false;
+  }
+  return true;
+}
+
+// Checks that the stationary state probs are a fixed point of the chain
+// reading each word of the vocabulary from each state, with the end of
+// sentence returning to the start state with the re-entry probability of
+// the solver. They are also written to --state_probs if given.
+bool CheckStationaryStateProbs(const Model &model) {
+  const double kAlpha = .999999;  // As in NGramModel::CalculateStateProbs().
+  std::vector<double> probs;
+  if (!model.CalculateStateProbs(&probs, true)) {
+    LOG(ERROR) << "Stationary state probs did not converge";
+    return false;
+  }
+  if (!FLAGS_state_probs.empty() &&
+      !WriteStateProbs(probs, FLAGS_state_probs)) {
+    return false;
+  }
+  const std::vector<StdArc::Label> vocabulary = Vocabulary(model);
+  std::vector<double> next_probs(probs.size(), 0.0);
+  for (StdArc::StateId st = 0; st < model.NumStates(); ++st) {
+    for (StdArc::Label label : vocabulary) {
+      StdArc::StateId mst = st;
+      int order;
+      double cost;
+      if (model.FindNGramInModel(&mst, &order, label, &cost))
+        next_probs[mst] += probs[st] * std::exp(-cost);
+    }
+    int order;
+    next_probs[model.GetFst().Start()] +=
+        probs[st] * kAlpha *
+        std::exp(-model.FinalCostInModel(st, &order).Value());
+  }
+  for (size_t st = 0; st < probs.size(); ++st) {
+    if (!Near(probs[st], next_probs[st])) {
+      LOG(ERROR) << "Stationary prob of state " << st << " is " << probs[st]
+                 << ", and " << next_probs[st] << " after one step";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Looks up 'label' from state 'st' through the cache and in the model,
+// returning false if the results differ.
+bool CheckLookup(const Model &model, LookupCache *cache, StdArc::StateId st,
+                 StdArc::Label label) {
+  StdArc::StateId mst = st;
+  StdArc::StateId cache_mst = st;
+  int order = -1;
+  int cache_order = -1;
+  double cost = 0.0;
+  double cache_cost = 0.0;
+  const bool found = model.FindNGramInModel(&mst, &order, label, &cost);
+  const bool cache_found =
+      cache->FindNGramInModel(&cache_mst, &cache_order, label, &cache_cost);
+  if (found != cache_found || mst != cache_mst || cost != cache_cost ||
+      (found && order != cache_order)) {
+    LOG(ERROR) << "NGramLookupCache: Lookup of label " << label
+               << " from state " << st << " differs from the model";
+    return false;
+  }
+  return true;
+}
+
+// Checks the hit and miss counts of the cache.
+bool CheckCounts(const LookupCache &cache, size_t hits, size_t misses) {
+  const double hit_rate =
+      hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses);
+  if (cache.Hits() != hits || cache.Misses() != misses ||
+      cache.HitRate() != hit_rate) {
+    LOG(ERROR) << "NGramLookupCache: " << cache.Hits() << " hits and "
+               << cache.Misses() << " misses, expected " << hits
+               << " hits and " << misses << " misses";
+    return false;
+  }
+  return true;
+}
+
+// Returns the labels to look up from each state: those of its arcs, a word
+// of the vocabulary reached by backing off unless at the state, and 'oov'.
+std::vector<std::vector<StdArc::Label>> LookupLabels(const Model &model,
+                                                     StdArc::Label oov) {
+  const std::vector<StdArc::Label> vocabulary = Vocabulary(model);
+  std::vector<std::vector<StdArc::Label>> labels(model.NumStates());
+  for (StdArc::StateId st = 0; st < model.NumStates(); ++st) {
+    std::set<StdArc::Label> state_labels = {oov};
+    if (!vocabulary.empty())
+      state_labels.insert(vocabulary[st % vocabulary.size()]);
+    for (fst::ArcIterator<fst::StdFst> aiter(model.GetFst(), st);
+         !aiter.Done(); aiter.Next()) {
+      if (aiter.Value().ilabel != model.BackoffLabel())
+        state_labels.insert(aiter.Value().ilabel);
+    }
+    labels[st].assign(state_labels.begin(), state_labels.end());
+  }
+  return labels;
+}
+
+// Checks lookups through caches of several sizes against the model, from
+// every state, of words found at the state, found by backing off, and not
+// in the model. Looking up a pair twice in a row hits the second time,
+// whatever the size of the cache; a cache of one entry misses on any other
+// pair.
+bool CheckLookupCache(const Model &model) {
+  const std::vector<StdArc::Label> vocabulary = Vocabulary(model);
+  const StdArc::Label oov = vocabulary.empty() ? 1 : vocabulary.back() + 1;
+  const std::vector<std::vector<StdArc::Label>> labels =
+      LookupLabels(model, oov);
+  size_t num_pairs = 0;
+  for (const auto &state_labels : labels) num_pairs += state_labels.size();
+  for (size_t size : {size_t{1}, size_t{1000}, size_t{1} << 16}) {
+    LookupCache cache(model, size);
+    if (cache.Size() < size || (cache.Size() & (cache.Size() - 1)) != 0) {
+      LOG(ERROR) << "NGramLookupCache: " << cache.Size()
+                 << " entries requested " << size;
+      return false;
+    }
+    if (!CheckCounts(cache, 0, 0)) return false;
+    for (StdArc::StateId st = 0; st < model.NumStates(); ++st) {
+      for (StdArc::Label label : labels[st]) {
+        if (!CheckLookup(model, &cache, st, label) ||
+            !CheckLookup(model, &cache, st, label)) {
+          return false;
+        }
+      }
+      // Negative labels are neither looked up nor counted.
+      if (!CheckLookup(model, &cache, st, fst::kNoLabel)) return false;
+    }
+    if (!CheckCounts(cache, num_pairs, num_pairs)) return false;
+    // Once more, the results of hits now having to survive collisions.
+    cache.ResetCounts();
+    for (StdArc::StateId st = 0; st < model.NumStates(); ++st) {
+      for (StdArc::Label label : labels[st]) {
+        if (!CheckLookup(model, &cache, st, label)) return false;
+      }
+    }
+    if (cache.Hits() + cache.Misses() != num_pairs ||
+        (cache.Size() == 1 && !CheckCounts(cache, 0, num_pairs))) {
+      LOG(ERROR) << "NGramLookupCache: " << cache.Hits() + cache.Misses()
+                 << " lookups counted of " << num_pairs;
+      return false;
+    }
+    // Resetting the counts keeps the entries, clearing the cache does not.
+    const StdArc::StateId st = model.GetFst().Start();
+    if (!CheckLookup(model, &cache, st, oov)) return false;
+    cache.ResetCounts();
+    if (!CheckCounts(cache, 0, 0) || !CheckLookup(model, &cache, st, oov) ||
+        !CheckCounts(cache, 1, 0)) {
+      return false;
+    }
+    cache.Clear();
+    if (!CheckCounts(cache, 0, 0) || !CheckLookup(model, &cache, st, oov) ||
+        !CheckLookup(model, &cache, st, oov) || !CheckCounts(cache, 1, 1)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads the label sequences of the string FSTs in the FAR.
+bool ReadSentences(const std::string &far_name,
+                   std::vector<Sentence> *sentences) {
+  std::unique_ptr<fst::FarReader<StdArc>> far_reader(
+      fst::FarReader<StdArc>::Open(far_name));
+  if (!far_reader) {
+    LOG(ERROR) << "Unable to open FAR: " << far_name;
+    return false;
+  }
+  for (; !far_reader->Done(); far_reader->Next()) {
+    const fst::StdFst &fst = *far_reader->GetFst();
+    if (!fst.Properties(fst::kString, true)) {
+      LOG(ERROR) << "FST " << far_reader->GetKey() << " is not a string";
+      return false;
+    }
+    sentences->emplace_back();
+    auto s = fst.Start();
+    while (s != fst::kNoStateId && fst.Final(s) == StdArc::Weight::Zero()) {
+      fst::ArcIterator<fst::StdFst> aiter(fst, s);
+      sentences->back().push_back(aiter.Value().ilabel);
+      s = aiter.Value().nextstate;
+    }
+  }
+  return true;
+}
+
+// Scores a sentence alone, as ScoreSentences() is documented to: a word
+// that is not in the model costs the backoff to the unigram state plus
+// 'oov_cost', has order -1, and is followed from the unigram state.
+std::vector<WordScore> ScoreSentence(const Model &model,
+                                     const Sentence &sentence,
+                                     double oov_cost) {
+  std::vector<WordScore> scores;
+  StdArc::StateId mst = model.GetFst().Start();
+  for (StdArc::Label label : sentence) {
+    int order;
+    double cost;
+    if (!model.FindNGramInModel(&mst, &order, label, &cost)) {
+      cost += oov_cost;
+      order = -1;
+      mst = model.UnigramState() >= 0 ? model.UnigramState()
+                                      : model.GetFst().Start();
+    }
+    scores.push_back(WordScore{cost, order});
+  }
+  int order;
+  const double cost = model.FinalCostInModel(mst, &order).Value();
+  scores.push_back(WordScore{cost, order});
+  return scores;
+}
+
+// Checks that scoring the sentences of the FAR, with words that are not in
+// the model and empty sentences added, in batches of several sizes, some
+// larger than the number of sentences scored at a time, gives the scores of
+// each sentence scored alone.
+bool CheckScoreSentences(const Model &model, const std::string &far_name) {
+  const double kOOVCost = 20.0;
+  std::vector<Sentence> sentences(1);  // Starts with an empty sentence.
+  if (!ReadSentences(far_name, &sentences)) return false;
+  const std::vector<StdArc::Label> vocabulary = Vocabulary(model);
+  const StdArc::Label oov = vocabulary.empty() ? 1 : vocabulary.back() + 1;
+  for (size_t i = 1; i < sentences.size(); i += 3) {
+    Sentence &sentence = sentences[i];
+    sentence.insert(sentence.begin() + sentence.size() / 2, oov);
+  }
+  for (size_t i = 2; i < sentences.size(); i += 7) sentences[i].clear();
+  sentences.back().assign(1, oov);
+  ngram::StdNGramFlatModel flat_model(model, ngram::kNoLabel, kOOVCost);
+  std::vector<std::vector<WordScore>> scores;
+  for (size_t batch_size : {size_t{1}, size_t{16}, size_t{17},
+                            sentences.size()}) {
+    for (size_t begin = 0; begin < sentences.size(); begin += batch_size) {
+      const size_t end = std::min(begin + batch_size, sentences.size());
+      const std::vector<Sentence> batch(sentences.begin() + begin,
+                                        sentences.begin() + end);
+      flat_model.ScoreSentences(batch, &scores);
+      if (scores.size() != batch.size()) {
+        LOG(ERROR) << "ScoreSentences: " << scores.size() << " results for "
+                   << batch.size() << " sentences";
+        return false;
+      }
+      for (size_t i = 0; i < batch.size(); ++i) {
+        const std::vector<WordScore> reference =
+            ScoreSentence(model, batch[i], kOOVCost);
+        bool same = scores[i].size() == reference.size();
+        for (size_t j = 0; same && j < reference.size(); ++j) {
+          same = scores[i][j].cost == reference[j].cost &&
+                 scores[i][j].order == reference[j].order;
+        }
+        if (!same) {
+          LOG(ERROR) << "ScoreSentences: Scores of sentence " << begin + i
+                     << " differ in batches of " << batch_size;
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int ngrammodeltest_main(int argc, char **argv) {
+  std::string usage =
+      "Checks n-gram model results against reference results.\n\n"
+      "  Usage: ";
+  usage += argv[0];
+  usage += " [--options] in.mod [in.far]\n";
+  std::set_new_handler(FailedNewHandler);
+  SET_FLAGS(usage.c_str(), &argc, &argv, true);
+
+  if (argc < 2 || argc > 3) {
+    ShowUsage();
+    return 1;
+  }
+
+  std::unique_ptr<fst::StdFst> fst(fst::StdFst::Read(argv[1]));
+  if (!fst) return 1;
+  Model model(*fst, 0, FLAGS_converge_eps);
+  if (model.Error()) return 1;
+  if (!CheckStationaryStateProbs(model)) return 1;
+  if (!CheckLookupCache(model)) return 1;
+  if (argc > 2 && !CheckScoreSentences(model, argv[2])) return 1;
+  return 0;
+}
@@ -0,0 +1,28 @@
+// Licensed under the Apache License, Version 2.0 (the 'License');
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an 'AS IS' BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Copyright 2005-2016 Brian Roark and Google, Inc.
+#include <string>
+
+#include <fst/flags.h>
+
+DEFINE_double(converge_eps, 1e-6,
+              "Convergence epsilon of the stationary state probs");
+DEFINE_double(tolerance, 1e-4,
+              "Relative difference allowed with the reference results");
+DEFINE_string(state_probs, "",
+              "File to write the stationary state probs to, one per line");
+
+int ngrammodeltest_main(int argc, char** argv);
+int main(int argc, char** argv) {
+  return ngrammodeltest_main(argc, argv);
+}
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Tests NGramModel library results with ngrammodeltest, which checks them
+# against results computed by following the arcs of the model.
+
+set -eou pipefail
+
+readonly BIN="../bin"
+readonly TESTDATA="${srcdir}/testdata"
+readonly TEST_TMPDIR="${TEST_TMPDIR:-$(mktemp -d)}"
+
+farcompilestrings \
+  --fst_type=compact \
+  --symbols="${TESTDATA}/earnest.sym" \
+  --keep_symbols \
+  "${TESTDATA}/earnest.txt" \
+  "${TEST_TMPDIR}/earnest.far"
+
+# A trigram model keeps the check of the stationary state probs, which
+# looks up every word from every state, short.
+"${BIN}/ngramcount" \
+  --order=3 \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.3.cnts"
+"${BIN}/ngrammake" \
+  "${TEST_TMPDIR}/earnest.3.cnts" \
+  "${TEST_TMPDIR}/earnest.3.mod"
+
+"./ngrammodeltest" "${TEST_TMPDIR}/earnest.3.mod" \
+  "${TEST_TMPDIR}/earnest.far"
+
+# The trigram states outnumber the kMinCheckStates (4096) states of a range,
+# so the solver splits them over threads: its probs must be those computed
+# by a single thread.
+"./ngrammodeltest" \
+  --ngram_check_threads=1 \
+  --state_probs="${TEST_TMPDIR}/earnest.3.probs" \
+  "${TEST_TMPDIR}/earnest.3.mod"
+"./ngrammodeltest" \
+  --ngram_check_threads=4 \
+  --state_probs="${TEST_TMPDIR}/earnest.3.threads.probs" \
+  "${TEST_TMPDIR}/earnest.3.mod"
+cmp "${TEST_TMPDIR}/earnest.3.probs" "${TEST_TMPDIR}/earnest.3.threads.probs"
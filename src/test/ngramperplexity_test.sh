@@ -36,3 +36,58 @@ compile_test_fst earnest-witten_bell.mod
 file "${TESTDATA}/earnest.perp"
 file "${TEST_TMPDIR}/earnest.perp"
 cmp "${TESTDATA}/earnest.perp" "${TEST_TMPDIR}/earnest.perp"
+
+# The same, from the model flattened into a memory-mapped file.
+"${BIN}/ngramflatten" \
+  --OOV_probability=0.01 \
+  "${TEST_TMPDIR}/earnest-witten_bell.mod.ref" \
+  "${TEST_TMPDIR}/earnest-witten_bell.flat"
+"${BIN}/ngramperplexity" \
+  "${TEST_TMPDIR}/earnest-witten_bell.flat" \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.flat.perp"
+cmp "${TESTDATA}/earnest.perp" "${TEST_TMPDIR}/earnest.flat.perp"
+
+# A flat model whose states index out of its arrays is rejected when
+# verified: here the position of the arcs of the first state is overwritten.
+cp "${TEST_TMPDIR}/earnest-witten_bell.flat" "${TEST_TMPDIR}/earnest-bad.flat"
+printf '\377\377\377\377\377\377\377\377' |
+  dd of="${TEST_TMPDIR}/earnest-bad.flat" bs=1 seek=128 conv=notrunc
+if "${BIN}/ngramperplexity" \
+  --verify_flat_model \
+  "${TEST_TMPDIR}/earnest-bad.flat" \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.bad.perp"; then
+  echo "ngramperplexity read a corrupt flat model" >&2
+  exit 1
+fi
+
+# The same, from the model quantized to 16 bits, which is enough to keep all
+# of its weights, verified when mapped.
+"${BIN}/ngramquantize" \
+  --bits=16 \
+  --OOV_probability=0.01 \
+  "${TEST_TMPDIR}/earnest-witten_bell.mod.ref" \
+  "${TEST_TMPDIR}/earnest-witten_bell.q16.flat"
+"${BIN}/ngramperplexity" \
+  --verify_flat_model \
+  "${TEST_TMPDIR}/earnest-witten_bell.q16.flat" \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.q16.perp"
+cmp "${TESTDATA}/earnest.perp" "${TEST_TMPDIR}/earnest.q16.perp"
+
+# The same, checking the model with several threads, and trusting it.
+"${BIN}/ngramperplexity" \
+  --OOV_probability=0.01 \
+  --ngram_check_threads=4 \
+  "${TEST_TMPDIR}/earnest-witten_bell.mod.ref" \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.threads.perp"
+cmp "${TESTDATA}/earnest.perp" "${TEST_TMPDIR}/earnest.threads.perp"
+"${BIN}/ngramperplexity" \
+  --OOV_probability=0.01 \
+  --trust_model \
+  "${TEST_TMPDIR}/earnest-witten_bell.mod.ref" \
+  "${TEST_TMPDIR}/earnest.far" \
+  "${TEST_TMPDIR}/earnest.trusted.perp"
+cmp "${TESTDATA}/earnest.perp" "${TEST_TMPDIR}/earnest.trusted.perp"